@@ -33,14 +33,38 @@ two modules will be linked.  Preserve this property!
     ((GifFilePrivateType*)_gif->Private)->Read(_gif,_buf,_len) : \
     fread(_buf,1,_len,((GifFilePrivateType*)_gif->Private)->File))
 
+/* copy the body of a function into each caller, where its constant
+ * arguments are folded */
+#if defined(_MSC_VER)
+#define GIF_FORCE_INLINE static __forceinline
+#else
+#define GIF_FORCE_INLINE static __inline__ __attribute__((always_inline))
+#endif
+
 static int DGifGetWord(GifFileType *GifFile, GifWord *Word);
 static int DGifSetupDecompress(GifFileType *GifFile);
 static int DGifDecompressLine(GifFileType *GifFile, GifPixelType *Line,
                               int LineLen);
-static int DGifGetPrefixChar(GifPrefixType *Prefix, int Code, int ClearCode);
+static int DGifDecompressLine2(GifFileType *GifFile, GifPixelType *Line,
+                               int LineLen);
+static int DGifDecompressLine4(GifFileType *GifFile, GifPixelType *Line,
+                               int LineLen);
+static int DGifDecompressLine8(GifFileType *GifFile, GifPixelType *Line,
+                               int LineLen);
 static int DGifDecompressInput(GifFileType *GifFile, int *Code);
-static int DGifBufferedInput(GifFileType *GifFile, GifByteType *Buf,
-                             GifByteType *NextByte);
+GIF_FORCE_INLINE int DGifLoadCodeBytes(GifFileType *GifFile,
+                                       const int RunningBits,
+                                       uint64_t *ShiftDWord, int *ShiftState);
+static int DGifFillCodeBuf(GifFileType *GifFile);
+static int DGifDecodeCodes(const GifByteType *Codes, unsigned long CodeBits,
+                           int BitsPerPixel, unsigned long MaxPixels,
+                           unsigned long MaxCodes, BOOL Output,
+                           GifCodeSegment *Segment);
+static int DGifDecodeImage(GifFileType *GifFile, SavedImage *sp);
+
+/* Codes a clear code found by DGifFindClearCode must be followed by, to be
+ * taken for one. */
+#define CLEAR_CHECK_CODES   256
 
 /******************************************************************************
  Open a new GIF file for read, given by its name.
@@ -76,7 +100,7 @@ DGifOpenFileHandle(int FileHandle, int *Error)
     GifFilePrivateType *Private;
     FILE *f;
 
-    GifFile = (GifFileType *)malloc(sizeof(GifFileType));
+    GifFile = (GifFileType *)GifMalloc(sizeof(GifFileType));
     if (GifFile == NULL) {
         if (Error != NULL)
 	    *Error = D_GIF_ERR_NOT_ENOUGH_MEM;
@@ -90,12 +114,12 @@ DGifOpenFileHandle(int FileHandle, int *Error)
     GifFile->SavedImages = NULL;
     GifFile->SColorMap = NULL;
 
-    Private = (GifFilePrivateType *)malloc(sizeof(GifFilePrivateType));
+    Private = (GifFilePrivateType *)GifMalloc(sizeof(GifFilePrivateType));
     if (Private == NULL) {
         if (Error != NULL)
 	    *Error = D_GIF_ERR_NOT_ENOUGH_MEM;
         (void)close(FileHandle);
-        free((char *)GifFile);
+        GifFree((char *)GifFile);
         return NULL;
     }
 #ifdef _WIN32
@@ -110,6 +134,8 @@ DGifOpenFileHandle(int FileHandle, int *Error)
     Private->File = f;
     Private->FileState = FILE_STATE_READ;
     Private->Read = NULL;        /* don't use alternate input method (TVT) */
+    Private->Decode = NULL;
+    Private->DecompressLine = DGifDecompressLine;
     GifFile->UserData = NULL;    /* TVT */
     /*@=mustfreeonly@*/
 
@@ -118,8 +144,8 @@ DGifOpenFileHandle(int FileHandle, int *Error)
         if (Error != NULL)
 	    *Error = D_GIF_ERR_READ_FAILED;
         (void)fclose(f);
-        free((char *)Private);
-        free((char *)GifFile);
+        GifFree((char *)Private);
+        GifFree((char *)GifFile);
         return NULL;
     }
 
@@ -129,15 +155,15 @@ DGifOpenFileHandle(int FileHandle, int *Error)
         if (Error != NULL)
 	    *Error = D_GIF_ERR_NOT_GIF_FILE;
         (void)fclose(f);
-        free((char *)Private);
-        free((char *)GifFile);
+        GifFree((char *)Private);
+        GifFree((char *)GifFile);
         return NULL;
     }
 
     if (DGifGetScreenDesc(GifFile) == GIF_ERROR) {
         (void)fclose(f);
-        free((char *)Private);
-        free((char *)GifFile);
+        GifFree((char *)Private);
+        GifFree((char *)GifFile);
         return NULL;
     }
 
@@ -159,7 +185,7 @@ DGifOpen(void *userData, InputFunc readFunc, int *Error)
     GifFileType *GifFile;
     GifFilePrivateType *Private;
 
-    GifFile = (GifFileType *)malloc(sizeof(GifFileType));
+    GifFile = (GifFileType *)GifMalloc(sizeof(GifFileType));
     if (GifFile == NULL) {
         if (Error != NULL)
 	    *Error = D_GIF_ERR_NOT_ENOUGH_MEM;
@@ -172,11 +198,11 @@ DGifOpen(void *userData, InputFunc readFunc, int *Error)
     GifFile->SavedImages = NULL;
     GifFile->SColorMap = NULL;
 
-    Private = (GifFilePrivateType *)malloc(sizeof(GifFilePrivateType));
+    Private = (GifFilePrivateType *)GifMalloc(sizeof(GifFilePrivateType));
     if (!Private) {
         if (Error != NULL)
 	    *Error = D_GIF_ERR_NOT_ENOUGH_MEM;
-        free((char *)GifFile);
+        GifFree((char *)GifFile);
         return NULL;
     }
 
@@ -186,14 +212,16 @@ DGifOpen(void *userData, InputFunc readFunc, int *Error)
     Private->FileState = FILE_STATE_READ;
 
     Private->Read = readFunc;    /* TVT */
+    Private->Decode = NULL;
+    Private->DecompressLine = DGifDecompressLine;
     GifFile->UserData = userData;    /* TVT */
 
     /* Lets see if this is a GIF file: */
     if (READ(GifFile, (unsigned char *)Buf, GIF_STAMP_LEN) != GIF_STAMP_LEN) {
         if (Error != NULL)
 	    *Error = D_GIF_ERR_READ_FAILED;
-        free((char *)Private);
-        free((char *)GifFile);
+        GifFree((char *)Private);
+        GifFree((char *)GifFile);
         return NULL;
     }
 
@@ -202,14 +230,14 @@ DGifOpen(void *userData, InputFunc readFunc, int *Error)
     if (strncmp(GIF_STAMP, Buf, GIF_VERSION_POS) != 0) {
         if (Error != NULL)
 	    *Error = D_GIF_ERR_NOT_GIF_FILE;
-        free((char *)Private);
-        free((char *)GifFile);
+        GifFree((char *)Private);
+        GifFree((char *)GifFile);
         return NULL;
     }
 
     if (DGifGetScreenDesc(GifFile) == GIF_ERROR) {
-        free((char *)Private);
-        free((char *)GifFile);
+        GifFree((char *)Private);
+        GifFree((char *)GifFile);
 	*Error = D_GIF_ERR_NO_SCRN_DSCR;
         return NULL;
     }
@@ -386,7 +414,7 @@ DGifGetImageDesc(GifFileType *GifFile)
     }
 
     if (GifFile->SavedImages) {
-        if ((GifFile->SavedImages = (SavedImage *)realloc(GifFile->SavedImages,
+        if ((GifFile->SavedImages = (SavedImage *)GifRealloc(GifFile->SavedImages,
                                       sizeof(SavedImage) *
                                       (GifFile->ImageCount + 1))) == NULL) {
             GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
@@ -394,7 +422,7 @@ DGifGetImageDesc(GifFileType *GifFile)
         }
     } else {
         if ((GifFile->SavedImages =
-             (SavedImage *) malloc(sizeof(SavedImage))) == NULL) {
+             (SavedImage *) GifMalloc(sizeof(SavedImage))) == NULL) {
             GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
             return GIF_ERROR;
         }
@@ -421,7 +449,8 @@ DGifGetImageDesc(GifFileType *GifFile)
        (long)GifFile->Image.Height;
 
     /* Reset decompress algorithm parameters. */
-    (void)DGifSetupDecompress(GifFile);
+    if (DGifSetupDecompress(GifFile) == GIF_ERROR)
+        return GIF_ERROR;
 
     return GIF_OK;
 }
@@ -449,7 +478,7 @@ DGifGetLine(GifFileType *GifFile, GifPixelType *Line, int LineLen)
         return GIF_ERROR;
     }
 
-    if (DGifDecompressLine(GifFile, Line, LineLen) == GIF_OK) {
+    if (Private->DecompressLine(GifFile, Line, LineLen) == GIF_OK) {
         if (Private->PixelCount == 0) {
             /* We probably won't be called any more, so let's clean up
              * everything before we return: need to flush out all the
@@ -486,7 +515,7 @@ DGifGetPixel(GifFileType *GifFile, GifPixelType Pixel)
         return GIF_ERROR;
     }
 
-    if (DGifDecompressLine(GifFile, &Pixel, 1) == GIF_OK) {
+    if (Private->DecompressLine(GifFile, &Pixel, 1) == GIF_OK) {
         if (Private->PixelCount == 0) {
             /* We probably won't be called any more, so let's clean up
              * everything before we return: need to flush out all the
@@ -650,14 +679,14 @@ DGifCloseFile(GifFileType *GifFile)
         return GIF_ERROR;
     }
 
-    free((char *)GifFile->Private);
+    GifFree((char *)GifFile->Private);
 
     /* 
      * Without the #ifndef, we get spurious warnings because Coverity mistakenly
      * thinks the GIF structure is freed on an error return. 
      */
 #ifndef __COVERITY__
-    free(GifFile);
+    GifFree(GifFile);
 #endif /* __COVERITY__ */
 
     return GIF_OK;
@@ -714,6 +743,13 @@ DGifGetCodeNext(GifFileType *GifFile, GifByteType **CodeBlock)
     GifByteType Buf;
     GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
 
+    if (Private->CodeBlocksEnd) {
+        /* The decoder read the empty block already, with the codes. */
+        *CodeBlock = NULL;
+        Private->PixelCount = 0;
+        return GIF_OK;
+    }
+
     /* coverity[tainted_data_argument] */
     if (READ(GifFile, &Buf, 1) != 1) {
         GifFile->Error = D_GIF_ERR_READ_FAILED;
@@ -731,7 +767,8 @@ DGifGetCodeNext(GifFileType *GifFile, GifByteType **CodeBlock)
         }
     } else {
         *CodeBlock = NULL;
-        Private->Buf[0] = 0;    /* Make sure the buffer is empty! */
+        Private->CodeBufPos = Private->CodeBufLen = 0;  /* Make sure the buffer is empty! */
+        Private->CodeBlocksEnd = TRUE;
         Private->PixelCount = 0;    /* And local info. indicate image read. */
     }
 
@@ -746,13 +783,24 @@ DGifSetupDecompress(GifFileType *GifFile)
 {
     int i, BitsPerPixel;
     GifByteType CodeSize;
-    GifPrefixType *Prefix;
+    GifDictEntry *Dict;
     GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
 
-    READ(GifFile, &CodeSize, 1);    /* Read Code size from file. */
+    /* Read Code size from file. */
+    if (READ(GifFile, &CodeSize, 1) != 1) {
+        GifFile->Error = D_GIF_ERR_READ_FAILED;
+        return GIF_ERROR;
+    }
+    /* The sizes DGifDecodeSegment accepts, larger ones would give codes
+     * longer than LZ_BITS: */
+    if (CodeSize < 1 || CodeSize > 8) {
+        GifFile->Error = D_GIF_ERR_IMAGE_DEFECT;
+        return GIF_ERROR;
+    }
     BitsPerPixel = CodeSize;
 
-    Private->Buf[0] = 0;    /* Input Buffer empty. */
+    Private->CodeBufPos = Private->CodeBufLen = 0;    /* Input Buffer empty. */
+    Private->CodeBlocksEnd = FALSE;
     Private->BitsPerPixel = BitsPerPixel;
     Private->ClearCode = (1 << BitsPerPixel);
     Private->EOFCode = Private->ClearCode + 1;
@@ -764,9 +812,30 @@ DGifSetupDecompress(GifFileType *GifFile)
     Private->CrntShiftState = 0;    /* No information in CrntShiftDWord. */
     Private->CrntShiftDWord = 0;
 
-    Prefix = Private->Prefix;
-    for (i = 0; i <= LZ_MAX_CODE; i++)
-        Prefix[i] = NO_SUCH_CODE;
+    /* The codes of 2, 4 and 8 bits pixels, the most used ones, have their
+     * own copies of the decompression routine: */
+    switch (BitsPerPixel) {
+      case 2:
+        Private->DecompressLine = DGifDecompressLine2;
+        break;
+      case 4:
+        Private->DecompressLine = DGifDecompressLine4;
+        break;
+      case 8:
+        Private->DecompressLine = DGifDecompressLine8;
+        break;
+      default:
+        Private->DecompressLine = DGifDecompressLine;
+        break;
+    }
+
+    /* The pixels are the strings of one pixel, the others are not set. */
+    Dict = Private->Dict;
+    for (i = 0; i <= LZ_MAX_CODE; i++) {
+        Dict[i].Prefix = NO_SUCH_CODE;
+        Dict[i].Length = i < Private->ClearCode ? 1 : 0;
+        Dict[i].Suffix = Dict[i].FirstPixel = (GifByteType)i;
+    }
 
     return GIF_OK;
 }
@@ -776,22 +845,34 @@ DGifSetupDecompress(GifFileType *GifFile)
  This version decompress the given GIF file into Line of length LineLen.
  This routine can be called few times (one per scan line, for example), in
  order the complete the whole image.
+ It is copied into DGifDecompressLine for any code size, and into the
+ routines for the most used code sizes, where BitsPerPixel is a constant.
+ The state of the codes is kept in locals while decoding.
 ******************************************************************************/
-static int
-DGifDecompressLine(GifFileType *GifFile, GifPixelType *Line, int LineLen)
+GIF_FORCE_INLINE int
+DGifDecompressKernel(GifFileType *GifFile, GifPixelType *Line, int LineLen,
+                     const int BitsPerPixel)
 {
-    int i = 0;
-    int j, CrntCode, EOFCode, ClearCode, CrntPrefix, LastCode, StackPtr;
-    GifByteType *Stack, *Suffix;
-    GifPrefixType *Prefix;
+    static const unsigned short CodeMasks[] = {
+	0x0000, 0x0001, 0x0003, 0x0007,
+	0x000f, 0x001f, 0x003f, 0x007f,
+	0x00ff, 0x01ff, 0x03ff, 0x07ff,
+	0x0fff
+    };
+
+    const int ClearCode = 1 << BitsPerPixel, EOFCode = ClearCode + 1;
+    int i = 0, Result = GIF_OK;
+    int j, CrntCode, CrntPrefix, LastCode, StackPtr, Len;
+    int RunningCode, RunningBits, MaxCode1, CrntShiftState;
+    uint64_t CrntShiftDWord;
+    GifByteType *Stack;
+    GifPixelType *Pixels;
+    GifDictEntry *Dict, *Entry;
     GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
 
     StackPtr = Private->StackPtr;
-    Prefix = Private->Prefix;
-    Suffix = Private->Suffix;
+    Dict = Private->Dict;
     Stack = Private->Stack;
-    EOFCode = Private->EOFCode;
-    ClearCode = Private->ClearCode;
     LastCode = Private->LastCode;
 
     if (StackPtr > LZ_MAX_CODE) {
@@ -804,24 +885,51 @@ DGifDecompressLine(GifFileType *GifFile, GifPixelType *Line, int LineLen)
             Line[i++] = Stack[--StackPtr];
     }
 
+    RunningCode = Private->RunningCode;
+    RunningBits = Private->RunningBits;
+    MaxCode1 = Private->MaxCode1;
+    CrntShiftState = Private->CrntShiftState;
+    CrntShiftDWord = Private->CrntShiftDWord;
+
     while (i < LineLen) {    /* Decode LineLen items. */
-        if (DGifDecompressInput(GifFile, &CrntCode) == GIF_ERROR)
-            return GIF_ERROR;
+        /* Read the next code, as DGifDecompressInput does: */
+        if (RunningBits > LZ_BITS) {
+            GifFile->Error = D_GIF_ERR_IMAGE_DEFECT;
+            Result = GIF_ERROR;
+            break;
+        }
+        if (CrntShiftState < RunningBits
+            && DGifLoadCodeBytes(GifFile, RunningBits, &CrntShiftDWord,
+                                 &CrntShiftState) == GIF_ERROR) {
+            Result = GIF_ERROR;
+            break;
+        }
+        CrntCode = (int)(CrntShiftDWord & CodeMasks[RunningBits]);
+        CrntShiftDWord >>= RunningBits;
+        CrntShiftState -= RunningBits;
+        if (RunningCode < LZ_MAX_CODE + 2 &&
+            ++RunningCode > MaxCode1 &&
+            RunningBits < LZ_BITS) {
+            MaxCode1 <<= 1;
+            RunningBits++;
+        }
 
         if (CrntCode == EOFCode) {
             /* Note however that usually we will not be here as we will stop
              * decoding as soon as we got all the pixel, or EOF code will
              * not be read at all, and DGifGetLine/Pixel clean everything.  */
 	    GifFile->Error = D_GIF_ERR_EOF_TOO_SOON;
-	    return GIF_ERROR;
+	    Result = GIF_ERROR;
+	    break;
         } else if (CrntCode == ClearCode) {
-            /* We need to start over again: */
-            for (j = 0; j <= LZ_MAX_CODE; j++)
-                Prefix[j] = NO_SUCH_CODE;
-            Private->RunningCode = Private->EOFCode + 1;
-            Private->RunningBits = Private->BitsPerPixel + 1;
-            Private->MaxCode1 = 1 << Private->RunningBits;
-            LastCode = Private->LastCode = NO_SUCH_CODE;
+            /* We need to start over again. Only the strings set since the
+             * last clear are there, at most up to the running code: */
+            for (j = EOFCode + 1; j <= RunningCode - 2 && j <= LZ_MAX_CODE; j++)
+                Dict[j].Length = 0;
+            RunningCode = EOFCode + 1;
+            RunningBits = BitsPerPixel + 1;
+            MaxCode1 = 1 << RunningBits;
+            LastCode = NO_SUCH_CODE;
         } else {
             /* Its regular code - if in pixel range simply add it to output
              * stream, otherwise trace to codes linked list until the prefix
@@ -830,91 +938,101 @@ DGifDecompressLine(GifFileType *GifFile, GifPixelType *Line, int LineLen)
                 /* This is simple - its pixel scalar, so add it to output: */
                 Line[i++] = CrntCode;
             } else {
-                /* Its a code to needed to be traced: trace the linked list
-                 * until the prefix is a pixel, while pushing the suffix
-                 * pixels on our stack. If we done, pop the stack in reverse
-                 * (thats what stack is good for!) order to output.  */
-                if (Prefix[CrntCode] == NO_SUCH_CODE) {
+                if (Dict[CrntCode].Length == 0) {
                     /* Only allowed if CrntCode is exactly the running code:
                      * In that case CrntCode = XXXCode, CrntCode or the
                      * prefix code is last code and the suffix char is
                      * exactly the prefix of last code! */
-                    if (CrntCode == Private->RunningCode - 2) {
-                        CrntPrefix = LastCode;
-                        Suffix[Private->RunningCode - 2] =
-                           Stack[StackPtr++] = DGifGetPrefixChar(Prefix,
-                                                                 LastCode,
-                                                                 ClearCode);
+                    if (CrntCode == RunningCode - 2
+                        && LastCode != NO_SUCH_CODE) {
+                        Entry = &Dict[CrntCode];
+                        Entry->Prefix = LastCode;
+                        Entry->Suffix = Dict[LastCode].FirstPixel;
+                        Entry->FirstPixel = Dict[LastCode].FirstPixel;
+                        Entry->Length = Dict[LastCode].Length + 1;
                     } else {
                         GifFile->Error = D_GIF_ERR_IMAGE_DEFECT;
-                        return GIF_ERROR;
+                        Result = GIF_ERROR;
+                        break;
                     }
-                } else
-                    CrntPrefix = CrntCode;
-
-                /* Now (if image is O.K.) we should not get a NO_SUCH_CODE
-                 * during the trace. As we might loop forever, in case of
-                 * defective image, we use StackPtr as loop counter and stop
-                 * before overflowing Stack[]. */
-                while (StackPtr < LZ_MAX_CODE &&
-                       CrntPrefix > ClearCode && CrntPrefix <= LZ_MAX_CODE) {
-                    Stack[StackPtr++] = Suffix[CrntPrefix];
-                    CrntPrefix = Prefix[CrntPrefix];
-                }
-                if (StackPtr >= LZ_MAX_CODE || CrntPrefix > LZ_MAX_CODE) {
-                    GifFile->Error = D_GIF_ERR_IMAGE_DEFECT;
-                    return GIF_ERROR;
                 }
-                /* Push the last character on stack: */
-                Stack[StackPtr++] = CrntPrefix;
-
-                /* Now lets pop all the stack into output: */
-                while (StackPtr != 0 && i < LineLen)
-                    Line[i++] = Stack[--StackPtr];
-            }
-            if (LastCode != NO_SUCH_CODE && Prefix[Private->RunningCode - 2] == NO_SUCH_CODE) {
-                Prefix[Private->RunningCode - 2] = LastCode;
 
-                if (CrntCode == Private->RunningCode - 2) {
-                    /* Only allowed if CrntCode is exactly the running code:
-                     * In that case CrntCode = XXXCode, CrntCode or the
-                     * prefix code is last code and the suffix char is
-                     * exactly the prefix of last code! */
-                    Suffix[Private->RunningCode - 2] =
-                       DGifGetPrefixChar(Prefix, LastCode, ClearCode);
+                /* Its a code to needed to be traced: the length of the
+                 * string is known, so its pixels are written from its end
+                 * while tracing the linked list. They go straight into Line
+                 * if the string fits, else on our stack, which is popped in
+                 * reverse (thats what stack is good for!) order to output. */
+                Len = Dict[CrntCode].Length;
+                if (Len <= LineLen - i) {
+                    Pixels = Line + i + Len;
+                    i += Len;
+                    for (CrntPrefix = CrntCode; Len > 0; Len--) {
+                        *--Pixels = Dict[CrntPrefix].Suffix;
+                        CrntPrefix = Dict[CrntPrefix].Prefix;
+                    }
                 } else {
-                    Suffix[Private->RunningCode - 2] =
-                       DGifGetPrefixChar(Prefix, CrntCode, ClearCode);
+                    for (CrntPrefix = CrntCode; Len > 0; Len--) {
+                        Stack[StackPtr++] = Dict[CrntPrefix].Suffix;
+                        CrntPrefix = Dict[CrntPrefix].Prefix;
+                    }
+                    while (StackPtr != 0 && i < LineLen)
+                        Line[i++] = Stack[--StackPtr];
                 }
             }
+            j = RunningCode - 2;
+            if (LastCode != NO_SUCH_CODE && j <= LZ_MAX_CODE
+                && Dict[j].Length == 0) {
+                /* The string of the last code followed by the first pixel
+                 * of this one: */
+                Entry = &Dict[j];
+                Entry->Prefix = LastCode;
+                Entry->Suffix = Dict[CrntCode].FirstPixel;
+                Entry->FirstPixel = Dict[LastCode].FirstPixel;
+                Entry->Length = Dict[LastCode].Length + 1;
+            }
             LastCode = CrntCode;
         }
     }
 
+    Private->RunningCode = RunningCode;
+    Private->RunningBits = RunningBits;
+    Private->MaxCode1 = MaxCode1;
+    Private->CrntShiftState = CrntShiftState;
+    Private->CrntShiftDWord = CrntShiftDWord;
     Private->LastCode = LastCode;
     Private->StackPtr = StackPtr;
 
-    return GIF_OK;
+    return Result;
 }
 
 /******************************************************************************
- Routine to trace the Prefixes linked list until we get a prefix which is
- not code, but a pixel value (less than ClearCode). Returns that pixel value.
- If image is defective, we might loop here forever, so we limit the loops to
- the maximum possible if image O.k. - LZ_MAX_CODE times.
+ The LZ decompression routine for any code size, the fallback of the ones
+ for 2, 4 and 8 bits pixels below.
 ******************************************************************************/
 static int
-DGifGetPrefixChar(GifPrefixType *Prefix, int Code, int ClearCode)
+DGifDecompressLine(GifFileType *GifFile, GifPixelType *Line, int LineLen)
 {
-    int i = 0;
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
 
-    while (Code > ClearCode && i++ <= LZ_MAX_CODE) {
-        if (Code > LZ_MAX_CODE) {
-            return NO_SUCH_CODE;
-        }
-        Code = Prefix[Code];
-    }
-    return Code;
+    return DGifDecompressKernel(GifFile, Line, LineLen, Private->BitsPerPixel);
+}
+
+static int
+DGifDecompressLine2(GifFileType *GifFile, GifPixelType *Line, int LineLen)
+{
+    return DGifDecompressKernel(GifFile, Line, LineLen, 2);
+}
+
+static int
+DGifDecompressLine4(GifFileType *GifFile, GifPixelType *Line, int LineLen)
+{
+    return DGifDecompressKernel(GifFile, Line, LineLen, 4);
+}
+
+static int
+DGifDecompressLine8(GifFileType *GifFile, GifPixelType *Line, int LineLen)
+{
+    return DGifDecompressKernel(GifFile, Line, LineLen, 8);
 }
 
 /******************************************************************************
@@ -972,24 +1090,18 @@ DGifDecompressInput(GifFileType *GifFile, int *Code)
 
     GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
 
-    GifByteType NextByte;
-
     /* The image can't contain more than LZ_BITS per code. */
     if (Private->RunningBits > LZ_BITS) {
         GifFile->Error = D_GIF_ERR_IMAGE_DEFECT;
         return GIF_ERROR;
     }
-    
-    while (Private->CrntShiftState < Private->RunningBits) {
-        /* Needs to get more bytes from input stream for next code: */
-        if (DGifBufferedInput(GifFile, Private->Buf, &NextByte) == GIF_ERROR) {
-            return GIF_ERROR;
-        }
-        Private->CrntShiftDWord |=
-	    ((unsigned long)NextByte) << Private->CrntShiftState;
-        Private->CrntShiftState += 8;
-    }
-    *Code = Private->CrntShiftDWord & CodeMasks[Private->RunningBits];
+
+    if (Private->CrntShiftState < Private->RunningBits
+        && DGifLoadCodeBytes(GifFile, Private->RunningBits,
+                             &Private->CrntShiftDWord,
+                             &Private->CrntShiftState) == GIF_ERROR)
+        return GIF_ERROR;
+    *Code = (int)(Private->CrntShiftDWord & CodeMasks[Private->RunningBits]);
 
     Private->CrntShiftDWord >>= Private->RunningBits;
     Private->CrntShiftState -= Private->RunningBits;
@@ -1009,51 +1121,364 @@ DGifDecompressInput(GifFileType *GifFile, int *Code)
 }
 
 /******************************************************************************
- This routines read one GIF data block at a time and buffers it internally
- so that the decompression routine could access it.
- The routine returns the next byte from its internal buffer (or read next
- block in if buffer empty) and returns GIF_OK if succesful.
+ This routine fills the bit stream ShiftDWord of ShiftState bits until it
+ has at least RunningBits bits. The bytes are taken several at a time from
+ the data blocks buffered by DGifFillCodeBuf.
+ Returns GIF_OK if read successfully.
 ******************************************************************************/
-static int
-DGifBufferedInput(GifFileType *GifFile, GifByteType *Buf, GifByteType *NextByte)
+GIF_FORCE_INLINE int
+DGifLoadCodeBytes(GifFileType *GifFile, const int RunningBits,
+                  uint64_t *ShiftDWord, int *ShiftState)
 {
-    if (Buf[0] == 0) {
-        /* Needs to read the next buffer - this one is empty: */
-        if (READ(GifFile, Buf, 1) != 1) {
-            GifFile->Error = D_GIF_ERR_READ_FAILED;
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+    const GifByteType *Bytes;
+    unsigned int Count, i;
+    uint64_t Word;
+
+    while (*ShiftState < RunningBits) {
+        /* Needs to get more bytes from input stream for next code: */
+        if (Private->CodeBufLen - Private->CodeBufPos < sizeof(uint64_t) &&
+            !Private->CodeBlocksEnd &&
+            DGifFillCodeBuf(GifFile) == GIF_ERROR)
             return GIF_ERROR;
-        }
         /* There shouldn't be any empty data blocks here as the LZW spec
-         * says the LZW termination code should come first.  Therefore we
-         * shouldn't be inside this routine at that point.
+         * says the LZW termination code should come first.
          */
-        if (Buf[0] == 0) {
+        if (Private->CodeBufPos == Private->CodeBufLen) {
             GifFile->Error = D_GIF_ERR_IMAGE_DEFECT;
             return GIF_ERROR;
         }
-        /* There shouldn't be any empty data blocks here as the LZW spec
-         * says the LZW termination code should come first.  Therefore we
-         * shouldn't be inside this routine at that point.
-         */
-        if (Buf[0] == 0) {
-            GifFile->Error = D_GIF_ERR_IMAGE_DEFECT;
+        /* Load as many whole bytes as the accumulator has room for. */
+        Count = (64 - *ShiftState) >> 3;
+        if (Count > Private->CodeBufLen - Private->CodeBufPos)
+            Count = Private->CodeBufLen - Private->CodeBufPos;
+        Bytes = Private->CodeBuf + Private->CodeBufPos;
+        for (Word = 0, i = Count; i > 0; i--)
+            Word = (Word << 8) | Bytes[i - 1];
+        *ShiftDWord |= Word << *ShiftState;
+        *ShiftState += Count * 8;
+        Private->CodeBufPos += Count;
+    }
+    return GIF_OK;
+}
+
+/******************************************************************************
+ This routine reads the data blocks of the codes into CodeBuf, without their
+ sizes, so that the decompression routine can take the bytes of several
+ blocks in a row. The bytes not taken yet are kept at the start of CodeBuf,
+ and as many blocks are appended as fit, up to the empty block ending the
+ codes. Returns GIF_OK if succesful.
+******************************************************************************/
+static int
+DGifFillCodeBuf(GifFileType *GifFile)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+    GifByteType Size;
+
+    Private->CodeBufLen -= Private->CodeBufPos;
+    memmove(Private->CodeBuf, Private->CodeBuf + Private->CodeBufPos,
+            Private->CodeBufLen);
+    Private->CodeBufPos = 0;
+
+    while (!Private->CodeBlocksEnd &&
+           Private->CodeBufLen + 255 <= CODE_BUF_SIZE) {
+        /* coverity[tainted_data_argument] */
+        if (READ(GifFile, &Size, 1) != 1) {
+            GifFile->Error = D_GIF_ERR_READ_FAILED;
             return GIF_ERROR;
         }
-        if (READ(GifFile, &Buf[1], Buf[0]) != Buf[0]) {
+        if (Size == 0) {
+            Private->CodeBlocksEnd = TRUE;
+            break;
+        }
+	/* coverity[tainted_data] */
+        if (READ(GifFile, Private->CodeBuf + Private->CodeBufLen, Size) != Size) {
             GifFile->Error = D_GIF_ERR_READ_FAILED;
             return GIF_ERROR;
         }
-        *NextByte = Buf[1];
-        Buf[1] = 2;    /* We use now the second place as last char read! */
-        Buf[0]--;
-    } else {
-        *NextByte = Buf[Buf[1]++];
-        Buf[0]--;
+        Private->CodeBufLen += Size;
     }
 
     return GIF_OK;
 }
 
+/******************************************************************************
+ Set the function DGifSlurp decodes the images with, from their codes
+ gathered in one buffer. This lets an image be decoded by several threads,
+ see DGifDecodeSegment.
+******************************************************************************/
+void
+DGifSetImageDecoder(GifFileType *GifFile, DecodeFunc decodeFunc)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+
+    Private->Decode = decodeFunc;
+}
+
+/******************************************************************************
+ Decode the codes of an image from bit Segment->Start, which is right after
+ a clear code or the start of the codes, up to the first clear code which
+ ends at or after bit Segment->Stop, an EOF code, or MaxPixels pixels.
+ Segment->Pixels is allocated for the pixels decoded, the caller frees it.
+ Codes has CodeBits bits, as DecodeFunc gets them.
+ A segment which starts after a clear code does not need the codes before,
+ so the segments of an image can be decoded by several threads at once.
+ The segment before another one tells if the guess of its start was good:
+ it must stop at the clear code which ends right where the other starts.
+******************************************************************************/
+int
+DGifDecodeSegment(const GifByteType *Codes, const unsigned long CodeBits,
+                  const int BitsPerPixel, const unsigned long MaxPixels,
+                  GifCodeSegment *Segment)
+{
+    return DGifDecodeCodes(Codes, CodeBits, BitsPerPixel, MaxPixels,
+                           ULONG_MAX, TRUE, Segment);
+}
+
+/******************************************************************************
+ Return the bit right after the first 12 bits clear code which starts from
+ bit From and before bit To, as sent when the string table is full, or
+ CodeBits if there is none.
+ The bits are searched one by one, so the ones of other codes may look like
+ a clear code too. Most of them are told apart by decoding a few codes
+ after them, which stops soon on a code not in the string table.
+******************************************************************************/
+unsigned long
+DGifFindClearCode(const GifByteType *Codes, const unsigned long CodeBits,
+                  const int BitsPerPixel, const unsigned long From,
+                  const unsigned long To)
+{
+    GifCodeSegment Segment;
+    unsigned long Position, Value;
+    unsigned long ClearCode = 1UL << BitsPerPixel;
+
+    for (Position = From; Position < To && Position + LZ_BITS <= CodeBits;
+         Position++) {
+        Value = Codes[Position >> 3];
+        if (((Position + LZ_BITS - 1) >> 3) > (Position >> 3))
+            Value |= (unsigned long)Codes[(Position >> 3) + 1] << 8;
+        if (((Position + LZ_BITS - 1) >> 3) > (Position >> 3) + 1)
+            Value |= (unsigned long)Codes[(Position >> 3) + 2] << 16;
+        if (((Value >> (Position & 7)) & 0xfff) != ClearCode)
+            continue;
+
+        memset(&Segment, '\0', sizeof(Segment));
+        Segment.Start = Position + LZ_BITS;
+        Segment.Stop = Segment.Start;
+        if (DGifDecodeCodes(Codes, CodeBits, BitsPerPixel, ULONG_MAX,
+                            CLEAR_CHECK_CODES, FALSE, &Segment) == GIF_OK
+            && (Segment.CodeCount >= CLEAR_CHECK_CODES
+                || Segment.End + 8 > CodeBits))
+            return Segment.Start;
+    }
+    return CodeBits;
+}
+
+/******************************************************************************
+ The decoder of DGifDecodeSegment. Each code keeps the length and the first
+ pixel of its string in the string table, so that the string is written
+ from its end straight into the pixels. Stops after MaxCodes codes, and only counts the pixels
+ unless Output.
+******************************************************************************/
+static int
+DGifDecodeCodes(const GifByteType *Codes, unsigned long CodeBits,
+                int BitsPerPixel, unsigned long MaxPixels,
+                unsigned long MaxCodes, BOOL Output, GifCodeSegment *Segment)
+{
+    GifDictEntry Dict[LZ_MAX_CODE + 1], *Entry;
+    unsigned long Position = Segment->Start, Value, Size = 0, Index, Needed;
+    int ClearCode, EOFCode, RunningCode, RunningBits, Code, LastCode, Len;
+    int Prefixed, ReadCode;
+    GifPixelType *Grown;
+
+    Segment->End = Position;
+    Segment->CodeCount = 0;
+    Segment->Pixels = NULL;
+    Segment->PixelCount = 0;
+    Segment->Finished = FALSE;
+    Segment->Error = 0;
+    if (BitsPerPixel < 1 || BitsPerPixel > 8) {
+        Segment->Error = D_GIF_ERR_IMAGE_DEFECT;
+        return GIF_ERROR;
+    }
+
+    ClearCode = 1 << BitsPerPixel;
+    EOFCode = ClearCode + 1;
+    for (Code = 0; Code < ClearCode; Code++) {
+        Dict[Code].Prefix = NO_SUCH_CODE;
+        Dict[Code].Suffix = Dict[Code].FirstPixel = (GifByteType)Code;
+        Dict[Code].Length = 1;
+    }
+    RunningCode = ReadCode = EOFCode + 1;
+    RunningBits = BitsPerPixel + 1;
+    LastCode = NO_SUCH_CODE;
+
+    for (;;) {
+        if (Position + RunningBits > CodeBits) {
+            Segment->Error = D_GIF_ERR_IMAGE_DEFECT;
+            break;
+        }
+        Index = Position >> 3;
+        Value = Codes[Index];
+        if (((Position + RunningBits - 1) >> 3) > Index)
+            Value |= (unsigned long)Codes[Index + 1] << 8;
+        if (((Position + RunningBits - 1) >> 3) > Index + 1)
+            Value |= (unsigned long)Codes[Index + 2] << 16;
+        Code = (int)((Value >> (Position & 7)) & ((1UL << RunningBits) - 1));
+        Position += RunningBits;
+
+        if (Code == ClearCode) {
+            Segment->End = Position;
+            if (Position >= Segment->Stop)
+                return GIF_OK;
+            RunningCode = ReadCode = EOFCode + 1;
+            RunningBits = BitsPerPixel + 1;
+            LastCode = NO_SUCH_CODE;
+            continue;
+        }
+        if (Code == EOFCode) {
+            Segment->End = Position;
+            Segment->Finished = TRUE;
+            return GIF_OK;
+        }
+        /* The codes get longer as in DGifDecompressKernel, which counts the
+         * first code after a clear too, so that 1 bit pixels get 3 bits
+         * codes right after it. */
+        if (ReadCode < LZ_MAX_CODE + 2 && ++ReadCode > (1 << RunningBits)
+            && RunningBits < LZ_BITS)
+            RunningBits++;
+        if (Segment->CodeCount == MaxCodes)
+            return GIF_OK;
+        Segment->CodeCount++;
+
+        if (LastCode == NO_SUCH_CODE) {
+            /* Only the pixels are in the string table after a clear. */
+            if (Code >= ClearCode) {
+                Segment->Error = D_GIF_ERR_IMAGE_DEFECT;
+                break;
+            }
+        } else if (Code <= RunningCode && Code <= LZ_MAX_CODE) {
+            /* The string of the last code and the first pixel of this one,
+             * which is the first pixel of the last one if it is new. */
+            if (RunningCode <= LZ_MAX_CODE) {
+                Entry = &Dict[RunningCode];
+                Entry->Prefix = LastCode;
+                Entry->Suffix = Dict[Code == RunningCode ? LastCode : Code].FirstPixel;
+                Entry->Length = Dict[LastCode].Length + 1;
+                Entry->FirstPixel = Dict[LastCode].FirstPixel;
+                RunningCode++;
+            }
+        } else {
+            Segment->Error = D_GIF_ERR_IMAGE_DEFECT;
+            break;
+        }
+
+        Len = Dict[Code].Length;
+        if (Output) {
+            /* The pixels past MaxPixels are dropped. */
+            Needed = Segment->PixelCount + Len;
+            if (Needed > MaxPixels)
+                Needed = MaxPixels;
+            if (Needed > Size) {
+                Size = Size * 2 > Needed ? Size * 2 : Needed + 4096;
+                if (Size > MaxPixels)
+                    Size = MaxPixels;
+                Grown = (GifPixelType *)GifRealloc(Segment->Pixels, Size);
+                if (Grown == NULL) {
+                    Segment->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+                    break;
+                }
+                Segment->Pixels = Grown;
+            }
+            Index = Segment->PixelCount + Len;
+            for (Prefixed = Code; Len > 0; Len--) {
+                if (--Index < Needed)
+                    Segment->Pixels[Index] = Dict[Prefixed].Suffix;
+                Prefixed = Dict[Prefixed].Prefix;
+            }
+        }
+        LastCode = Code;
+
+        Segment->End = Position;
+        if (Segment->PixelCount + Dict[Code].Length >= MaxPixels) {
+            Segment->PixelCount = MaxPixels;
+            Segment->Finished = TRUE;
+            return GIF_OK;
+        }
+        Segment->PixelCount += Dict[Code].Length;
+    }
+
+    return GIF_ERROR;
+}
+
+/******************************************************************************
+ Gather the codes of the image sp, whose descriptor was just read, and
+ decode them with the function set by DGifSetImageDecoder.
+******************************************************************************/
+static int
+DGifDecodeImage(GifFileType *GifFile, SavedImage *sp)
+{
+    static const int InterlacedOffset[] = { 0, 4, 2, 1 };
+    static const int InterlacedJumps[] = { 8, 8, 4, 2 };
+    GifFilePrivateType *Private = (GifFilePrivateType *)GifFile->Private;
+    unsigned long PixelCount = (unsigned long)sp->ImageDesc.Width
+                               * sp->ImageDesc.Height;
+    unsigned long Len = 0, Size = 0;
+    GifByteType *Codes = NULL, *CodeBlock, *Grown;
+    GifPixelType *Pixels = sp->RasterBits;
+    int Result = GIF_OK, i, j, Line = 0;
+
+    do {
+        if (DGifGetCodeNext(GifFile, &CodeBlock) == GIF_ERROR) {
+            GifFree((char *)Codes);
+            return GIF_ERROR;
+        }
+        if (CodeBlock != NULL) {
+            if (Len + CodeBlock[0] > Size) {
+                Size = Size * 2 + 4096;
+                Grown = (GifByteType *)GifRealloc(Codes, Size);
+                if (Grown == NULL) {
+                    GifFree((char *)Codes);
+                    GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+                    return GIF_ERROR;
+                }
+                Codes = Grown;
+            }
+            memcpy(Codes + Len, CodeBlock + 1, CodeBlock[0]);
+            Len += CodeBlock[0];
+        }
+    } while (CodeBlock != NULL);
+
+    if (PixelCount == 0) {
+        GifFree((char *)Codes);
+        return GIF_OK;
+    }
+    if (sp->ImageDesc.Interlace) {
+        Pixels = (GifPixelType *)GifMalloc(PixelCount);
+        if (Pixels == NULL) {
+            GifFree((char *)Codes);
+            GifFile->Error = D_GIF_ERR_NOT_ENOUGH_MEM;
+            return GIF_ERROR;
+        }
+    }
+
+    Result = Private->Decode(GifFile, Codes, Len * 8, Private->BitsPerPixel,
+                             Pixels, PixelCount);
+
+    if (sp->ImageDesc.Interlace) {
+        /* The rows were sent in four passes. */
+        for (i = 0; Result == GIF_OK && i < 4; i++)
+            for (j = InterlacedOffset[i]; j < sp->ImageDesc.Height;
+                 j += InterlacedJumps[i])
+                memcpy(sp->RasterBits + j * sp->ImageDesc.Width,
+                       Pixels + (Line++) * sp->ImageDesc.Width,
+                       sp->ImageDesc.Width);
+        GifFree((char *)Pixels);
+    }
+    GifFree((char *)Codes);
+    return Result;
+}
+
 /******************************************************************************
  This routine reads an entire GIF into core, hanging all its state info off
  the GifFileType pointer.  Call DGifOpenFileName() or DGifOpenFileHandle()
@@ -1091,14 +1516,18 @@ DGifSlurp(GifFileType *GifFile)
               if (ImageSize > (SIZE_MAX / sizeof(GifPixelType))) {
                   return GIF_ERROR;
               }
-              sp->RasterBits = (unsigned char *)malloc(ImageSize *
+              sp->RasterBits = (unsigned char *)GifMalloc(ImageSize *
                       sizeof(GifPixelType));
 
               if (sp->RasterBits == NULL) {
                   return GIF_ERROR;
               }
 
-	      if (sp->ImageDesc.Interlace) {
+	      if (((GifFilePrivateType *)GifFile->Private)->Decode != NULL) {
+		  if (DGifDecodeImage(GifFile, sp) == GIF_ERROR)
+		      return GIF_ERROR;
+	      }
+	      else if (sp->ImageDesc.Interlace) {
 		  int i, j;
 		   /* 
 		    * The way an interlaced image should be read - 
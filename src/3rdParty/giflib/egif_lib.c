@@ -25,6 +25,14 @@ two modules will be linked.  Preserve this property!
 #include "gif_lib.h"
 #include "gif_lib_private.h"
 
+/* Shorter strings tried by the best level, and the pixels they must gain
+ * over the longest one. */
+#define BEST_LOOKAHEAD      32
+#define BEST_MIN_GAIN       2
+/* Pixels between the checks of a full string table, when clearing on ratio
+ * drop. */
+#define RATIO_DROP_WINDOW   4096
+
 /* Masks given codes to BitsPerPixel, to make sure all codes are in range: */
 /*@+charint@*/
 static const GifPixelType CodeMask[] = {
@@ -34,11 +42,13 @@ static const GifPixelType CodeMask[] = {
 
 static int EGifPutWord(int Word, GifFileType * GifFile);
 static int EGifSetupCompress(GifFileType * GifFile);
-static int EGifCompressLine(GifFileType * GifFile, GifPixelType * Line,
+static int EGifCompressLine(GifFileType * GifFile, const GifPixelType * Line,
                             int LineLen);
 static int EGifCompressOutput(GifFileType * GifFile, int Code);
-static int EGifBufferedOutput(GifFileType * GifFile, GifByteType * Buf,
-                              int c);
+static int EGifCompressBest(GifFileType * GifFile);
+static int EGifRatioDropped(GifFilePrivateType * Private, int LinePos);
+static int EGifPackOutput(GifFileType * GifFile);
+static int EGifFlushCodeBuf(GifFileType * GifFile, const BOOL Last);
 
 /* extract bytes from an unsigned word */
 #define LOBYTE(x)	((x) & 0xff)
@@ -89,23 +99,23 @@ EGifOpenFileHandle(const int FileHandle, int *Error)
     GifFilePrivateType *Private;
     FILE *f;
 
-    GifFile = (GifFileType *) malloc(sizeof(GifFileType));
+    GifFile = (GifFileType *) GifMalloc(sizeof(GifFileType));
     if (GifFile == NULL) {
         return NULL;
     }
 
     memset(GifFile, '\0', sizeof(GifFileType));
 
-    Private = (GifFilePrivateType *)malloc(sizeof(GifFilePrivateType));
+    Private = (GifFilePrivateType *)GifMalloc(sizeof(GifFilePrivateType));
     if (Private == NULL) {
-        free(GifFile);
+        GifFree(GifFile);
         if (Error != NULL)
 	    *Error = E_GIF_ERR_NOT_ENOUGH_MEM;
         return NULL;
     }
     if ((Private->HashTable = _InitHashTable()) == NULL) {
-        free(GifFile);
-        free(Private);
+        GifFree(GifFile);
+        GifFree(Private);
         if (Error != NULL)
 	    *Error = E_GIF_ERR_NOT_ENOUGH_MEM;
         return NULL;
@@ -121,6 +131,10 @@ EGifOpenFileHandle(const int FileHandle, int *Error)
     Private->FileHandle = FileHandle;
     Private->File = f;
     Private->FileState = FILE_STATE_WRITE;
+    Private->CompressionLevel = GIF_COMPRESSION_NORMAL;
+    Private->PixelBuffer = NULL;
+    Private->ClearPolicy = GIF_CLEAR_FIXED;
+    Private->RawCodes = FALSE;
 
     Private->Write = (OutputFunc) 0;    /* No user write routine (MRB) */
     GifFile->UserData = (void *)NULL;    /* No user write handle (MRB) */
@@ -140,7 +154,7 @@ EGifOpen(void *userData, OutputFunc writeFunc, int *Error)
     GifFileType *GifFile;
     GifFilePrivateType *Private;
 
-    GifFile = (GifFileType *)malloc(sizeof(GifFileType));
+    GifFile = (GifFileType *)GifMalloc(sizeof(GifFileType));
     if (GifFile == NULL) {
         if (Error != NULL)
 	    *Error = E_GIF_ERR_NOT_ENOUGH_MEM;
@@ -149,9 +163,9 @@ EGifOpen(void *userData, OutputFunc writeFunc, int *Error)
 
     memset(GifFile, '\0', sizeof(GifFileType));
 
-    Private = (GifFilePrivateType *)malloc(sizeof(GifFilePrivateType));
+    Private = (GifFilePrivateType *)GifMalloc(sizeof(GifFilePrivateType));
     if (Private == NULL) {
-        free(GifFile);
+        GifFree(GifFile);
         if (Error != NULL)
 	    *Error = E_GIF_ERR_NOT_ENOUGH_MEM;
         return NULL;
@@ -159,8 +173,8 @@ EGifOpen(void *userData, OutputFunc writeFunc, int *Error)
 
     Private->HashTable = _InitHashTable();
     if (Private->HashTable == NULL) {
-        free (GifFile);
-        free (Private);
+        GifFree(GifFile);
+        GifFree(Private);
         if (Error != NULL)
 	    *Error = E_GIF_ERR_NOT_ENOUGH_MEM;
         return NULL;
@@ -170,6 +184,10 @@ EGifOpen(void *userData, OutputFunc writeFunc, int *Error)
     Private->FileHandle = 0;
     Private->File = (FILE *) 0;
     Private->FileState = FILE_STATE_WRITE;
+    Private->CompressionLevel = GIF_COMPRESSION_NORMAL;
+    Private->PixelBuffer = NULL;
+    Private->ClearPolicy = GIF_CLEAR_FIXED;
+    Private->RawCodes = FALSE;
 
     Private->Write = writeFunc;    /* User write routine (MRB) */
     GifFile->UserData = userData;    /* User write handle (MRB) */
@@ -238,6 +256,45 @@ void EGifSetGifVersion(GifFileType *GifFile, const BOOL gif89)
     Private->gif89 = gif89;
 }
 
+/******************************************************************************
+ Set how hard the pixels of the next images are compressed. The fastest
+ level sends each pixel as its own code and builds no string table, so the
+ output is a bit larger than the pixels themselves. The best level keeps
+ the pixels of the whole image, to parse them with lookahead.
+******************************************************************************/
+void EGifSetCompressionLevel(GifFileType *GifFile, const int Level)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+
+    Private->CompressionLevel = Level;
+}
+
+/******************************************************************************
+ Set when the normal level clears the full string table: at once, never, or
+ when the codes of the last pixels cost more bits per pixel than right after
+ the table got full. The best level tries these by itself.
+******************************************************************************/
+void EGifSetClearPolicy(GifFileType *GifFile, const int Policy)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+
+    Private->ClearPolicy = Policy;
+}
+
+/******************************************************************************
+ Return the compression ratio of the last image compressed: the number of
+ its pixels over the number of bytes of its codes.
+******************************************************************************/
+double EGifGetCompressionRatio(GifFileType *GifFile)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+    unsigned long CodeBytes = (Private->CodeBits + 7) / 8;
+
+    if (CodeBytes == 0)
+        return 0;
+    return (double)GifFile->Image.Width * GifFile->Image.Height / CodeBytes;
+}
+
 /******************************************************************************
  All writes to the GIF should go through this.
 ******************************************************************************/
@@ -376,6 +433,11 @@ EGifPutImageDesc(GifFileType *GifFile,
     GifFile->Image.Width = Width;
     GifFile->Image.Height = Height;
     GifFile->Image.Interlace = Interlace;
+    /* Free the color map of the previous image, if any. */
+    if (GifFile->Image.ColorMap) {
+        GifFreeMapObject(GifFile->Image.ColorMap);
+        GifFile->Image.ColorMap = NULL;
+    }
     if (ColorMap) {
         GifFile->Image.ColorMap = GifMakeMapObject(ColorMap->ColorCount,
                                                 ColorMap->Colors);
@@ -432,10 +494,8 @@ EGifPutImageDesc(GifFileType *GifFile,
  Put one full scanned line (Line) of length LineLen into GIF file.
 ******************************************************************************/
 int
-EGifPutLine(GifFileType * GifFile, GifPixelType *Line, int LineLen)
+EGifPutLine(GifFileType * GifFile, const GifPixelType *Line, int LineLen)
 {
-    int i;
-    GifPixelType Mask;
     GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
 
     if (!IS_WRITEABLE(Private)) {
@@ -452,12 +512,8 @@ EGifPutLine(GifFileType * GifFile, GifPixelType *Line, int LineLen)
     }
     Private->PixelCount -= LineLen;
 
-    /* Make sure the codes are not out of bit range, as we might generate
-     * wrong code (because of overflow when we combine them) in this case: */
-    Mask = CodeMask[Private->BitsPerPixel];
-    for (i = 0; i < LineLen; i++)
-        Line[i] &= Mask;
-
+    /* The codes are masked by EGifCompressLine, so that Line is left
+     * untouched and can be the caller's own buffer. */
     return EGifCompressLine(GifFile, Line, LineLen);
 }
 
@@ -488,6 +544,118 @@ EGifPutPixel(GifFileType *GifFile, GifPixelType Pixel)
     return EGifCompressLine(GifFile, &Pixel, 1);
 }
 
+/******************************************************************************
+ Compress PixelCount pixels of the current image on their own, as if the
+ string table had just been cleared, and write their codes to WriteFunc
+ without the sizes of the blocks. The codes end with a clear code, or with
+ the EOF code if Last. CodeBits is set to the number of bits of the codes,
+ the last byte written is padded with zeros.
+ GifFile is only read, so that the strips of an image can be compressed by
+ several threads at once. They are then put in order with EGifPutStrip.
+******************************************************************************/
+int
+EGifCompressStrip(GifFileType *GifFile, const GifPixelType *Pixels,
+                  const int PixelCount, const BOOL Last,
+                  void *userData, OutputFunc writeFunc,
+                  unsigned long *CodeBits, int *Error)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+    GifFilePrivateType *StripPrivate;
+    GifFileType StripFile;
+    int Result;
+
+    if (!IS_WRITEABLE(Private) || PixelCount <= 0) {
+        if (Error != NULL)
+            *Error = IS_WRITEABLE(Private) ? E_GIF_ERR_DATA_TOO_BIG
+                                           : E_GIF_ERR_NOT_WRITEABLE;
+        return GIF_ERROR;
+    }
+
+    StripPrivate = (GifFilePrivateType *)GifCalloc(1, sizeof(GifFilePrivateType));
+    if (StripPrivate == NULL) {
+        if (Error != NULL)
+            *Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+        return GIF_ERROR;
+    }
+    StripPrivate->HashTable = _InitHashTable();
+    if (StripPrivate->HashTable == NULL) {
+        GifFree((char *) StripPrivate);
+        if (Error != NULL)
+            *Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+        return GIF_ERROR;
+    }
+
+    memset(&StripFile, '\0', sizeof(GifFileType));
+    StripFile.UserData = userData;
+    StripFile.Private = (void *)StripPrivate;
+    StripPrivate->FileState = FILE_STATE_WRITE | FILE_STATE_IMAGE;
+    StripPrivate->Write = writeFunc;
+    StripPrivate->RawCodes = TRUE;
+    StripPrivate->CompressionLevel = Private->CompressionLevel;
+    StripPrivate->ClearPolicy = Private->ClearPolicy;
+    StripPrivate->BitsPerPixel = Private->BitsPerPixel;
+    StripPrivate->ClearCode = Private->ClearCode;
+    StripPrivate->EOFCode = Private->EOFCode;
+    StripPrivate->EndCode = Last ? Private->EOFCode : Private->ClearCode;
+    StripPrivate->RunningCode = Private->EOFCode + 1;
+    StripPrivate->RunningBits = Private->BitsPerPixel + 1;
+    StripPrivate->MaxCode1 = 1 << StripPrivate->RunningBits;
+    StripPrivate->CrntCode = FIRST_CODE;
+    StripPrivate->PixelCount = 0;    /* All the pixels are given at once. */
+
+    Result = EGifCompressLine(&StripFile, Pixels, PixelCount);
+    *CodeBits = StripPrivate->CodeBits;
+    if (Result == GIF_ERROR && Error != NULL)
+        *Error = StripFile.Error;
+
+    GifFree((char *) StripPrivate->HashTable);
+    GifFree((char *) StripPrivate->PixelBuffer);
+    GifFree((char *) StripPrivate);
+    return Result;
+}
+
+/******************************************************************************
+ Put the codes of a strip made by EGifCompressStrip, which has PixelCount
+ pixels of the current image. The codes are shifted in right after the ones
+ already there, bit by bit, and cut into blocks.
+******************************************************************************/
+int
+EGifPutStrip(GifFileType *GifFile, const GifByteType *Codes,
+             const unsigned long CodeBits, const int PixelCount)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+    unsigned long i;
+    int Bits;
+
+    if (!IS_WRITEABLE(Private)) {
+        /* This file was NOT open for writing: */
+        GifFile->Error = E_GIF_ERR_NOT_WRITEABLE;
+        return GIF_ERROR;
+    }
+    if (PixelCount <= 0 || Private->PixelCount < (unsigned)PixelCount) {
+        GifFile->Error = E_GIF_ERR_DATA_TOO_BIG;
+        return GIF_ERROR;
+    }
+    Private->PixelCount -= PixelCount;
+
+    for (i = 0; i * 8 < CodeBits; i++) {
+        Bits = CodeBits - i * 8 < 8 ? (int)(CodeBits - i * 8) : 8;
+        Private->CrntShiftDWord |=
+            ((uint64_t)(Codes[i] & ((1 << Bits) - 1))) << Private->CrntShiftState;
+        Private->CrntShiftState += Bits;
+        if (EGifPackOutput(GifFile) == GIF_ERROR)
+            return GIF_ERROR;
+    }
+    Private->CodeBits += CodeBits;
+
+    if (Private->PixelCount == 0
+        && EGifCompressOutput(GifFile, FLUSH_OUTPUT) == GIF_ERROR) {
+        GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
+        return GIF_ERROR;
+    }
+    return GIF_OK;
+}
+
 /******************************************************************************
  Put a comment into GIF file using the GIF89 comment extension block.
 ******************************************************************************/
@@ -781,9 +949,12 @@ EGifCloseFile(GifFileType *GifFile)
     }
     if (Private) {
         if (Private->HashTable) {
-            free((char *) Private->HashTable);
+            GifFree((char *) Private->HashTable);
+        }
+        if (Private->PixelBuffer) {
+            GifFree((char *) Private->PixelBuffer);
         }
-	    free((char *) Private);
+	    GifFree((char *) Private);
     }
 
     if (File && fclose(File) != 0) {
@@ -796,7 +967,7 @@ EGifCloseFile(GifFileType *GifFile)
      * thinks the GIF structure is freed on an error return. 
      */
 #ifndef __COVERITY__
-    free(GifFile);
+    GifFree(GifFile);
 #endif /* __COVERITY__ */
 
     return GIF_OK;
@@ -841,20 +1012,33 @@ EGifSetupCompress(GifFileType *GifFile)
     Buf = BitsPerPixel = (BitsPerPixel < 2 ? 2 : BitsPerPixel);
     InternalWrite(GifFile, &Buf, 1);    /* Write the Code size to file. */
 
-    Private->Buf[0] = 0;    /* Nothing was output yet. */
+    Private->CodeBufLen = 0;    /* Nothing was output yet. */
     Private->BitsPerPixel = BitsPerPixel;
     Private->ClearCode = (1 << BitsPerPixel);
     Private->EOFCode = Private->ClearCode + 1;
+    Private->EndCode = Private->EOFCode;
     Private->RunningCode = Private->EOFCode + 1;
     Private->RunningBits = BitsPerPixel + 1;    /* Number of bits per code. */
     Private->MaxCode1 = 1 << Private->RunningBits;    /* Max. code + 1. */
     Private->CrntCode = FIRST_CODE;    /* Signal that this is first one! */
     Private->CrntShiftState = 0;    /* No information in CrntShiftDWord. */
     Private->CrntShiftDWord = 0;
+    Private->CodeBits = 0;
+    Private->PixelsIn = 0;
+    Private->FillPixels = 0;
 
    /* Clear hash table and send Clear to make sure the decoder do the same. */
     _ClearHashTable(Private->HashTable);
 
+    /* The best level compresses the image once all of it is there. The
+     * buffer is allocated by the first line, the frames put as strips
+     * never need it. */
+    if (Private->PixelBuffer) {
+        GifFree((char *) Private->PixelBuffer);
+        Private->PixelBuffer = NULL;
+    }
+    Private->PixelBufferLen = 0;
+
     if (EGifCompressOutput(GifFile, Private->ClearCode) == GIF_ERROR) {
         GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
         return GIF_ERROR;
@@ -870,24 +1054,71 @@ EGifSetupCompress(GifFileType *GifFile)
 ******************************************************************************/
 static int
 EGifCompressLine(GifFileType *GifFile,
-                 GifPixelType *Line,
+                 const GifPixelType *Line,
                  const int LineLen)
 {
     int i = 0, CrntCode, NewCode;
     unsigned long NewKey;
-    GifPixelType Pixel;
+    GifPixelType Pixel, Mask;
     GifHashTableType *HashTable;
     GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
 
     HashTable = Private->HashTable;
 
+    /* Make sure the codes are not out of bit range, as we might generate
+     * wrong code (because of overflow when we combine them) in this case: */
+    Mask = CodeMask[Private->BitsPerPixel];
+
+    if (Private->CompressionLevel == GIF_COMPRESSION_BEST) {
+        if (Private->PixelBuffer == NULL) {
+            /* The pixels left to put, this line included. */
+            Private->PixelBuffer = (GifPixelType *)GifMalloc(Private->PixelCount + LineLen);
+            if (Private->PixelBuffer == NULL) {
+                GifFile->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+                return GIF_ERROR;
+            }
+        }
+        for (i = 0; i < LineLen; i++)
+            Private->PixelBuffer[Private->PixelBufferLen++] = Line[i] & Mask;
+        if (Private->PixelCount > 0)
+            return GIF_OK;
+        i = EGifCompressBest(GifFile);
+        GifFree((char *) Private->PixelBuffer);
+        Private->PixelBuffer = NULL;
+        return i;
+    }
+
     if (Private->CrntCode == FIRST_CODE)    /* Its first time! */
-        CrntCode = Line[i++];
+        CrntCode = Line[i++] & Mask;
     else
         CrntCode = Private->CrntCode;    /* Get last code in compression. */
 
+    if (Private->CompressionLevel == GIF_COMPRESSION_FASTEST) {
+        /* Send the pixels as literal codes. The decoder still adds a string
+         * for each of them, so a clear code is sent before the codes would
+         * need one more bit.
+         */
+        while (i < LineLen) {
+            if (EGifCompressOutput(GifFile, CrntCode) == GIF_ERROR) {
+                GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
+                return GIF_ERROR;
+            }
+            CrntCode = Line[i++] & Mask;
+            if (Private->RunningCode >= Private->MaxCode1 - 1) {
+                if (EGifCompressOutput(GifFile, Private->ClearCode)
+                        == GIF_ERROR) {
+                    GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
+                    return GIF_ERROR;
+                }
+                Private->RunningCode = Private->EOFCode + 1;
+            } else {
+                Private->RunningCode++;
+            }
+        }
+    }
+
     while (i < LineLen) {   /* Decode LineLen items. */
-        Pixel = Line[i++];  /* Get next pixel from stream. */
+        Pixel = Line[i++] & Mask;  /* Get next pixel from stream. */
         /* Form a new unique key to search hash table for the code combines 
          * CrntCode as Prefix string with Pixel as postfix char.
          */
@@ -908,9 +1139,12 @@ EGifCompressLine(GifFileType *GifFile,
             CrntCode = Pixel;
 
             /* If however the HashTable if full, we send a clear first and
-             * Clear the hash table.
+             * Clear the hash table, unless the policy keeps it.
              */
-            if (Private->RunningCode >= LZ_MAX_CODE) {
+            if (Private->RunningCode >= LZ_MAX_CODE
+                && (Private->ClearPolicy == GIF_CLEAR_FIXED
+                    || (Private->RunningCode > LZ_MAX_CODE
+                        && EGifRatioDropped(Private, i)))) {
                 /* Time to do some clearance: */
                 if (EGifCompressOutput(GifFile, Private->ClearCode)
                         == GIF_ERROR) {
@@ -921,9 +1155,15 @@ EGifCompressLine(GifFileType *GifFile,
                 Private->RunningBits = Private->BitsPerPixel + 1;
                 Private->MaxCode1 = 1 << Private->RunningBits;
                 _ClearHashTable(HashTable);
-            } else {
+                Private->FillPixels = 0;
+            } else if (Private->RunningCode <= LZ_MAX_CODE) {
                 /* Put this unique key with its relative Code in hash table: */
                 _InsertHashTable(HashTable, NewKey, Private->RunningCode++);
+                if (Private->RunningCode > LZ_MAX_CODE) {
+                    /* The table is full, its first window starts here. */
+                    Private->WindowPixels = Private->PixelsIn + i;
+                    Private->WindowBits = Private->CodeBits;
+                }
             }
         }
 
@@ -931,6 +1171,7 @@ EGifCompressLine(GifFileType *GifFile,
 
     /* Preserve the current state of the compression algorithm: */
     Private->CrntCode = CrntCode;
+    Private->PixelsIn += LineLen;
 
     if (Private->PixelCount == 0) {
         /* We are done - output last Code and flush output buffers: */
@@ -938,7 +1179,7 @@ EGifCompressLine(GifFileType *GifFile,
             GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
             return GIF_ERROR;
         }
-        if (EGifCompressOutput(GifFile, Private->EOFCode) == GIF_ERROR) {
+        if (EGifCompressOutput(GifFile, Private->EndCode) == GIF_ERROR) {
             GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
             return GIF_ERROR;
         }
@@ -951,10 +1192,234 @@ EGifCompressLine(GifFileType *GifFile,
     return GIF_OK;
 }
 
+/******************************************************************************
+ Check the full string table for the clear on ratio drop policy, once per
+ window of pixels; LinePos is the position in the line being compressed.
+ Returns TRUE if the table should be cleared: the codes of the last window
+ cost more bits per pixel than the ones of the first window after the
+ table got full.
+******************************************************************************/
+static int
+EGifRatioDropped(GifFilePrivateType *Private, int LinePos)
+{
+    unsigned long Pixels = Private->PixelsIn + LinePos - Private->WindowPixels;
+    unsigned long Bits = Private->CodeBits - Private->WindowBits;
+
+    if (Private->ClearPolicy != GIF_CLEAR_ON_RATIO_DROP
+        || Pixels < RATIO_DROP_WINDOW)
+        return FALSE;
+    if (Private->FillPixels == 0) {
+        Private->FillPixels = Pixels;
+        Private->FillBits = Bits;
+    } else if (Bits * Private->FillPixels > Private->FillBits * Pixels) {
+        return TRUE;
+    }
+    Private->WindowPixels += Pixels;
+    Private->WindowBits += Bits;
+    return FALSE;
+}
+
+/******************************************************************************
+ Return the length of the longest string of the string table which starts
+ the Len pixels, and store in Codes the codes of its first 1, 2, ... pixels
+ if Codes is not NULL.
+******************************************************************************/
+static int
+EGifMatchLength(GifHashTableType *HashTable,
+                const GifPixelType *Pixels,
+                const unsigned long Len,
+                int *Codes)
+{
+    int Code = Pixels[0], NewCode, Length = 1;
+
+    if (Codes)
+        Codes[0] = Code;
+    while ((unsigned long)Length < Len
+           && (NewCode = _ExistsHashTable(HashTable,
+                                (((uint32_t) Code) << 8) + Pixels[Length])) >= 0) {
+        Code = NewCode;
+        if (Codes)
+            Codes[Length] = Code;
+        Length++;
+    }
+    return Length;
+}
+
+/******************************************************************************
+ Parse the Len pixels into the codes of the best level, without sending
+ them, and return the number of bits they take. The strings are chosen by
+ flexible parsing: a string shorter than the longest match, by up to
+ Lookahead pixels, is taken when it lets the next string reach at least
+ MinGain pixels further. If ClearWindow is 0, a clear code is sent as soon
+ as the string table is full. Otherwise the table keeps being used, and is
+ cleared only when the codes sent for the last ClearWindow pixels cost more
+ bits per pixel than the ones sent for the first ClearWindow pixels after
+ it got full.
+******************************************************************************/
+static unsigned long
+EGifParseBest(GifFilePrivateType *Private,
+              const GifPixelType *Pixels,
+              const unsigned long Len,
+              const int Lookahead,
+              const int MinGain,
+              const unsigned long ClearWindow,
+              unsigned short *Codes,
+              unsigned long *CodeCount)
+{
+    GifHashTableType *HashTable = Private->HashTable;
+    unsigned long Pos = 0, Count = 0, Bits = 0;
+    unsigned long WindowPos = 0, WindowBits = 0, FillPixels = 0, FillBits = 0;
+    int RunningCode = Private->EOFCode + 1;
+    int RunningBits = Private->BitsPerPixel + 1;
+    int MaxCode1 = 1 << RunningBits;
+    int MatchCodes[LZ_MAX_CODE + 1];
+    int Length, Best, Score, k, Code;
+
+    _ClearHashTable(HashTable);
+    while (Pos < Len) {
+        Length = EGifMatchLength(HashTable, Pixels + Pos, Len - Pos, MatchCodes);
+
+        /* Pick a shorter string if it leads to a longer next one. */
+        Best = Length;
+        if (Lookahead > 0 && Length > 1 && Pos + Length < Len) {
+            Score = Length + MinGain
+                + EGifMatchLength(HashTable, Pixels + Pos + Length,
+                                  Len - Pos - Length, NULL);
+            for (k = Length - 1; k >= 1 && k >= Length - Lookahead; k--) {
+                int KScore = k + EGifMatchLength(HashTable, Pixels + Pos + k,
+                                                 Len - Pos - k, NULL);
+                if (KScore >= Score) {
+                    Score = KScore + 1;
+                    Best = k;
+                }
+            }
+        }
+
+        Code = MatchCodes[Best - 1];
+        Codes[Count++] = Code;
+        Bits += RunningBits;
+        if (RunningCode >= MaxCode1 && RunningBits < LZ_BITS)
+            MaxCode1 = 1 << ++RunningBits;
+        Pos += Best;
+        if (Pos >= Len)
+            break;
+
+        if (RunningCode <= LZ_MAX_CODE && (ClearWindow || RunningCode < LZ_MAX_CODE)) {
+            /* The string followed by the next pixel, as the decoder does. */
+            _InsertHashTable(HashTable, (((uint32_t) Code) << 8) + Pixels[Pos],
+                             RunningCode++);
+            if (RunningCode > LZ_MAX_CODE) {
+                WindowPos = Pos;
+                WindowBits = Bits;
+            }
+        } else if (!ClearWindow || (Pos - WindowPos >= ClearWindow
+                   && FillPixels > 0
+                   && (Bits - WindowBits) * FillPixels
+                      > FillBits * (Pos - WindowPos))) {
+            Codes[Count++] = Private->ClearCode;
+            Bits += RunningBits;
+            RunningCode = Private->EOFCode + 1;
+            RunningBits = Private->BitsPerPixel + 1;
+            MaxCode1 = 1 << RunningBits;
+            _ClearHashTable(HashTable);
+            FillPixels = 0;
+        } else if (Pos - WindowPos >= ClearWindow) {
+            /* The first window with a full table is the reference. */
+            if (FillPixels == 0) {
+                FillPixels = Pos - WindowPos;
+                FillBits = Bits - WindowBits;
+            }
+            WindowPos = Pos;
+            WindowBits = Bits;
+        }
+    }
+
+    *CodeCount = Count;
+    return Bits;
+}
+
+/******************************************************************************
+ The LZ compression routine of the best level, run once all the pixels of
+ the image are buffered:
+ The pixels are parsed a few ways, with and without lookahead, and with
+ clear codes sent at once or deferred, and the codes of the smallest parse
+ are sent. The greedy
+ parse with a clear code as soon as the table is full, as the normal level
+ does, is one of them, so the output is never larger than the normal one.
+******************************************************************************/
+static int
+EGifCompressBest(GifFileType *GifFile)
+{
+    static const int Lookaheads[] = { 0, BEST_LOOKAHEAD };
+    static const unsigned long ClearWindows[] = { 0, 4096, 16384 };
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+    unsigned long Len = Private->PixelBufferLen, MaxCodes = Len + Len / 1024 + 2;
+    unsigned long Bits, BestBits = 0, Count, BestCount = 0, i;
+    unsigned short *Codes, *BestCodes, *Swap;
+    int l, c;
+
+    Codes = (unsigned short *)GifMalloc(MaxCodes * sizeof(unsigned short));
+    BestCodes = (unsigned short *)GifMalloc(MaxCodes * sizeof(unsigned short));
+    if (Codes == NULL || BestCodes == NULL) {
+        if (Codes)
+            GifFree((char *) Codes);
+        if (BestCodes)
+            GifFree((char *) BestCodes);
+        GifFile->Error = E_GIF_ERR_NOT_ENOUGH_MEM;
+        return GIF_ERROR;
+    }
+
+    for (l = 0; l < 2; l++) {
+        for (c = 0; c < 3; c++) {
+            Bits = EGifParseBest(Private, Private->PixelBuffer, Len, Lookaheads[l],
+                                 BEST_MIN_GAIN, ClearWindows[c], Codes, &Count);
+            if (BestCount == 0 || Bits < BestBits) {
+                BestBits = Bits;
+                BestCount = Count;
+                Swap = BestCodes;
+                BestCodes = Codes;
+                Codes = Swap;
+            }
+        }
+    }
+
+    /* Send the codes, growing the code size as the decoder does. */
+    for (i = 0; i < BestCount; i++) {
+        if (EGifCompressOutput(GifFile, BestCodes[i]) == GIF_ERROR) {
+            GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
+            break;
+        }
+        if (BestCodes[i] == Private->ClearCode) {
+            Private->RunningCode = Private->EOFCode + 1;
+            Private->RunningBits = Private->BitsPerPixel + 1;
+            Private->MaxCode1 = 1 << Private->RunningBits;
+        } else if (i + 1 < BestCount && BestCodes[i + 1] != Private->ClearCode
+                   && Private->RunningCode <= LZ_MAX_CODE) {
+            Private->RunningCode++;
+        }
+    }
+    GifFree((char *) Codes);
+    GifFree((char *) BestCodes);
+    if (i < BestCount)
+        return GIF_ERROR;
+
+    /* We are done - output EOF Code and flush output buffers: */
+    if (EGifCompressOutput(GifFile, Private->EndCode) == GIF_ERROR) {
+        GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
+        return GIF_ERROR;
+    }
+    if (EGifCompressOutput(GifFile, FLUSH_OUTPUT) == GIF_ERROR) {
+        GifFile->Error = E_GIF_ERR_DISK_IS_FULL;
+        return GIF_ERROR;
+    }
+    return GIF_OK;
+}
+
 /******************************************************************************
  The LZ compression output routine:
  This routine is responsible for the compression of the bit stream into
- 8 bits (bytes) packets.
+ 8 bits (bytes) packets. The codes are packed 32 bits at a time into
+ CodeBuf, see EGifPackOutput.
  Returns GIF_OK if written successfully.
 ******************************************************************************/
 static int
@@ -965,34 +1430,30 @@ EGifCompressOutput(GifFileType *GifFile,
     int retval = GIF_OK;
 
     if (Code == FLUSH_OUTPUT) {
+        /* Get Rid of what is left in DWord, there is room for it. */
         while (Private->CrntShiftState > 0) {
-            /* Get Rid of what is left in DWord, and flush it. */
-            if (EGifBufferedOutput(GifFile, Private->Buf,
-                                 Private->CrntShiftDWord & 0xff) == GIF_ERROR)
-                retval = GIF_ERROR;
+            Private->CodeBuf[Private->CodeBufLen++] =
+                (GifByteType)(Private->CrntShiftDWord & 0xff);
             Private->CrntShiftDWord >>= 8;
             Private->CrntShiftState -= 8;
         }
         Private->CrntShiftState = 0;    /* For next time. */
-        if (EGifBufferedOutput(GifFile, Private->Buf,
-                               FLUSH_OUTPUT) == GIF_ERROR)
+        if (EGifFlushCodeBuf(GifFile, TRUE) == GIF_ERROR)
             retval = GIF_ERROR;
     } else {
-        Private->CrntShiftDWord |= ((long)Code) << Private->CrntShiftState;
+        Private->CrntShiftDWord |=
+            ((uint64_t)Code) << Private->CrntShiftState;
         Private->CrntShiftState += Private->RunningBits;
-        while (Private->CrntShiftState >= 8) {
-            /* Dump out full bytes: */
-            if (EGifBufferedOutput(GifFile, Private->Buf,
-                                 Private->CrntShiftDWord & 0xff) == GIF_ERROR)
-                retval = GIF_ERROR;
-            Private->CrntShiftDWord >>= 8;
-            Private->CrntShiftState -= 8;
-        }
+        Private->CodeBits += Private->RunningBits;
+        if (EGifPackOutput(GifFile) == GIF_ERROR)
+            retval = GIF_ERROR;
     }
 
     /* If code cannt fit into RunningBits bits, must raise its size. Note */
     /* however that codes above 4095 are used for special signaling.      */
-    if (Private->RunningCode >= Private->MaxCode1 && Code <= 4095) {
+    /* The codes stay 12 bits long once the string table is full.         */
+    if (Private->RunningCode >= Private->MaxCode1 && Code <= 4095
+        && Private->RunningBits < LZ_BITS) {
        Private->MaxCode1 = 1 << ++Private->RunningBits;
     }
 
@@ -1000,41 +1461,79 @@ EGifCompressOutput(GifFileType *GifFile,
 }
 
 /******************************************************************************
- This routines buffers the given characters until 255 characters are ready
- to be output. If Code is equal to -1 the buffer is flushed (EOF).
- The buffer is Dumped with first byte as its size, as GIF format requires.
+ This routine moves the low 32 bits of CrntShiftDWord to CodeBuf once they
+ are all set, and writes CodeBuf out once it is full. CodeBuf always keeps
+ room for the 4 bytes left in CrntShiftDWord.
  Returns GIF_OK if written successfully.
 ******************************************************************************/
 static int
-EGifBufferedOutput(GifFileType *GifFile,
-                   GifByteType *Buf,
-                   int c)
+EGifPackOutput(GifFileType *GifFile)
 {
-    if (c == FLUSH_OUTPUT) {
-        /* Flush everything out. */
-        if (Buf[0] != 0
-            && InternalWrite(GifFile, Buf, Buf[0] + 1) != (unsigned)(Buf[0] + 1)) {
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+    GifByteType *Bytes;
+
+    if (Private->CrntShiftState < 32)
+        return GIF_OK;
+
+    Bytes = Private->CodeBuf + Private->CodeBufLen;
+    Bytes[0] = (GifByteType)(Private->CrntShiftDWord & 0xff);
+    Bytes[1] = (GifByteType)((Private->CrntShiftDWord >> 8) & 0xff);
+    Bytes[2] = (GifByteType)((Private->CrntShiftDWord >> 16) & 0xff);
+    Bytes[3] = (GifByteType)((Private->CrntShiftDWord >> 24) & 0xff);
+    Private->CodeBufLen += 4;
+    Private->CrntShiftDWord >>= 32;
+    Private->CrntShiftState -= 32;
+
+    if (Private->CodeBufLen + 4 > CODE_BUF_SIZE)
+        return EGifFlushCodeBuf(GifFile, FALSE);
+    return GIF_OK;
+}
+
+/******************************************************************************
+ This routine writes the bytes of CodeBuf out in blocks of 255 bytes, each
+ with its size first as GIF format requires, in one write. The bytes which
+ don't fill a block are kept for later, unless Last, when they are written
+ as a shorter block followed by the empty block ending the codes.
+ Returns GIF_OK if written successfully.
+******************************************************************************/
+static int
+EGifFlushCodeBuf(GifFileType *GifFile, const BOOL Last)
+{
+    GifFilePrivateType *Private = (GifFilePrivateType *) GifFile->Private;
+    GifByteType Blocks[CODE_BUF_SIZE + CODE_BUF_SIZE / 255 + 2];
+    unsigned int Pos = 0, Len = 0, Size;
+
+    if (Private->RawCodes) {
+        /* The codes of a strip are written without the sizes of the blocks,
+         * they get them when the strip is put in the file. */
+        Size = Private->CodeBufLen;
+        Private->CodeBufLen = 0;
+        if (Size > 0 && InternalWrite(GifFile, Private->CodeBuf, Size) != Size) {
             GifFile->Error = E_GIF_ERR_WRITE_FAILED;
             return GIF_ERROR;
         }
+        return GIF_OK;
+    }
+
+    while (Private->CodeBufLen - Pos >= 255
+           || (Last && Pos < Private->CodeBufLen)) {
+        Size = Private->CodeBufLen - Pos < 255 ? Private->CodeBufLen - Pos : 255;
+        Blocks[Len++] = (GifByteType)Size;
+        memcpy(Blocks + Len, Private->CodeBuf + Pos, Size);
+        Len += Size;
+        Pos += Size;
+    }
+    if (Last) {
         /* Mark end of compressed data, by an empty block (see GIF doc): */
-        Buf[0] = 0;
-        if (InternalWrite(GifFile, Buf, 1) != 1) {
-            GifFile->Error = E_GIF_ERR_WRITE_FAILED;
-            return GIF_ERROR;
-        }
-    } else {
-        if (Buf[0] == 255) {
-            /* Dump out this buffer - it is full: */
-            if (InternalWrite(GifFile, Buf, Buf[0] + 1) != (unsigned)(Buf[0] + 1)) {
-                GifFile->Error = E_GIF_ERR_WRITE_FAILED;
-                return GIF_ERROR;
-            }
-            Buf[0] = 0;
-        }
-        Buf[++Buf[0]] = c;
+        Blocks[Len++] = 0;
     }
+    Private->CodeBufLen -= Pos;
+    memmove(Private->CodeBuf, Private->CodeBuf + Pos, Private->CodeBufLen);
 
+    if (Len > 0 && InternalWrite(GifFile, Blocks, Len) != Len) {
+        GifFile->Error = E_GIF_ERR_WRITE_FAILED;
+        return GIF_ERROR;
+    }
     return GIF_OK;
 }
 
@@ -37,7 +37,7 @@ GifHashTableType *_InitHashTable(void)
 {
     GifHashTableType *HashTable;
 
-    if ((HashTable = (GifHashTableType *) malloc(sizeof(GifHashTableType)))
+    if ((HashTable = (GifHashTableType *) GifMalloc(sizeof(GifHashTableType)))
 	== NULL)
 	return NULL;
 
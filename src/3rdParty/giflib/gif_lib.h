@@ -50,7 +50,7 @@ typedef struct ColorMapObject {
     int ColorCount;
     int BitsPerPixel;
     BOOL SortFlag;
-    GifColorType *Colors;    /* on malloc(3) heap */
+    GifColorType *Colors;    /* owned by giflib, release with GifFree() */
 } ColorMapObject;
 
 typedef struct GifImageDesc {
@@ -61,7 +61,7 @@ typedef struct GifImageDesc {
 
 typedef struct ExtensionBlock {
     int ByteCount;
-    GifByteType *Bytes; /* on malloc(3) heap */
+    GifByteType *Bytes; /* owned by giflib, release with GifFree() */
     int Function;       /* The block function code */
 #define CONTINUE_EXT_FUNC_CODE    0x00    /* continuation subblock */
 #define COMMENT_EXT_FUNC_CODE     0xfe    /* comment */
@@ -72,7 +72,7 @@ typedef struct ExtensionBlock {
 
 typedef struct SavedImage {
     GifImageDesc ImageDesc;
-    GifByteType *RasterBits;         /* on malloc(3) heap */
+    GifByteType *RasterBits;         /* owned by giflib, release with GifFree() */
     int ExtensionBlockCount;         /* Count of extensions before image */    
     ExtensionBlock *ExtensionBlocks; /* Extensions before image */    
 } SavedImage;
@@ -111,6 +111,14 @@ typedef int (*InputFunc) (GifFileType *, GifByteType *, int);
  */
 typedef int (*OutputFunc) (GifFileType *, const GifByteType *, int);
 
+/* func type to decode the codes of an image, given without the sizes of
+ * their blocks, into its pixels in the order they are sent.
+ * Returns GIF_OK, or GIF_ERROR with GifFile->Error set.
+ */
+typedef int (*DecodeFunc) (GifFileType *, const GifByteType *Codes,
+                           unsigned long CodeBits, int BitsPerPixel,
+                           GifPixelType *Pixels, unsigned long PixelCount);
+
 /******************************************************************************
  GIF89 structures
 ******************************************************************************/
@@ -151,6 +159,14 @@ int EGifCloseFile(GifFileType * GifFile);
 #define E_GIF_ERR_CLOSE_FAILED   9
 #define E_GIF_ERR_NOT_WRITEABLE  10
 
+#define GIF_COMPRESSION_FASTEST  0    /* Literal codes, no string table. */
+#define GIF_COMPRESSION_NORMAL   1    /* Hashed string table. */
+#define GIF_COMPRESSION_BEST     2
+
+#define GIF_CLEAR_FIXED          0    /* Clear as soon as the table is full. */
+#define GIF_CLEAR_DEFERRED       1    /* Keep the full table to the end. */
+#define GIF_CLEAR_ON_RATIO_DROP  2    /* Clear when the full table degrades. */
+
 /* These are legacy.  You probably do not want to call them directly */
 int EGifPutScreenDesc(GifFileType *GifFile,
                       const int GifWidth, const int GifHeight, 
@@ -163,9 +179,18 @@ int EGifPutImageDesc(GifFileType *GifFile,
              const BOOL GifInterlace,
                      const ColorMapObject *GifColorMap);
 void EGifSetGifVersion(GifFileType *GifFile, const BOOL gif89);
-int EGifPutLine(GifFileType *GifFile, GifPixelType *GifLine,
+void EGifSetCompressionLevel(GifFileType *GifFile, const int Level);
+void EGifSetClearPolicy(GifFileType *GifFile, const int Policy);
+double EGifGetCompressionRatio(GifFileType *GifFile);
+int EGifPutLine(GifFileType *GifFile, const GifPixelType *GifLine,
                 int GifLineLen);
 int EGifPutPixel(GifFileType *GifFile, const GifPixelType GifPixel);
+int EGifCompressStrip(GifFileType *GifFile, const GifPixelType *GifPixels,
+                      const int GifPixelCount, const BOOL GifLast,
+                      void *userPtr, OutputFunc writeFunc,
+                      unsigned long *GifCodeBits, int *Error);
+int EGifPutStrip(GifFileType *GifFile, const GifByteType *GifCodes,
+                 const unsigned long GifCodeBits, const int GifPixelCount);
 int EGifPutComment(GifFileType *GifFile, const char *GifComment);
 int EGifPutExtensionLeader(GifFileType *GifFile, const int GifExtCode);
 int EGifPutExtensionBlock(GifFileType *GifFile,
@@ -183,6 +208,18 @@ int EGifPutCodeNext(GifFileType *GifFile,
  GIF decoding routines
 ******************************************************************************/
 
+/* A run of the codes of an image decoded on its own, see DGifDecodeSegment */
+typedef struct GifCodeSegment {
+    unsigned long Start;    /* Bit of its first code, after a clear code. */
+    unsigned long Stop;     /* Ends with the clear code which ends here. */
+    unsigned long End;      /* Bit after the last code decoded. */
+    unsigned long CodeCount;
+    GifPixelType *Pixels;   /* owned by giflib, release with GifFree() */
+    unsigned long PixelCount;
+    BOOL Finished;          /* EOF code or all the pixels reached. */
+    int Error;
+} GifCodeSegment;
+
 /* Main entry points */
 GifFileType *DGifOpenFileName(const char *GifFileName, int *Error);
 GifFileType *DGifOpenFileHandle(int GifFileHandle, int *Error);
@@ -218,6 +255,17 @@ int DGifGetCode(GifFileType *GifFile, int *GifCodeSize,
                 GifByteType **GifCodeBlock);
 int DGifGetCodeNext(GifFileType *GifFile, GifByteType **GifCodeBlock);
 int DGifGetLZCodes(GifFileType *GifFile, int *GifCode);
+void DGifSetImageDecoder(GifFileType *GifFile, DecodeFunc decodeFunc);
+int DGifDecodeSegment(const GifByteType *GifCodes,
+                      const unsigned long GifCodeBits,
+                      const int GifBitsPerPixel,
+                      const unsigned long GifMaxPixels,
+                      GifCodeSegment *Segment);
+unsigned long DGifFindClearCode(const GifByteType *GifCodes,
+                                const unsigned long GifCodeBits,
+                                const int GifBitsPerPixel,
+                                const unsigned long From,
+                                const unsigned long To);
 
 
 /******************************************************************************
@@ -229,6 +277,12 @@ int GifQuantizeBuffer(unsigned int Width, unsigned int Height,
                    GifByteType * OutputBuffer,
                    GifColorType * OutputColorMap);
 
+#define GIF_QUANTIZE_HISTOGRAM_SIZE 32768   /* 5 bits per primary color */
+int GifQuantizeHistogram(const unsigned long *Histogram,
+                   int *ColorMapSize,
+                   GifColorType * OutputColorMap,
+                   GifByteType * IndexMap);
+
 /******************************************************************************
  Error handling and reporting.
 ******************************************************************************/
@@ -239,6 +293,23 @@ extern char *GifErrorString(int ErrorCode);     /* new in 2012 - ESR */
  mode' for doing I/O in two big belts with all the image-bashing in core.
 ******************************************************************************/
 
+/******************************************************************************
+ Memory allocation and accounting from gifalloc.c. The blocks start past a
+ size header, they must be released with GifFree(), never with free(3).
+******************************************************************************/
+
+typedef struct GifAllocCounter {
+    unsigned long BytesAllocated;
+    unsigned long BytesFreed;
+} GifAllocCounter;
+
+extern GifAllocCounter *GifSetAllocCounter(GifAllocCounter *Counter);
+extern GifAllocCounter *GifGetAllocCounter(void);
+extern void *GifMalloc(size_t Size);
+extern void *GifCalloc(size_t Count, size_t Size);
+extern void *GifRealloc(void *Ptr, size_t Size);
+extern void GifFree(void *Ptr);
+
 /******************************************************************************
  Color map handling from gif_alloc.c
 ******************************************************************************/
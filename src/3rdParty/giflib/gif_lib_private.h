@@ -29,6 +29,19 @@ gif_lib_private.h - internal giflib routines and structures
 #define IS_READABLE(Private)    (Private->FileState & FILE_STATE_READ)
 #define IS_WRITEABLE(Private)   (Private->FileState & FILE_STATE_WRITE)
 
+#define CODE_BUF_SIZE   (255 * 32)  /* Codes buffered without block sizes. */
+
+/* An entry of the string table of the decoder. The string is the one of
+ * Prefix followed by Suffix, so it is written backwards from its Length.
+ * Entries are packed in 8 bytes, 8 of them share a cache line. */
+typedef struct GifDictEntry {
+    uint16_t Prefix;        /* Code of the string without its last pixel. */
+    uint16_t Length;        /* Pixels in the string, 0 if it is not set. */
+    GifByteType Suffix;     /* Last pixel of the string. */
+    GifByteType FirstPixel; /* First pixel of the string. */
+    uint16_t Unused;
+} GifDictEntry;
+
 typedef struct GifFilePrivateType {
     GifWord FileState, FileHandle,  /* Where all this data goes to! */
       BitsPerPixel,     /* Bits per pixel (Codes uses at least this + 1). */
@@ -41,17 +54,32 @@ typedef struct GifFilePrivateType {
       CrntCode,    /* Current algorithm code. */
       StackPtr,    /* For character stack (see below). */
       CrntShiftState;    /* Number of bits in CrntShiftDWord. */
-    unsigned long CrntShiftDWord;   /* For bytes decomposition into codes. */
+    uint64_t CrntShiftDWord;   /* For bytes decomposition into codes. */
     unsigned long PixelCount;   /* Number of pixels in image. */
     FILE *File;    /* File as stream. */
     InputFunc Read;     /* function to read gif input (TVT) */
     OutputFunc Write;   /* function to write gif output (MRB) */
+    DecodeFunc Decode;  /* function to decode images in DGifSlurp */
+    int (*DecompressLine)(GifFileType *, GifPixelType *, int);
+                        /* decoder for the code size of the image */
     GifByteType Buf[256];   /* Compressed input is buffered here. */
+    GifByteType CodeBuf[CODE_BUF_SIZE]; /* Codes of several data blocks. */
+    unsigned int CodeBufPos, CodeBufLen;  /* Next and end byte in CodeBuf. */
+    BOOL CodeBlocksEnd; /* The empty block ending the codes was read. */
     GifByteType Stack[LZ_MAX_CODE]; /* Decoded pixels are stacked here. */
-    GifByteType Suffix[LZ_MAX_CODE + 1];    /* So we can trace the codes. */
-    GifPrefixType Prefix[LZ_MAX_CODE + 1];
+    GifDictEntry Dict[LZ_MAX_CODE + 1];     /* So we can trace the codes. */
     GifHashTableType *HashTable;
     BOOL gif89;
+    int CompressionLevel;   /* One of the GIF_COMPRESSION_* levels. */
+    GifPixelType *PixelBuffer;  /* Pixels of the image, for the best level. */
+    unsigned long PixelBufferLen;
+    int ClearPolicy;    /* One of the GIF_CLEAR_* policies. */
+    unsigned long CodeBits,     /* Bits of the codes of the image so far. */
+      PixelsIn,    /* Pixels of the image compressed so far. */
+      WindowPixels, WindowBits, /* Where the window of the full table began. */
+      FillPixels, FillBits;     /* Cost of the first window once full. */
+    BOOL RawCodes;      /* Codes are written without sub-block sizes. */
+    int EndCode;        /* EOF, or clear when a strip follows. */
 } GifFilePrivateType;
 
 #endif /* _GIF_LIB_PRIVATE_H */
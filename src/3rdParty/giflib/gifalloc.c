@@ -12,6 +12,113 @@
 
 #define MAX(x, y)    (((x) > (y)) ? (x) : (y))
 
+#if defined(_MSC_VER)
+#define GIF_THREAD_LOCAL __declspec(thread)
+#else
+#define GIF_THREAD_LOCAL __thread
+#endif
+
+/******************************************************************************
+ Memory allocation functions
+******************************************************************************/
+
+/*
+ * Every block starts with its size, so that the bytes freed can be counted.
+ * The union keeps the user part of the block aligned as malloc() does.
+ */
+typedef union GifAllocHeader {
+    size_t Size;
+    long double AlignLongDouble;
+    void *AlignPointer;
+} GifAllocHeader;
+
+/* Counter of the calling thread, NULL if the allocations are not counted. */
+static GIF_THREAD_LOCAL GifAllocCounter *CrntAllocCounter = NULL;
+
+/*
+ * Count the allocations done by the calling thread in Counter, until
+ * GifSetAllocCounter is called again. Return the previous counter.
+ */
+GifAllocCounter *
+GifSetAllocCounter(GifAllocCounter *Counter)
+{
+    GifAllocCounter *Previous = CrntAllocCounter;
+
+    CrntAllocCounter = Counter;
+    return Previous;
+}
+
+/*
+ * Return the counter of the calling thread, NULL if none is set.
+ */
+GifAllocCounter *
+GifGetAllocCounter(void)
+{
+    return CrntAllocCounter;
+}
+
+void *
+GifMalloc(size_t Size)
+{
+    GifAllocHeader *Header;
+
+    Header = (GifAllocHeader *)malloc(sizeof(GifAllocHeader) + Size);
+    if (Header == NULL)
+        return NULL;
+    Header->Size = Size;
+    if (CrntAllocCounter != NULL)
+        CrntAllocCounter->BytesAllocated += Size;
+    return Header + 1;
+}
+
+void *
+GifCalloc(size_t Count, size_t Size)
+{
+    void *Ptr;
+
+    if (Size != 0 && Count > ((size_t)-1 - sizeof(GifAllocHeader)) / Size)
+        return NULL;
+    Ptr = GifMalloc(Count * Size);
+    if (Ptr != NULL)
+        memset(Ptr, 0, Count * Size);
+    return Ptr;
+}
+
+void *
+GifRealloc(void *Ptr, size_t Size)
+{
+    GifAllocHeader *Header;
+    size_t OldSize;
+
+    if (Ptr == NULL)
+        return GifMalloc(Size);
+
+    Header = (GifAllocHeader *)Ptr - 1;
+    OldSize = Header->Size;
+    Header = (GifAllocHeader *)realloc(Header, sizeof(GifAllocHeader) + Size);
+    if (Header == NULL)
+        return NULL;
+    Header->Size = Size;
+    if (CrntAllocCounter != NULL) {
+        CrntAllocCounter->BytesFreed += OldSize;
+        CrntAllocCounter->BytesAllocated += Size;
+    }
+    return Header + 1;
+}
+
+void
+GifFree(void *Ptr)
+{
+    GifAllocHeader *Header;
+
+    if (Ptr == NULL)
+        return;
+    Header = (GifAllocHeader *)Ptr - 1;
+    if (CrntAllocCounter != NULL)
+        CrntAllocCounter->BytesFreed += Header->Size;
+    free(Header);
+}
+
 /******************************************************************************
  Miscellaneous utility functions                          
 ******************************************************************************/
@@ -47,19 +154,20 @@ GifMakeMapObject(int ColorCount, const GifColorType *ColorMap)
         return ((ColorMapObject *) NULL);
     }
     
-    Object = (ColorMapObject *)malloc(sizeof(ColorMapObject));
+    Object = (ColorMapObject *)GifMalloc(sizeof(ColorMapObject));
     if (Object == (ColorMapObject *) NULL) {
         return ((ColorMapObject *) NULL);
     }
 
-    Object->Colors = (GifColorType *)calloc(ColorCount, sizeof(GifColorType));
+    Object->Colors = (GifColorType *)GifCalloc(ColorCount, sizeof(GifColorType));
     if (Object->Colors == (GifColorType *) NULL) {
-	free(Object);
+	GifFree(Object);
         return ((ColorMapObject *) NULL);
     }
 
     Object->ColorCount = ColorCount;
     Object->BitsPerPixel = GifBitSize(ColorCount);
+    Object->SortFlag = false;
 
     if (ColorMap != NULL) {
         memcpy((char *)Object->Colors,
@@ -76,8 +184,8 @@ void
 GifFreeMapObject(ColorMapObject *Object)
 {
     if (Object != NULL) {
-        (void)free(Object->Colors);
-        (void)free(Object);
+        (void)GifFree(Object->Colors);
+        (void)GifFree(Object);
     }
 }
 
@@ -187,7 +295,7 @@ GifUnionColorMap(const ColorMapObject *ColorIn1,
 
         /* perhaps we can shrink the map? */
         if (RoundUpTo < ColorUnion->ColorCount)
-            ColorUnion->Colors = (GifColorType *)realloc(Map,
+            ColorUnion->Colors = (GifColorType *)GifRealloc(Map,
                                  sizeof(GifColorType) * RoundUpTo);
     }
 
@@ -223,9 +331,9 @@ GifAddExtensionBlock(int *ExtensionBlockCount,
     ExtensionBlock *ep;
 
     if (*ExtensionBlocks == NULL)
-        *ExtensionBlocks=(ExtensionBlock *)malloc(sizeof(ExtensionBlock));
+        *ExtensionBlocks=(ExtensionBlock *)GifMalloc(sizeof(ExtensionBlock));
     else
-        *ExtensionBlocks = (ExtensionBlock *)realloc(*ExtensionBlocks,
+        *ExtensionBlocks = (ExtensionBlock *)GifRealloc(*ExtensionBlocks,
                                       sizeof(ExtensionBlock) *
                                       (*ExtensionBlockCount + 1));
 
@@ -236,7 +344,7 @@ GifAddExtensionBlock(int *ExtensionBlockCount,
 
     ep->Function = Function;
     ep->ByteCount=Len;
-    ep->Bytes = (GifByteType *)malloc(ep->ByteCount);
+    ep->Bytes = (GifByteType *)GifMalloc(ep->ByteCount);
     if (ep->Bytes == NULL)
         return (GIF_ERROR);
 
@@ -259,8 +367,8 @@ GifFreeExtensions(int *ExtensionBlockCount,
     for (ep = *ExtensionBlocks;
 	 ep < (*ExtensionBlocks + *ExtensionBlockCount); 
 	 ep++)
-        (void)free((char *)ep->Bytes);
-    (void)free((char *)*ExtensionBlocks);
+        (void)GifFree((char *)ep->Bytes);
+    (void)GifFree((char *)*ExtensionBlocks);
     *ExtensionBlocks = NULL;
     *ExtensionBlockCount = 0;
 }
@@ -292,7 +400,7 @@ FreeLastSavedImage(GifFileType *GifFile)
 
     /* Deallocate the image data */
     if (sp->RasterBits != NULL)
-        free((char *)sp->RasterBits);
+        GifFree((char *)sp->RasterBits);
 
     /* Deallocate any extensions */
     GifFreeExtensions(&sp->ExtensionBlockCount, &sp->ExtensionBlocks);
@@ -312,9 +420,9 @@ SavedImage *
 GifMakeSavedImage(GifFileType *GifFile, const SavedImage *CopyFrom)
 {
     if (GifFile->SavedImages == NULL)
-        GifFile->SavedImages = (SavedImage *)malloc(sizeof(SavedImage));
+        GifFile->SavedImages = (SavedImage *)GifMalloc(sizeof(SavedImage));
     else
-        GifFile->SavedImages = (SavedImage *)realloc(GifFile->SavedImages,
+        GifFile->SavedImages = (SavedImage *)GifRealloc(GifFile->SavedImages,
                                sizeof(SavedImage) * (GifFile->ImageCount + 1));
 
     if (GifFile->SavedImages == NULL)
@@ -344,7 +452,7 @@ GifMakeSavedImage(GifFileType *GifFile, const SavedImage *CopyFrom)
             }
 
             /* next, the raster */
-            sp->RasterBits = (unsigned char *)malloc(sizeof(GifPixelType) *
+            sp->RasterBits = (unsigned char *)GifMalloc(sizeof(GifPixelType) *
                                                    CopyFrom->ImageDesc.Height *
                                                    CopyFrom->ImageDesc.Width);
             if (sp->RasterBits == NULL) {
@@ -357,7 +465,7 @@ GifMakeSavedImage(GifFileType *GifFile, const SavedImage *CopyFrom)
 
             /* finally, the extension blocks */
             if (sp->ExtensionBlocks != NULL) {
-                sp->ExtensionBlocks = (ExtensionBlock *)malloc(
+                sp->ExtensionBlocks = (ExtensionBlock *)GifMalloc(
                                       sizeof(ExtensionBlock) *
                                       CopyFrom->ExtensionBlockCount);
                 if (sp->ExtensionBlocks == NULL) {
@@ -389,11 +497,11 @@ GifFreeSavedImages(GifFileType *GifFile)
         }
 
         if (sp->RasterBits != NULL)
-            free((char *)sp->RasterBits);
+            GifFree((char *)sp->RasterBits);
 	
 	GifFreeExtensions(&sp->ExtensionBlockCount, &sp->ExtensionBlocks);
     }
-    free((char *)GifFile->SavedImages);
+    GifFree((char *)GifFile->SavedImages);
     GifFile->SavedImages = NULL;
 }
 
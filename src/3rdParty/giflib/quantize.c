@@ -18,12 +18,10 @@
 
 #define ABS(x)    ((x) > 0 ? (x) : (-(x)))
 
-#define COLOR_ARRAY_SIZE 32768
+#define COLOR_ARRAY_SIZE GIF_QUANTIZE_HISTOGRAM_SIZE
 #define BITS_PER_PRIM_COLOR 5
 #define MAX_PRIM_COLOR      0x1f
 
-static int SortRGBAxis;
-
 typedef struct QuantizedColorType {
     GifByteType RGB[3];
     GifByteType NewColorIndex;
@@ -38,10 +36,15 @@ typedef struct NewColorMapType {
     QuantizedColorType *QuantizedColors;
 } NewColorMapType;
 
+static int QuantizeColorArray(QuantizedColorType *ColorArrayEntries,
+                              int *ColorMapSize,
+                              GifColorType *OutputColorMap);
 static int SubdivColorMap(NewColorMapType * NewColorSubdiv,
                           unsigned int ColorMapSize,
                           unsigned int *NewColorMapSize);
-static int SortCmpRtn(const void *Entry1, const void *Entry2);
+static int SortCmpRed(const void *Entry1, const void *Entry2);
+static int SortCmpGreen(const void *Entry1, const void *Entry2);
+static int SortCmpBlue(const void *Entry1, const void *Entry2);
 
 /******************************************************************************
  Quantize high resolution image into lower one. Input image consists of a
@@ -65,26 +68,18 @@ GifQuantizeBuffer(unsigned int Width,
                GifByteType * OutputBuffer,
                GifColorType * OutputColorMap) {
 
-    unsigned int Index, NumOfEntries;
-    int i, j, MaxRGBError[3];
-    unsigned int NewColorMapSize;
-    long Red, Green, Blue;
-    NewColorMapType NewColorSubdiv[256];
-    QuantizedColorType *ColorArrayEntries, *QuantizedColor;
+    unsigned int Index;
+    int i, MaxRGBError[3];
+    QuantizedColorType *ColorArrayEntries;
 
-    ColorArrayEntries = (QuantizedColorType *)malloc(
+    ColorArrayEntries = (QuantizedColorType *)GifMalloc(
                            sizeof(QuantizedColorType) * COLOR_ARRAY_SIZE);
     if (ColorArrayEntries == NULL) {
         return GIF_ERROR;
     }
 
-    for (i = 0; i < COLOR_ARRAY_SIZE; i++) {
-        ColorArrayEntries[i].RGB[0] = i >> (2 * BITS_PER_PRIM_COLOR);
-        ColorArrayEntries[i].RGB[1] = (i >> BITS_PER_PRIM_COLOR) &
-           MAX_PRIM_COLOR;
-        ColorArrayEntries[i].RGB[2] = i & MAX_PRIM_COLOR;
+    for (i = 0; i < COLOR_ARRAY_SIZE; i++)
         ColorArrayEntries[i].Count = 0;
-    }
 
     /* Sample the colors and their distribution: */
     for (i = 0; i < (int)(Width * Height); i++) {
@@ -96,6 +91,114 @@ GifQuantizeBuffer(unsigned int Width,
         ColorArrayEntries[Index].Count++;
     }
 
+    if (QuantizeColorArray(ColorArrayEntries, ColorMapSize,
+                           OutputColorMap) != GIF_OK) {
+        GifFree((char *)ColorArrayEntries);
+        return GIF_ERROR;
+    }
+
+    /* Finally scan the input buffer again and put the mapped index in the
+     * output buffer.  */
+    MaxRGBError[0] = MaxRGBError[1] = MaxRGBError[2] = 0;
+    for (i = 0; i < (int)(Width * Height); i++) {
+        Index = ((RedInput[i] >> (8 - BITS_PER_PRIM_COLOR)) <<
+                 (2 * BITS_PER_PRIM_COLOR)) +
+                ((GreenInput[i] >> (8 - BITS_PER_PRIM_COLOR)) <<
+                 BITS_PER_PRIM_COLOR) +
+                (BlueInput[i] >> (8 - BITS_PER_PRIM_COLOR));
+        Index = ColorArrayEntries[Index].NewColorIndex;
+        OutputBuffer[i] = Index;
+        if (MaxRGBError[0] < ABS(OutputColorMap[Index].Red - RedInput[i]))
+            MaxRGBError[0] = ABS(OutputColorMap[Index].Red - RedInput[i]);
+        if (MaxRGBError[1] < ABS(OutputColorMap[Index].Green - GreenInput[i]))
+            MaxRGBError[1] = ABS(OutputColorMap[Index].Green - GreenInput[i]);
+        if (MaxRGBError[2] < ABS(OutputColorMap[Index].Blue - BlueInput[i]))
+            MaxRGBError[2] = ABS(OutputColorMap[Index].Blue - BlueInput[i]);
+    }
+
+#ifdef DEBUG
+    fprintf(stderr,
+            "Quantization L(0) errors: Red = %d, Green = %d, Blue = %d.\n",
+            MaxRGBError[0], MaxRGBError[1], MaxRGBError[2]);
+#endif /* DEBUG */
+
+    GifFree((char *)ColorArrayEntries);
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Quantize a color histogram instead of an image. Histogram holds
+ GIF_QUANTIZE_HISTOGRAM_SIZE pixel counts, indexed by the color reduced to 5
+ bits per primary color (red in the high bits, blue in the low bits), so the
+ caller can accumulate it from any number of images or samples.
+ ColorMapSize specifies size of color map up to 256 and will be updated to
+ real size before returning. If IndexMap is not NULL, it receives the output
+ color map index of every non empty histogram entry.
+   This function returns GIF_OK if successful, GIF_ERROR otherwise.
+******************************************************************************/
+int
+GifQuantizeHistogram(const unsigned long *Histogram,
+                     int *ColorMapSize,
+                     GifColorType * OutputColorMap,
+                     GifByteType * IndexMap) {
+
+    int i;
+    QuantizedColorType *ColorArrayEntries;
+
+    ColorArrayEntries = (QuantizedColorType *)GifMalloc(
+                           sizeof(QuantizedColorType) * COLOR_ARRAY_SIZE);
+    if (ColorArrayEntries == NULL) {
+        return GIF_ERROR;
+    }
+
+    for (i = 0; i < COLOR_ARRAY_SIZE; i++)
+        ColorArrayEntries[i].Count = Histogram[i];
+
+    if (QuantizeColorArray(ColorArrayEntries, ColorMapSize,
+                           OutputColorMap) != GIF_OK) {
+        GifFree((char *)ColorArrayEntries);
+        return GIF_ERROR;
+    }
+
+    if (IndexMap != NULL) {
+        for (i = 0; i < COLOR_ARRAY_SIZE; i++)
+            IndexMap[i] = ColorArrayEntries[i].Count > 0 ?
+               ColorArrayEntries[i].NewColorIndex : 0;
+    }
+
+    GifFree((char *)ColorArrayEntries);
+
+    return GIF_OK;
+}
+
+/******************************************************************************
+ Median cut the sampled colors of ColorArrayEntries, whose Count members
+ must be filled in by the caller, into at most ColorMapSize colors. On
+ return NewColorIndex of every non empty entry is its output color index.
+ Returns GIF_ERROR if failed, otherwise GIF_OK.
+******************************************************************************/
+static int
+QuantizeColorArray(QuantizedColorType *ColorArrayEntries,
+                   int *ColorMapSize,
+                   GifColorType *OutputColorMap) {
+
+    unsigned int NumOfEntries;
+    int i, j;
+    unsigned int NewColorMapSize;
+    unsigned long TotalCount = 0;
+    long Red, Green, Blue;
+    NewColorMapType NewColorSubdiv[256];
+    QuantizedColorType *QuantizedColor;
+
+    for (i = 0; i < COLOR_ARRAY_SIZE; i++) {
+        ColorArrayEntries[i].RGB[0] = i >> (2 * BITS_PER_PRIM_COLOR);
+        ColorArrayEntries[i].RGB[1] = (i >> BITS_PER_PRIM_COLOR) &
+           MAX_PRIM_COLOR;
+        ColorArrayEntries[i].RGB[2] = i & MAX_PRIM_COLOR;
+        TotalCount += ColorArrayEntries[i].Count;
+    }
+
     /* Put all the colors in the first entry of the color map, and call the
      * recursive subdivision process.  */
     for (i = 0; i < 256; i++) {
@@ -111,6 +214,8 @@ GifQuantizeBuffer(unsigned int Width,
     for (i = 0; i < COLOR_ARRAY_SIZE; i++)
         if (ColorArrayEntries[i].Count > 0)
             break;
+    if (i == COLOR_ARRAY_SIZE)
+        return GIF_ERROR;    /* Nothing was sampled. */
     QuantizedColor = NewColorSubdiv[0].QuantizedColors = &ColorArrayEntries[i];
     NumOfEntries = 1;
     while (++i < COLOR_ARRAY_SIZE)
@@ -122,11 +227,10 @@ GifQuantizeBuffer(unsigned int Width,
     QuantizedColor->Pnext = NULL;
 
     NewColorSubdiv[0].NumEntries = NumOfEntries; /* Different sampled colors */
-    NewColorSubdiv[0].Count = ((long)Width) * Height; /* Pixels */
+    NewColorSubdiv[0].Count = TotalCount; /* Pixels */
     NewColorMapSize = 1;
     if (SubdivColorMap(NewColorSubdiv, *ColorMapSize, &NewColorMapSize) !=
        GIF_OK) {
-        free((char *)ColorArrayEntries);
         return GIF_ERROR;
     }
     if (NewColorMapSize < *ColorMapSize) {
@@ -155,33 +259,6 @@ GifQuantizeBuffer(unsigned int Width,
         }
     }
 
-    /* Finally scan the input buffer again and put the mapped index in the
-     * output buffer.  */
-    MaxRGBError[0] = MaxRGBError[1] = MaxRGBError[2] = 0;
-    for (i = 0; i < (int)(Width * Height); i++) {
-        Index = ((RedInput[i] >> (8 - BITS_PER_PRIM_COLOR)) <<
-                 (2 * BITS_PER_PRIM_COLOR)) +
-                ((GreenInput[i] >> (8 - BITS_PER_PRIM_COLOR)) <<
-                 BITS_PER_PRIM_COLOR) +
-                (BlueInput[i] >> (8 - BITS_PER_PRIM_COLOR));
-        Index = ColorArrayEntries[Index].NewColorIndex;
-        OutputBuffer[i] = Index;
-        if (MaxRGBError[0] < ABS(OutputColorMap[Index].Red - RedInput[i]))
-            MaxRGBError[0] = ABS(OutputColorMap[Index].Red - RedInput[i]);
-        if (MaxRGBError[1] < ABS(OutputColorMap[Index].Green - GreenInput[i]))
-            MaxRGBError[1] = ABS(OutputColorMap[Index].Green - GreenInput[i]);
-        if (MaxRGBError[2] < ABS(OutputColorMap[Index].Blue - BlueInput[i]))
-            MaxRGBError[2] = ABS(OutputColorMap[Index].Blue - BlueInput[i]);
-    }
-
-#ifdef DEBUG
-    fprintf(stderr,
-            "Quantization L(0) errors: Red = %d, Green = %d, Blue = %d.\n",
-            MaxRGBError[0], MaxRGBError[1], MaxRGBError[2]);
-#endif /* DEBUG */
-
-    free((char *)ColorArrayEntries);
-
     *ColorMapSize = NewColorMapSize;
 
     return GIF_OK;
@@ -198,7 +275,7 @@ SubdivColorMap(NewColorMapType * NewColorSubdiv,
                unsigned int ColorMapSize,
                unsigned int *NewColorMapSize) {
 
-    int MaxSize;
+    int MaxSize, SortRGBAxis = 0;
     unsigned int i, j, Index = 0, NumEntries, MinColor, MaxColor;
     long Sum, Count;
     QuantizedColorType *QuantizedColor, **SortArray;
@@ -224,7 +301,7 @@ SubdivColorMap(NewColorMapType * NewColorSubdiv,
 
         /* Sort all elements in that entry along the given axis and split at
          * the median.  */
-        SortArray = (QuantizedColorType **)malloc(
+        SortArray = (QuantizedColorType **)GifMalloc(
                       sizeof(QuantizedColorType *) * 
                       NewColorSubdiv[Index].NumEntries);
         if (SortArray == NULL)
@@ -235,14 +312,16 @@ SubdivColorMap(NewColorMapType * NewColorSubdiv,
             SortArray[j] = QuantizedColor;
 
         qsort(SortArray, NewColorSubdiv[Index].NumEntries,
-              sizeof(QuantizedColorType *), SortCmpRtn);
+              sizeof(QuantizedColorType *),
+              SortRGBAxis == 0 ? SortCmpRed :
+              SortRGBAxis == 1 ? SortCmpGreen : SortCmpBlue);
 
         /* Relink the sorted list into one: */
         for (j = 0; j < NewColorSubdiv[Index].NumEntries - 1; j++)
             SortArray[j]->Pnext = SortArray[j + 1];
         SortArray[NewColorSubdiv[Index].NumEntries - 1]->Pnext = NULL;
         NewColorSubdiv[Index].QuantizedColors = QuantizedColor = SortArray[0];
-        free((char *)SortArray);
+        GifFree((char *)SortArray);
 
         /* Now simply add the Counts until we have half of the Count: */
         Sum = NewColorSubdiv[Index].Count / 2 - QuantizedColor->Count;
@@ -296,14 +375,32 @@ SubdivColorMap(NewColorMapType * NewColorSubdiv,
 }
 
 /****************************************************************************
- Routine called by qsort to compare two entries.
+ Routines called by qsort to compare two entries along one axis. There is
+ one per axis, rather than a static axis variable, so that several images
+ can be quantized at the same time from different threads.
 *****************************************************************************/
 static int
-SortCmpRtn(const void *Entry1,
+SortCmpRed(const void *Entry1,
            const void *Entry2) {
 
-    return (*((QuantizedColorType **) Entry1))->RGB[SortRGBAxis] -
-       (*((QuantizedColorType **) Entry2))->RGB[SortRGBAxis];
+    return (*((QuantizedColorType **) Entry1))->RGB[0] -
+       (*((QuantizedColorType **) Entry2))->RGB[0];
+}
+
+static int
+SortCmpGreen(const void *Entry1,
+             const void *Entry2) {
+
+    return (*((QuantizedColorType **) Entry1))->RGB[1] -
+       (*((QuantizedColorType **) Entry2))->RGB[1];
+}
+
+static int
+SortCmpBlue(const void *Entry1,
+            const void *Entry2) {
+
+    return (*((QuantizedColorType **) Entry1))->RGB[2] -
+       (*((QuantizedColorType **) Entry2))->RGB[2];
 }
 
 /* end */
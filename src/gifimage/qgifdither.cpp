@@ -0,0 +1,486 @@
+/****************************************************************************
+** Copyright (c) 2013 Debao Zhang <hello@debao.me>
+** All right reserved.
+**
+** Permission is hereby granted, free of charge, to any person obtaining
+** a copy of this software and associated documentation files (the
+** "Software"), to deal in the Software without restriction, including
+** without limitation the rights to use, copy, modify, merge, publish,
+** distribute, sublicense, and/or sell copies of the Software, and to
+** permit persons to whom the Software is furnished to do so, subject to
+** the following conditions:
+**
+** The above copyright notice and this permission notice shall be
+** included in all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+** EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+** MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+** NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+** LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+** OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+** WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+**
+****************************************************************************/
+#include "qgifdither_p.h"
+
+#include <QAtomicInt>
+#include <QGlobalStatic>
+#include <QThread>
+#include <QVector>
+#include <QtConcurrent>
+#include <qmath.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+namespace
+{
+struct ThresholdMap
+{
+    ThresholdMap() : size(0) {}
+    //Rank of each cell, from 0 to size*size-1.
+    int rank(int x, int y) const { return ranks[y * size + x]; }
+
+    int size;
+    QVector<int> ranks;
+};
+
+/*
+    8x8 Bayer matrix, the rank is the bit reversed interleave of x^y and y.
+ */
+class BayerMap : public ThresholdMap
+{
+public:
+    BayerMap()
+    {
+        size = 8;
+        ranks.resize(size * size);
+        for (int y = 0; y < size; ++y) {
+            for (int x = 0; x < size; ++x) {
+                int rank = 0;
+                for (int bit = 0; bit < 3; ++bit) {
+                    int value = ((((x ^ y) >> bit) & 1) << 1) | ((y >> bit) & 1);
+                    rank |= value << (2 * (2 - bit));
+                }
+                ranks[y * size + x] = rank;
+            }
+        }
+    }
+};
+
+/*
+    64x64 blue noise, generated once with the void-and-cluster method of
+    Ulichney. A fixed seed is used, so that the map is the same for every
+    frame and every run.
+ */
+class BlueNoiseMap : public ThresholdMap
+{
+public:
+    BlueNoiseMap()
+    {
+        size = 64;
+        const int count = size * size;
+        ranks.fill(0, count);
+
+        //Toroidal gaussian energy filter, sigma is 1.5
+        QVector<double> filter(count);
+        for (int y = 0; y < size; ++y) {
+            for (int x = 0; x < size; ++x) {
+                int dx = qMin(x, size - x);
+                int dy = qMin(y, size - y);
+                filter[y * size + x] = qExp(-(dx * dx + dy * dy) / (2 * 1.5 * 1.5));
+            }
+        }
+
+        QVector<uchar> pattern(count, 0);
+        QVector<double> energy(count, 0.0);
+        quint32 seed = 0x9e3779b9;
+        int ones = 0;
+        while (ones < count / 10) {
+            seed = seed * 1664525 + 1013904223;
+            int pos = (seed >> 8) % count;
+            if (!pattern[pos]) {
+                pattern[pos] = 1;
+                updateEnergy(&energy, filter, pos, 1.0);
+                ++ones;
+            }
+        }
+
+        //Move the points from the tightest clusters to the largest voids.
+        for (int iteration = 0; iteration < count; ++iteration) {
+            int cluster = findExtremum(energy, pattern, true);
+            pattern[cluster] = 0;
+            updateEnergy(&energy, filter, cluster, -1.0);
+            int hole = findExtremum(energy, pattern, false);
+            pattern[hole] = 1;
+            updateEnergy(&energy, filter, hole, 1.0);
+            if (hole == cluster)
+                break;
+        }
+
+        //Rank the initial points, tightest cluster last.
+        QVector<uchar> rankedPattern = pattern;
+        QVector<double> rankedEnergy = energy;
+        for (int rank = ones - 1; rank >= 0; --rank) {
+            int cluster = findExtremum(rankedEnergy, rankedPattern, true);
+            rankedPattern[cluster] = 0;
+            updateEnergy(&rankedEnergy, filter, cluster, -1.0);
+            ranks[cluster] = rank;
+        }
+
+        //Then fill the largest voids.
+        for (int rank = ones; rank < count; ++rank) {
+            int hole = findExtremum(energy, pattern, false);
+            pattern[hole] = 1;
+            updateEnergy(&energy, filter, hole, 1.0);
+            ranks[hole] = rank;
+        }
+    }
+
+private:
+    void updateEnergy(QVector<double> *energy, const QVector<double> &filter, int pos, double sign) const
+    {
+        int px = pos % size;
+        int py = pos / size;
+        for (int y = 0; y < size; ++y) {
+            const double *filterLine = filter.constData() + ((y - py + size) % size) * size;
+            double *energyLine = energy->data() + y * size;
+            for (int x = 0; x < size; ++x)
+                energyLine[x] += sign * filterLine[(x - px + size) % size];
+        }
+    }
+
+    //The tightest cluster is the set point of highest energy, the largest
+    //void the unset point of lowest energy.
+    int findExtremum(const QVector<double> &energy, const QVector<uchar> &pattern, bool cluster) const
+    {
+        int pos = -1;
+        for (int idx = 0; idx < energy.size(); ++idx) {
+            if (pattern[idx] != cluster)
+                continue;
+            if (pos == -1 || (cluster ? energy[idx] > energy[pos] : energy[idx] < energy[pos]))
+                pos = idx;
+        }
+        return pos;
+    }
+};
+
+Q_GLOBAL_STATIC(BayerMap, bayerMap)
+Q_GLOBAL_STATIC(BlueNoiseMap, blueNoiseMap)
+
+inline int positiveModulo(int value, int size)
+{
+    int result = value % size;
+    return result < 0 ? result + size : result;
+}
+
+inline quint32 addSaturated(quint32 pixel, quint32 add, quint32 sub)
+{
+    quint32 result = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        int value = int((pixel >> shift) & 0xff) + int((add >> shift) & 0xff) - int((sub >> shift) & 0xff);
+        result |= quint32(qBound(0, value, 255)) << shift;
+    }
+    return result;
+}
+
+/*
+    dst = src + add - sub, each byte saturated.
+ */
+void applyThresholds(const quint32 *src, const quint32 *add, const quint32 *sub, quint32 *dst, int width)
+{
+    int x = 0;
+#if defined(__SSE2__)
+    for (; x + 4 <= width; x += 4) {
+        __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x));
+        pixels = _mm_adds_epu8(pixels, _mm_loadu_si128(reinterpret_cast<const __m128i *>(add + x)));
+        pixels = _mm_subs_epu8(pixels, _mm_loadu_si128(reinterpret_cast<const __m128i *>(sub + x)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), pixels);
+    }
+#elif defined(__ARM_NEON__)
+    for (; x + 4 <= width; x += 4) {
+        uint8x16_t pixels = vld1q_u8(reinterpret_cast<const uint8_t *>(src + x));
+        pixels = vqaddq_u8(pixels, vld1q_u8(reinterpret_cast<const uint8_t *>(add + x)));
+        pixels = vqsubq_u8(pixels, vld1q_u8(reinterpret_cast<const uint8_t *>(sub + x)));
+        vst1q_u8(reinterpret_cast<uint8_t *>(dst + x), pixels);
+    }
+#endif
+    for (; x < width; ++x)
+        dst[x] = addSaturated(src[x], add[x], sub[x]);
+}
+
+struct RowRange
+{
+    RowRange(int begin = 0, int end = 0) : begin(begin), end(end) {}
+    int begin;
+    int end;
+};
+
+QVector<RowRange> splitRows(int height)
+{
+    int stripHeight = qMax(8, height / (QThread::idealThreadCount() * 4));
+    QVector<RowRange> strips;
+    for (int y = 0; y < height; y += stripHeight)
+        strips.append(RowRange(y, qMin(height, y + stripHeight)));
+    return strips;
+}
+
+struct OrderedDitherStrip
+{
+    typedef void result_type;
+
+    const QImage *image;
+    const QGifColorMapper *mapper;
+    //One row of threshold offsets per row of the threshold map, as wide as the image.
+    const quint32 *addRows;
+    const quint32 *subRows;
+    int mapSize;
+    int offsetY;
+    uchar *bits;
+    int bytesPerLine;
+
+    void operator()(const RowRange &strip) const
+    {
+        int width = image->width();
+        QVector<quint32> line(width);
+        for (int y = strip.begin; y < strip.end; ++y) {
+            const quint32 *src = reinterpret_cast<const quint32 *>(image->constScanLine(y));
+            int mapRow = positiveModulo(y + offsetY, mapSize);
+            applyThresholds(src, addRows + mapRow * width, subRows + mapRow * width, line.data(), width);
+
+            uchar *dst = bits + y * bytesPerLine;
+            for (int x = 0; x < width; ++x) {
+                if (mapper->isTransparent(src[x]))
+                    dst[x] = mapper->nearestIndex(src[x]);
+                else
+                    dst[x] = mapper->nearestOpaqueIndex(line[x]);
+            }
+        }
+    }
+};
+
+/*
+    Error diffusion kernel, as the (dx, dy, weight) taps the quantization
+    error of a pixel is pushed to. The weights add up to 1 << shift.
+ */
+struct DiffusionTap
+{
+    int dx;
+    int dy;
+    int weight;
+};
+
+struct DiffusionKernel
+{
+    const DiffusionTap *taps;
+    int tapCount;
+    int shift;
+    //How far row y-1 must be ahead of row y.
+    int lag;
+};
+
+const DiffusionTap floydSteinbergTaps[] = {
+    {1, 0, 7},
+    {-1, 1, 3}, {0, 1, 5}, {1, 1, 1}
+};
+
+const DiffusionTap sierraTaps[] = {
+    {1, 0, 5}, {2, 0, 3},
+    {-2, 1, 2}, {-1, 1, 4}, {0, 1, 5}, {1, 1, 4}, {2, 1, 2},
+    {-1, 2, 2}, {0, 2, 3}, {1, 2, 2}
+};
+
+const DiffusionKernel floydSteinbergKernel = { floydSteinbergTaps, 4, 4, 2 };
+const DiffusionKernel sierraKernel = { sierraTaps, 10, 5, 3 };
+
+//Publish the progress of a row every progressStep pixels.
+const int progressStep = 16;
+
+/*
+    The error diffusion is done in the pull form: the error added to a pixel
+    is the weighted sum of the errors of the pixels before it, which are
+    stored. So a pixel only depends on row y-1 being done up to x+lag, and
+    the rows can be processed as a wavefront. The rows are claimed in order,
+    so the row a thread waits for is always being processed by another one.
+    Integer arithmetic makes the result independent of the number of threads.
+ */
+struct ErrorDiffusionWorker
+{
+    typedef void result_type;
+
+    const QImage *image;
+    const QGifColorMapper *mapper;
+    const DiffusionKernel *kernel;
+    QAtomicInt *nextRow;
+    QAtomicInt *progress;
+    //Three errors per pixel.
+    qint16 *errors;
+    uchar *bits;
+    int bytesPerLine;
+
+    void operator()(int &) const
+    {
+        const int width = image->width();
+        const int height = image->height();
+        const QVector<QRgb> colorTable = mapper->colorTable();
+        for (int y = nextRow->fetchAndAddOrdered(1); y < height; y = nextRow->fetchAndAddOrdered(1)) {
+            const quint32 *src = reinterpret_cast<const quint32 *>(image->constScanLine(y));
+            uchar *dst = bits + y * bytesPerLine;
+            qint16 *rowErrors = errors + y * width * 3;
+            int aboveProgress = y ? progress[y - 1].loadAcquire() : width;
+
+            for (int x = 0; x < width; ++x) {
+                int needed = qMin(width, x + kernel->lag);
+                while (aboveProgress < needed) {
+                    QThread::yieldCurrentThread();
+                    aboveProgress = progress[y - 1].loadAcquire();
+                }
+
+                if (mapper->isTransparent(src[x])) {
+                    dst[x] = mapper->nearestIndex(src[x]);
+                    rowErrors[x * 3] = rowErrors[x * 3 + 1] = rowErrors[x * 3 + 2] = 0;
+                } else {
+                    int sum[3] = { 0, 0, 0 };
+                    for (int tap = 0; tap < kernel->tapCount; ++tap) {
+                        const DiffusionTap &t = kernel->taps[tap];
+                        int sx = x - t.dx;
+                        int sy = y - t.dy;
+                        if (sx < 0 || sx >= width || sy < 0)
+                            continue;
+                        const qint16 *e = errors + (sy * width + sx) * 3;
+                        sum[0] += t.weight * e[0];
+                        sum[1] += t.weight * e[1];
+                        sum[2] += t.weight * e[2];
+                    }
+                    const int round = 1 << (kernel->shift - 1);
+                    int r = qBound(0, qRed(src[x]) + ((sum[0] + round) >> kernel->shift), 255);
+                    int g = qBound(0, qGreen(src[x]) + ((sum[1] + round) >> kernel->shift), 255);
+                    int b = qBound(0, qBlue(src[x]) + ((sum[2] + round) >> kernel->shift), 255);
+                    int index = mapper->nearestOpaqueIndex(qRgb(r, g, b));
+                    QRgb color = colorTable[index];
+                    dst[x] = index;
+                    rowErrors[x * 3] = r - qRed(color);
+                    rowErrors[x * 3 + 1] = g - qGreen(color);
+                    rowErrors[x * 3 + 2] = b - qBlue(color);
+                }
+
+                if ((x + 1) % progressStep == 0)
+                    progress[y].storeRelease(x + 1);
+            }
+            progress[y].storeRelease(width);
+        }
+    }
+};
+}
+
+QGifDitherer::QGifDitherer(QGifImage::DitherMode mode, const QGifColorMapper &mapper)
+    : mode(mode), mapper(mapper)
+{
+}
+
+/*
+    Map \a image to the color table of the mapper. The \a offset of the image
+    in the canvas is used by the threshold maps, so that the same pixel of the
+    canvas is always dithered the same way, whatever the frame.
+ */
+QImage QGifDitherer::dither(const QImage &image, const QPoint &offset) const
+{
+    if (image.isNull() || mapper.colorTable().isEmpty())
+        return QImage();
+
+    switch (mode) {
+    case QGifImage::OrderedDither:
+    case QGifImage::BlueNoiseDither:
+        return orderedDither(image, offset);
+    case QGifImage::FloydSteinbergDither:
+    case QGifImage::SierraDither:
+        return errorDiffusion(image);
+    default:
+        break;
+    }
+    return mapper.map(image);
+}
+
+QImage QGifDitherer::orderedDither(const QImage &image, const QPoint &offset) const
+{
+    QImage argbImage = image;
+    if (image.format() != QImage::Format_RGB32 && image.format() != QImage::Format_ARGB32)
+        argbImage = image.convertToFormat(QImage::Format_ARGB32);
+
+    const ThresholdMap *map = mode == QGifImage::BlueNoiseDither
+            ? static_cast<const ThresholdMap *>(blueNoiseMap())
+            : static_cast<const ThresholdMap *>(bayerMap());
+
+    //The spread of the thresholds is the distance between two levels of a
+    //channel, as if the colors of the table were evenly spaced.
+    const int width = argbImage.width();
+    const int levels = map->size * map->size;
+    const double channelLevels = qPow(mapper.colorTable().size(), 1.0 / 3);
+    const int spread = qBound(4, int(255 / qMax(1.0, channelLevels - 1)), 255);
+    QVector<quint32> addRows(map->size * width, 0);
+    QVector<quint32> subRows(map->size * width, 0);
+    for (int row = 0; row < map->size; ++row) {
+        for (int x = 0; x < width; ++x) {
+            int rank = map->rank(positiveModulo(x + offset.x(), map->size), row);
+            int threshold = (2 * rank + 1) * spread / (2 * levels) - spread / 2;
+            quint32 value = qAbs(threshold);
+            value = value | (value << 8) | (value << 16);
+            if (threshold > 0)
+                addRows[row * width + x] = value;
+            else
+                subRows[row * width + x] = value;
+        }
+    }
+
+    QImage result(argbImage.width(), argbImage.height(), QImage::Format_Indexed8);
+    result.setColorTable(mapper.colorTable());
+    result.setOffset(image.offset());
+
+    OrderedDitherStrip ditherStrip;
+    ditherStrip.image = &argbImage;
+    ditherStrip.mapper = &mapper;
+    ditherStrip.addRows = addRows.constData();
+    ditherStrip.subRows = subRows.constData();
+    ditherStrip.mapSize = map->size;
+    ditherStrip.offsetY = offset.y();
+    ditherStrip.bits = result.bits();
+    ditherStrip.bytesPerLine = result.bytesPerLine();
+
+    QVector<RowRange> strips = splitRows(argbImage.height());
+    QtConcurrent::blockingMap(strips, ditherStrip);
+    return result;
+}
+
+QImage QGifDitherer::errorDiffusion(const QImage &image) const
+{
+    QImage argbImage = image;
+    if (image.format() != QImage::Format_RGB32 && image.format() != QImage::Format_ARGB32)
+        argbImage = image.convertToFormat(QImage::Format_ARGB32);
+
+    QImage result(argbImage.width(), argbImage.height(), QImage::Format_Indexed8);
+    result.setColorTable(mapper.colorTable());
+    result.setOffset(image.offset());
+
+    QAtomicInt nextRow(0);
+    QVector<QAtomicInt> progress(argbImage.height());
+    QVector<qint16> errors(argbImage.width() * argbImage.height() * 3);
+
+    ErrorDiffusionWorker worker;
+    worker.image = &argbImage;
+    worker.mapper = &mapper;
+    worker.kernel = mode == QGifImage::SierraDither ? &sierraKernel : &floydSteinbergKernel;
+    worker.nextRow = &nextRow;
+    worker.progress = progress.data();
+    worker.errors = errors.data();
+    worker.bits = result.bits();
+    worker.bytesPerLine = result.bytesPerLine();
+
+    //Each worker processes rows until all of them have been claimed.
+    QVector<int> workers(qBound(1, QThread::idealThreadCount(), argbImage.height()));
+    QtConcurrent::blockingMap(workers, worker);
+    return result;
+}
@@ -0,0 +1,49 @@
+/****************************************************************************
+** Copyright (c) 2013 Debao Zhang <hello@debao.me>
+** All right reserved.
+**
+** Permission is hereby granted, free of charge, to any person obtaining
+** a copy of this software and associated documentation files (the
+** "Software"), to deal in the Software without restriction, including
+** without limitation the rights to use, copy, modify, merge, publish,
+** distribute, sublicense, and/or sell copies of the Software, and to
+** permit persons to whom the Software is furnished to do so, subject to
+** the following conditions:
+**
+** The above copyright notice and this permission notice shall be
+** included in all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+** EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+** MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+** NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+** LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+** OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+** WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+**
+****************************************************************************/
+#ifndef QGIFDITHER_P_H
+#define QGIFDITHER_P_H
+
+#include "qgifimage.h"
+#include "qgifquantizer_p.h"
+
+#include <QImage>
+#include <QPoint>
+
+class QGifDitherer
+{
+public:
+    QGifDitherer(QGifImage::DitherMode mode, const QGifColorMapper &mapper);
+
+    QImage dither(const QImage &image, const QPoint &offset = QPoint()) const;
+
+private:
+    QImage orderedDither(const QImage &image, const QPoint &offset) const;
+    QImage errorDiffusion(const QImage &image) const;
+
+    QGifImage::DitherMode mode;
+    QGifColorMapper mapper;
+};
+
+#endif // QGIFDITHER_P_H
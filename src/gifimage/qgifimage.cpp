@@ -24,33 +24,779 @@
 ****************************************************************************/
 #include "qgifimage.h"
 #include "qgifimage_p.h"
+#include "qgifdither_p.h"
+#include "qgifquantizer_p.h"
+#include <QBuffer>
 #include <QFile>
 #include <QImage>
 #include <QDebug>
 #include <QScopedPointer>
+#include <QThread>
+#include <QtConcurrent>
+#include <QPair>
+#include <string.h>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 namespace
 {
+/*
+    giflib writes the file in many small pieces, 255 bytes at most. They
+    are gathered here, so that the device is written by large blocks.
+ */
+class GifWriteBuffer
+{
+public:
+    explicit GifWriteBuffer(QIODevice *device)
+        : device(device), redirection(0), failed(false)
+    {
+        buffer.reserve(capacity);
+    }
+
+    //The bytes written from now on are appended to \a bytes instead of
+    //being written to the device, until it is called again with 0.
+    void redirect(QByteArray *bytes)
+    {
+        redirection = bytes;
+    }
+
+    int write(const GifByteType *data, int size)
+    {
+        if (failed)
+            return -1;
+        if (redirection) {
+            redirection->append(reinterpret_cast<const char *>(data), size);
+            return size;
+        }
+        if (buffer.size() + size > capacity && !flush())
+            return -1;
+        if (size >= capacity) {
+            if (device->write(reinterpret_cast<const char *>(data), size) != size) {
+                failed = true;
+                return -1;
+            }
+            return size;
+        }
+        buffer.append(reinterpret_cast<const char *>(data), size);
+        return size;
+    }
+
+    bool flush()
+    {
+        if (!failed && !buffer.isEmpty()) {
+            failed = device->write(buffer) != buffer.size();
+            buffer.resize(0);
+        }
+        return !failed;
+    }
+
+private:
+    static const int capacity = 64 * 1024;
+
+    QIODevice *device;
+    QByteArray buffer;
+    QByteArray *redirection;
+    bool failed;
+};
+
+struct GifColorMapDeleter
+{
+    static inline void cleanup(ColorMapObject *colorMap)
+    {
+        GifFreeMapObject(colorMap);
+    }
+};
+
+/*
+    Owns everything giflib allocates while a file is saved: the file handle
+    and the color maps shared by several frames are released on every exit
+    path. The allocations made by giflib in the meantime are counted.
+ */
+class GifSaveContext
+{
+public:
+    GifSaveContext(qint64 *bytesAllocated, qint64 *bytesFreed)
+        : gifFile(0), bytesAllocated(bytesAllocated), bytesFreed(bytesFreed)
+    {
+        counter.BytesAllocated = 0;
+        counter.BytesFreed = 0;
+        previousCounter = GifSetAllocCounter(&counter);
+    }
+
+    ~GifSaveContext()
+    {
+        foreach (ColorMapObject *colorMap, colorMaps)
+            GifFreeMapObject(colorMap);
+        if (gifFile)
+            EGifCloseFile(gifFile);
+        GifSetAllocCounter(previousCounter);
+        *bytesAllocated = counter.BytesAllocated;
+        *bytesFreed = counter.BytesFreed;
+    }
+
+    ColorMapObject *ownColorMap(ColorMapObject *colorMap)
+    {
+        colorMaps.append(colorMap);
+        return colorMap;
+    }
+
+    bool closeFile()
+    {
+        //The handle is freed by giflib even when the close fails.
+        GifFileType *file = gifFile;
+        gifFile = 0;
+        return EGifCloseFile(file) != GIF_ERROR;
+    }
+
+    GifFileType *gifFile;
+
+private:
+    Q_DISABLE_COPY(GifSaveContext)
+
+    GifAllocCounter counter;
+    GifAllocCounter *previousCounter;
+    QVector<ColorMapObject *> colorMaps;
+    qint64 *bytesAllocated;
+    qint64 *bytesFreed;
+};
+
 int writeToIODevice(GifFileType *gifFile, const GifByteType *data, int maxSize)
 {
-    return static_cast<QIODevice *>(gifFile->UserData)->write(reinterpret_cast<const char *>(data), maxSize);
+    return static_cast<GifWriteBuffer *>(gifFile->UserData)->write(data, maxSize);
 }
 
 int readFromIODevice(GifFileType *gifFile, GifByteType *data, int maxSize)
 {
     return static_cast<QIODevice *>(gifFile->UserData)->read(reinterpret_cast<char *>(data), maxSize);
 }
+
+//Max number of bytes reserved in advance by save() for a QBuffer.
+const qint64 maxReservedSize = 16 * 1024 * 1024;
+
+//Min number of pixels in each strip of a frame compressed in parallel.
+const qint64 minStripPixels = 256 * 1024;
+
+//Min number of pixels in each segment of a frame decoded in parallel.
+const unsigned long minSegmentPixels = 256 * 1024;
+
+//Number of bits searched for a clear code to start a segment from. A full
+//string table of 12 bits codes is cleared every 48K bits at most.
+const unsigned long clearSearchBits = 128 * 1024;
+
+//Max number of pixels sampled in each frame to build the global color table.
+const int maxHistogramSamples = 64 * 1024;
+
+//Sample step of the rows and the columns of \a image, so that at most
+//maxHistogramSamples pixels are sampled.
+int histogramSampleStep(const QImage &image)
+{
+    qint64 pixelCount = qint64(image.width()) * image.height();
+    int step = 1;
+    while (pixelCount / (qint64(step) * step) > maxHistogramSamples)
+        ++step;
+    return step;
+}
+
+struct FrameHistogram
+{
+    FrameHistogram() : image(0), sampleStep(1) {}
+    const QImage *image;
+    int sampleStep;
+    QGifColorHistogram histogram;
+};
+
+void computeFrameHistogram(FrameHistogram &frameHistogram)
+{
+    frameHistogram.histogram.addImage(*frameHistogram.image, frameHistogram.sampleStep);
+}
+
+int writeToByteArray(GifFileType *gifFile, const GifByteType *data, int maxSize)
+{
+    static_cast<QByteArray *>(gifFile->UserData)->append(reinterpret_cast<const char *>(data), maxSize);
+    return maxSize;
+}
+
+//Rows of a frame compressed on their own, from the first one in the order
+//they are written. The allocations made by giflib for the strip are
+//counted apart, as the worker threads do not see the counter of the
+//thread which saves.
+struct CompressedStrip
+{
+    CompressedStrip() : firstRow(0), rowCount(0), last(false), codeBits(0), error(0)
+    {
+        allocCounter.BytesAllocated = 0;
+        allocCounter.BytesFreed = 0;
+    }
+    int firstRow;
+    int rowCount;
+    bool last;
+    QByteArray codes;
+    unsigned long codeBits;
+    int error;
+    GifAllocCounter allocCounter;
+};
+
+struct StripCompressor
+{
+    typedef void result_type;
+
+    GifFileType *gifFile;
+    const QImage *image;
+    const int *rows;
+
+    void operator()(CompressedStrip &strip) const
+    {
+        int width = image->width();
+        QByteArray pixels(strip.rowCount * width, Qt::Uninitialized);
+        for (int idx = 0; idx < strip.rowCount; ++idx)
+            memcpy(pixels.data() + idx * width, image->constScanLine(rows[strip.firstRow + idx]), width);
+        GifAllocCounter *previousCounter = GifSetAllocCounter(&strip.allocCounter);
+        if (EGifCompressStrip(gifFile, reinterpret_cast<const GifPixelType *>(pixels.constData()), pixels.size(),
+                              strip.last, &strip.codes, writeToByteArray, &strip.codeBits, &strip.error) == GIF_ERROR
+                && strip.error == 0)
+            strip.error = E_GIF_ERR_WRITE_FAILED;
+        GifSetAllocCounter(previousCounter);
+    }
+};
+
+struct SegmentDecoder
+{
+    typedef void result_type;
+
+    const GifByteType *codes;
+    unsigned long codeBits;
+    int bitsPerPixel;
+    unsigned long pixelCount;
+
+    void operator()(GifCodeSegment &segment) const
+    {
+        DGifDecodeSegment(codes, codeBits, bitsPerPixel, pixelCount, &segment);
+    }
+};
+
+/*
+    Decode the codes of a frame from several clear codes at once, each
+    found near one of evenly spaced bits. The segments are joined in order.
+    A segment is kept only if the one before stops at a clear code which
+    ends right where it starts, otherwise the codes are decoded again from
+    where the one before stopped.
+ */
+int decodeImageInParallel(GifFileType *gifFile, const GifByteType *codes, unsigned long codeBits, int bitsPerPixel,
+                          GifPixelType *pixels, unsigned long pixelCount)
+{
+    unsigned long segmentCount = qMin(static_cast<unsigned long>(QThread::idealThreadCount()),
+                                      pixelCount / minSegmentPixels);
+    GifCodeSegment segment;
+    memset(&segment, 0, sizeof(segment));
+    segment.Stop = ~0UL;
+    QVector<GifCodeSegment> segments;
+    segments.append(segment);
+    for (unsigned long idx = 1; idx < segmentCount; ++idx) {
+        unsigned long from = qMax(codeBits / segmentCount * idx, segments.last().Start + 1);
+        segment.Start = DGifFindClearCode(codes, codeBits, bitsPerPixel, from, from + clearSearchBits);
+        if (segment.Start >= codeBits)
+            break;
+        segments.last().Stop = segment.Start;
+        segments.append(segment);
+    }
+
+    SegmentDecoder decoder;
+    decoder.codes = codes;
+    decoder.codeBits = codeBits;
+    decoder.bitsPerPixel = bitsPerPixel;
+    decoder.pixelCount = pixelCount;
+    if (segments.size() > 1)
+        QtConcurrent::blockingMap(segments, decoder);
+    else
+        decoder(segments[0]);
+
+    unsigned long decoded = 0;
+    int next = 1;
+    GifCodeSegment current = segments[0];
+    QVector<GifCodeSegment> serialSegments;
+    for (;;) {
+        if (current.Error != 0) {
+            gifFile->Error = current.Error;
+            break;
+        }
+        unsigned long count = qMin(current.PixelCount, pixelCount - decoded);
+        if (count > 0)
+            memcpy(pixels + decoded, current.Pixels, count);
+        decoded += count;
+        if (current.Finished || decoded == pixelCount)
+            break;
+
+        while (next < segments.size() && segments[next].Start < current.End)
+            ++next;
+        if (next < segments.size() && segments[next].Start == current.End) {
+            current = segments[next++];
+        } else {
+            memset(&segment, 0, sizeof(segment));
+            segment.Start = current.End;
+            segment.Stop = next < segments.size() ? segments[next].Start : ~0UL;
+            decoder(segment);
+            serialSegments.append(segment);
+            current = segment;
+        }
+    }
+    if (current.Error == 0 && decoded < pixelCount)
+        gifFile->Error = D_GIF_ERR_EOF_TOO_SOON;
+
+    foreach (const GifCodeSegment &segment, segments)
+        GifFree(segment.Pixels);
+    foreach (const GifCodeSegment &segment, serialSegments)
+        GifFree(segment.Pixels);
+    return current.Error == 0 && decoded == pixelCount ? GIF_OK : GIF_ERROR;
+}
+
+/*
+    dst[x] = indexMap[src[x]]. When the color table has no more than 16
+    colors, 16 pixels are remapped at once by a byte shuffle. The entries
+    of \a indexMap past the color table are 0, so the shuffle must give 0
+    for the indexes above 15 too.
+ */
+void remapIndexes(const uchar *src, uchar *dst, int width, const uchar *indexMap, int colorCount)
+{
+    int x = 0;
+#if defined(__SSSE3__)
+    if (colorCount <= 16) {
+        __m128i table = _mm_loadu_si128(reinterpret_cast<const __m128i *>(indexMap));
+        //Indexes above 15 get their high bit set, which shuffles in a 0.
+        __m128i outOfRange = _mm_set1_epi8(0x70);
+        for (; x + 16 <= width; x += 16) {
+            __m128i indexes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x));
+            indexes = _mm_adds_epu8(indexes, outOfRange);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), _mm_shuffle_epi8(table, indexes));
+        }
+    }
+#elif defined(__ARM_NEON__) && defined(__aarch64__)
+    if (colorCount <= 16) {
+        uint8x16_t table = vld1q_u8(indexMap);
+        for (; x + 16 <= width; x += 16)
+            vst1q_u8(dst + x, vqtbl1q_u8(table, vld1q_u8(src + x)));
+    }
+#else
+    Q_UNUSED(colorCount);
+#endif
+    for (; x < width; ++x)
+        dst[x] = indexMap[src[x]];
+}
+
+/*
+    Remove the colors which are not used by the pixels of the indexed
+    \a image from its color table. If \a sortByUsage is true, the colors
+    are sorted by decreasing usage, otherwise their order is kept.
+ */
+QImage optimizeColorTable(const QImage &image, bool sortByUsage)
+{
+    QVector<QRgb> colorTable = image.colorTable();
+
+    //Four interleaved counters avoid the stalls on runs of the same index.
+    quint32 counts[4][256];
+    memset(counts, 0, sizeof(counts));
+    for (int y = 0; y < image.height(); ++y) {
+        const uchar *line = image.constScanLine(y);
+        int x = 0;
+        for (; x + 4 <= image.width(); x += 4) {
+            ++counts[0][line[x]];
+            ++counts[1][line[x + 1]];
+            ++counts[2][line[x + 2]];
+            ++counts[3][line[x + 3]];
+        }
+        for (; x < image.width(); ++x)
+            ++counts[0][line[x]];
+    }
+
+    QVector<QPair<quint32, int> > usedColors;
+    for (int idx = 0; idx < colorTable.size(); ++idx) {
+        quint32 count = counts[0][idx] + counts[1][idx] + counts[2][idx] + counts[3][idx];
+        if (count)
+            usedColors.append(qMakePair(~count, idx));
+    }
+    if (usedColors.isEmpty())
+        return image;
+    if (sortByUsage)
+        qSort(usedColors.begin(), usedColors.end());
+
+    bool unchanged = usedColors.size() == colorTable.size();
+    uchar indexMap[256];
+    memset(indexMap, 0, sizeof(indexMap));
+    QVector<QRgb> optimizedTable;
+    for (int idx = 0; idx < usedColors.size(); ++idx) {
+        unchanged &= usedColors[idx].second == idx;
+        indexMap[usedColors[idx].second] = idx;
+        optimizedTable.append(colorTable[usedColors[idx].second]);
+    }
+    if (unchanged)
+        return image;
+
+    QImage result(image.width(), image.height(), QImage::Format_Indexed8);
+    result.setColorTable(optimizedTable);
+    result.setOffset(image.offset());
+    for (int y = 0; y < image.height(); ++y)
+        remapIndexes(image.constScanLine(y), result.scanLine(y), image.width(), indexMap, colorTable.size());
+    return result;
+}
+
+/*
+    Replace each pixel of the indexed \a image by the pixel on its left,
+    or else by the one above it, when their colors are no further apart
+    than \a level. The longer runs and repeated lines compress much better.
+    The pixels of \a transIndex are neither replaced nor copied.
+ */
+void applyLossyLevel(QImage *image, int level, int transIndex)
+{
+    QVector<QRgb> colorTable = image->colorTable();
+    int colorCount = colorTable.size();
+    int maxDistance = level * level;
+    QVector<uchar> closeColors(colorCount * colorCount, 0);
+    for (int i = 0; i < colorCount; ++i) {
+        for (int j = 0; j < colorCount; ++j) {
+            int dr = qRed(colorTable[i]) - qRed(colorTable[j]);
+            int dg = qGreen(colorTable[i]) - qGreen(colorTable[j]);
+            int db = qBlue(colorTable[i]) - qBlue(colorTable[j]);
+            closeColors[i * colorCount + j] = i != transIndex && j != transIndex
+                    && dr * dr + dg * dg + db * db <= maxDistance;
+        }
+    }
+
+    const uchar *close = closeColors.constData();
+    for (int y = 0; y < image->height(); ++y) {
+        uchar *line = image->scanLine(y);
+        const uchar *above = y > 0 ? image->constScanLine(y - 1) : 0;
+        for (int x = 0; x < image->width(); ++x) {
+            const uchar *closeToPixel = close + line[x] * colorCount;
+            if (x > 0 && closeToPixel[line[x - 1]])
+                line[x] = line[x - 1];
+            else if (above && closeToPixel[above[x]])
+                line[x] = above[x];
+        }
+    }
+}
+
+//Coarse normalized histogram, 3 bits per primary color, used to compare frames.
+QVector<float> histogramFeature(const QGifColorHistogram &histogram)
+{
+    QVector<QRgb> colors;
+    QVector<quint32> counts;
+    histogram.getColors(&colors, &counts);
+
+    QVector<float> feature(512, 0.0f);
+    quint64 total = 0;
+    for (int idx = 0; idx < colors.size(); ++idx) {
+        int bin = ((qRed(colors[idx]) >> 5) << 6) | ((qGreen(colors[idx]) >> 5) << 3) | (qBlue(colors[idx]) >> 5);
+        feature[bin] += counts[idx];
+        total += counts[idx];
+    }
+    if (total) {
+        for (int bin = 0; bin < feature.size(); ++bin)
+            feature[bin] /= total;
+    }
+    return feature;
+}
+
+float featureDistance(const QVector<float> &f1, const QVector<float> &f2)
+{
+    float distance = 0;
+    for (int idx = 0; idx < f1.size(); ++idx)
+        distance += (f1[idx] - f2[idx]) * (f1[idx] - f2[idx]);
+    return distance;
+}
+
+/*
+    K-means clustering of the features in up to \a k clusters. The centers
+    are seeded with the farthest point method, starting from the first
+    feature, so that the result is deterministic.
+ */
+QVector<int> clusterFeatures(const QVector<QVector<float> > &features, int k)
+{
+    QVector<int> clusters(features.size(), 0);
+    if (features.isEmpty())
+        return clusters;
+
+    QVector<QVector<float> > centers;
+    centers.append(features[0]);
+    QVector<float> distances(features.size());
+    for (int idx = 0; idx < features.size(); ++idx)
+        distances[idx] = featureDistance(features[idx], centers[0]);
+    while (centers.size() < k) {
+        int farthest = 0;
+        for (int idx = 1; idx < features.size(); ++idx) {
+            if (distances[idx] > distances[farthest])
+                farthest = idx;
+        }
+        if (distances[farthest] <= 0)
+            break;
+        centers.append(features[farthest]);
+        for (int idx = 0; idx < features.size(); ++idx)
+            distances[idx] = qMin(distances[idx], featureDistance(features[idx], centers.last()));
+    }
+
+    for (int iteration = 0; iteration < 16; ++iteration) {
+        bool changed = false;
+        for (int idx = 0; idx < features.size(); ++idx) {
+            int cluster = 0;
+            float minDistance = featureDistance(features[idx], centers[0]);
+            for (int c = 1; c < centers.size(); ++c) {
+                float distance = featureDistance(features[idx], centers[c]);
+                if (distance < minDistance) {
+                    minDistance = distance;
+                    cluster = c;
+                }
+            }
+            if (iteration == 0 || clusters[idx] != cluster)
+                changed = true;
+            clusters[idx] = cluster;
+        }
+        if (!changed)
+            break;
+
+        for (int c = 0; c < centers.size(); ++c) {
+            QVector<float> center(centers[c].size(), 0.0f);
+            int memberCount = 0;
+            for (int idx = 0; idx < features.size(); ++idx) {
+                if (clusters[idx] != c)
+                    continue;
+                for (int bin = 0; bin < center.size(); ++bin)
+                    center[bin] += features[idx][bin];
+                ++memberCount;
+            }
+            if (!memberCount)
+                continue;
+            for (int bin = 0; bin < center.size(); ++bin)
+                center[bin] /= memberCount;
+            centers[c] = center;
+        }
+    }
+
+    //Renumber the clusters in order of first use, and drop the empty ones.
+    QVector<int> numbers(centers.size(), -1);
+    int clusterCount = 0;
+    for (int idx = 0; idx < clusters.size(); ++idx) {
+        if (numbers[clusters[idx]] == -1)
+            numbers[clusters[idx]] = clusterCount++;
+        clusters[idx] = numbers[clusters[idx]];
+    }
+    return clusters;
+}
+
+//Hash of the pixels and the color table of \a image, padding bytes excluded.
+quint64 imageHash(const QImage &image)
+{
+    const quint64 multiplier = Q_UINT64_C(0x9e3779b97f4a7c15);
+    quint64 hash = quint64(image.width()) << 32 | quint64(image.height());
+    foreach (QRgb color, image.colorTable())
+        hash = (hash ^ color) * multiplier;
+
+    int lineSize = image.width() * image.depth() / 8;
+    for (int y = 0; y < image.height(); ++y) {
+        const uchar *line = image.constScanLine(y);
+        int x = 0;
+        for (; x + 8 <= lineSize; x += 8) {
+            quint64 word;
+            memcpy(&word, line + x, 8);
+            hash = (hash ^ word) * multiplier;
+            hash ^= hash >> 32;
+        }
+        for (; x < lineSize; ++x)
+            hash = (hash ^ line[x]) * multiplier;
+    }
+    return hash;
+}
+
+bool bytesEqual(const uchar *bytes1, const uchar *bytes2, int size)
+{
+    int x = 0;
+#if defined(__SSE2__)
+    for (; x + 16 <= size; x += 16) {
+        __m128i v1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes1 + x));
+        __m128i v2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes2 + x));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)) != 0xffff)
+            return false;
+    }
+#elif defined(__ARM_NEON__) && defined(__aarch64__)
+    for (; x + 16 <= size; x += 16) {
+        if (vminvq_u8(vceqq_u8(vld1q_u8(bytes1 + x), vld1q_u8(bytes2 + x))) != 0xff)
+            return false;
+    }
+#endif
+    return memcmp(bytes1 + x, bytes2 + x, size - x) == 0;
+}
+
+/*
+    The pixels of \a image as drawn on the canvas: the pixels of the
+    transparent color are left fully transparent, the others are opaque.
+ */
+QImage frameLayer(const QImage &image, const QColor &transColor)
+{
+    QImage layer = image.convertToFormat(QImage::Format_ARGB32);
+    QRgb transRgb = transColor.rgb() & 0xffffff;
+    for (int y = 0; y < layer.height(); ++y) {
+        QRgb *line = reinterpret_cast<QRgb *>(layer.scanLine(y));
+        for (int x = 0; x < layer.width(); ++x) {
+            if (transColor.isValid() && (line[x] & 0xffffff) == transRgb)
+                line[x] = 0;
+            else
+                line[x] |= 0xff000000;
+        }
+    }
+    return layer;
+}
+
+void drawLayer(QImage *canvas, const QImage &layer, const QPoint &offset)
+{
+    QRect rect = QRect(offset, layer.size()) & canvas->rect();
+    for (int y = rect.top(); y <= rect.bottom(); ++y) {
+        const QRgb *src = reinterpret_cast<const QRgb *>(layer.constScanLine(y - offset.y())) - offset.x();
+        QRgb *dst = reinterpret_cast<QRgb *>(canvas->scanLine(y));
+        for (int x = rect.left(); x <= rect.right(); ++x) {
+            if (qAlpha(src[x]))
+                dst[x] = src[x];
+        }
+    }
+}
+
+//Bounding rectangle of the pixels of \a area which differ in the two canvases.
+QRect changedRect(const QImage &canvas1, const QImage &canvas2, const QRect &area)
+{
+    int left = area.right() + 1;
+    int right = area.left() - 1;
+    int top = -1;
+    int bottom = -1;
+    for (int y = area.top(); y <= area.bottom(); ++y) {
+        const QRgb *line1 = reinterpret_cast<const QRgb *>(canvas1.constScanLine(y));
+        const QRgb *line2 = reinterpret_cast<const QRgb *>(canvas2.constScanLine(y));
+        if (bytesEqual(reinterpret_cast<const uchar *>(line1 + area.left()),
+                       reinterpret_cast<const uchar *>(line2 + area.left()), area.width() * 4))
+            continue;
+        for (int x = area.left(); x < left; ++x) {
+            if (line1[x] != line2[x]) {
+                left = x;
+                break;
+            }
+        }
+        for (int x = area.right(); x > right; --x) {
+            if (line1[x] != line2[x]) {
+                right = x;
+                break;
+            }
+        }
+        if (top == -1)
+            top = y;
+        bottom = y;
+    }
+    if (top == -1)
+        return QRect();
+    return QRect(QPoint(left, top), QPoint(right, bottom));
+}
+
+/*
+    Returns true if drawing \a layer at \a offset, clipped to \a rect, turns
+    \a canvas into \a target: the transparent pixels of the layer must show
+    the right pixels already.
+ */
+bool layerCompletes(const QImage &layer, const QPoint &offset, const QImage &canvas,
+                    const QImage &target, const QRect &rect)
+{
+    for (int y = rect.top(); y <= rect.bottom(); ++y) {
+        const QRgb *src = reinterpret_cast<const QRgb *>(layer.constScanLine(y - offset.y())) - offset.x();
+        const QRgb *line1 = reinterpret_cast<const QRgb *>(canvas.constScanLine(y));
+        const QRgb *line2 = reinterpret_cast<const QRgb *>(target.constScanLine(y));
+        for (int x = rect.left(); x <= rect.right(); ++x) {
+            if (!qAlpha(src[x]) && line1[x] != line2[x])
+                return false;
+        }
+    }
+    return true;
+}
+
+/*
+    Returns true if the pixels of \a rect in \a target can be written as
+    they are: none of them is transparent or of the \a transColor.
+ */
+bool isOpaqueArea(const QImage &target, const QRect &rect, const QColor &transColor)
+{
+    QRgb transRgb = transColor.rgb() | 0xff000000;
+    for (int y = rect.top(); y <= rect.bottom(); ++y) {
+        const QRgb *line = reinterpret_cast<const QRgb *>(target.constScanLine(y));
+        for (int x = rect.left(); x <= rect.right(); ++x) {
+            if (!qAlpha(line[x]) || (transColor.isValid() && line[x] == transRgb))
+                return false;
+        }
+    }
+    return true;
+}
+
+//Largest delay of a graphics control block, in 1/100 seconds.
+const int maxFrameDelay = 0xFFFF;
+
+/*
+    Write the graphics control block of a frame shown for \a delay 1/100
+    seconds.
+ */
+bool writeGraphicsControlBlock(GifFileType *gifFile, int delay, int disposalMode, int transparentIndex)
+{
+    GraphicsControlBlock gcbBlock;
+    gcbBlock.DisposalMode = disposalMode;
+    gcbBlock.UserInputFlag = false;
+    gcbBlock.DelayTime = delay;
+    gcbBlock.TransparentColor = transparentIndex;
+
+    GifByteType extension[4];
+    int extensionLength = EGifGCBToExtension(&gcbBlock, extension);
+    return EGifPutExtension(gifFile, GRAPHICS_EXT_FUNC_CODE, extensionLength, extension) != GIF_ERROR;
+}
+
+/*
+    Write the \a encodedFrame bytes, made of the image descriptor and the
+    compressed pixels, after their graphics control block. A \a delay too
+    long for one graphics control block is split over copies of the frame.
+    Only the last copy is disposed of as asked, the others are left in place,
+    unless the canvas must be restored to what it was before the first copy.
+ */
+bool writeEncodedFrame(GifFileType *gifFile, GifWriteBuffer *writeBuffer, const QByteArray &encodedFrame,
+                       int delay, int disposalMode, int transparentIndex)
+{
+    const GifByteType *data = reinterpret_cast<const GifByteType *>(encodedFrame.constData());
+    do {
+        int frameDelay = qMin(delay, maxFrameDelay);
+        int frameDisposalMode = disposalMode;
+        if (delay > maxFrameDelay && disposalMode != DISPOSE_PREVIOUS)
+            frameDisposalMode = DISPOSE_DO_NOT;
+        if (!writeGraphicsControlBlock(gifFile, frameDelay, frameDisposalMode, transparentIndex)
+                || writeBuffer->write(data, encodedFrame.size()) != encodedFrame.size())
+            return false;
+        delay -= frameDelay;
+    } while (delay > 0);
+    return true;
+}
 }
 
 QGifImagePrivate::QGifImagePrivate(QGifImage *p)
-    : loopCount(0), defaultDelayTime(1000), q_ptr(p)
+    : loopCount(0), defaultDelayTime(1000), autoGlobalColorTable(false), quantizer(0), ditherMode(QGifImage::NoDither), paletteReuseTolerance(0), paletteGroupCount(0), reorderColorTable(false), mergeDuplicateFrames(false), autoDisposalMode(false), maxColorCount(256), lossyLevel(0), frameDropCount(0), targetSize(0), compressionLevel(QGifImage::NormalCompression), clearPolicy(QGifImage::FixedClear), parallelCompression(false), parallelDecoding(false), lastSaveBytesAllocated(0), lastSaveBytesFreed(0), builtMaxColorCount(0), q_ptr(p)
 {
 
 }
 
 QGifImagePrivate::~QGifImagePrivate()
 {
+    delete quantizer;
+}
 
+/*
+    Mark all the frames as dirty, after a change of the settings which
+    affect how every frame is encoded.
+ */
+void QGifImagePrivate::invalidateFrames()
+{
+    for (int idx=0; idx<frameInfos.size(); ++idx)
+        frameInfos[idx].dirty = true;
 }
 
 QVector<QRgb> QGifImagePrivate::colorTableFromColorMapObject(ColorMapObject *colorMap, int transColorIndex) const
@@ -74,23 +820,20 @@ ColorMapObject *QGifImagePrivate::colorTableToColorMapObject(QVector<QRgb> color
     if (colorTable.isEmpty())
         return 0;
 
-    ColorMapObject *cmap = (ColorMapObject *)malloc(sizeof(ColorMapObject));
     // num of colors must be a power of 2
     int numColors = 1 << GifBitSize(colorTable.size());
-    cmap->ColorCount = numColors;
-    //Maybe a bug of giflib, BitsPerPixel is used as size of the color table size.
-    cmap->BitsPerPixel = GifBitSize(colorTable.size()); //Todo!
-    cmap->SortFlag = false;
+    //Allocated by giflib, so that it is freed and accounted by giflib too.
+    ColorMapObject *cmap = GifMakeMapObject(numColors, 0);
+    if (!cmap)
+        return 0;
 
-    GifColorType* colorValues = (GifColorType*)calloc(numColors, sizeof(GifColorType));
+    GifColorType *colorValues = cmap->Colors;
     for(int idx=0; idx < colorTable.size(); ++idx) {
         colorValues[idx].Red = qRed(colorTable[idx]);
         colorValues[idx].Green = qGreen(colorTable[idx]);
         colorValues[idx].Blue = qBlue(colorTable[idx]);
     }
 
-    cmap->Colors = colorValues;
-
     return cmap;
 }
 
@@ -112,11 +855,137 @@ QSize QGifImagePrivate::getCanvasSize() const
     return QSize(width, height);
 }
 
+QColor QGifImagePrivate::getFrameTransparentColor(const QGifFrameInfoData &frameInfo) const
+{
+    return frameInfo.transparentColor.isValid() ? frameInfo.transparentColor : defaultTransparentColor;
+}
+
+int QGifImagePrivate::getFrameDelay(const QGifFrameInfoData &frameInfo) const
+{
+    return frameInfo.delayTime != -1 ? frameInfo.delayTime : defaultDelayTime;
+}
+
+/*
+    Returns true if \a frameInfo2 looks exactly like \a frameInfo1 once
+    drawn, so that \a frameInfo1 can simply be shown longer. The hash of
+    the images rejects most of the different frames at once.
+ */
+bool QGifImagePrivate::isDuplicateFrame(const QGifFrameInfoData &frameInfo1, const QGifFrameInfoData &frameInfo2) const
+{
+    const QImage &image1 = frameInfo1.image;
+    const QImage &image2 = frameInfo2.image;
+    if (frameInfo1.offset != frameInfo2.offset || frameInfo1.interlace != frameInfo2.interlace
+            || getFrameTransparentColor(frameInfo1) != getFrameTransparentColor(frameInfo2)
+            || image1.size() != image2.size() || image1.format() != image2.format())
+        return false;
+
+    if (!frameInfo1.imageHashValid) {
+        frameInfo1.imageHash = imageHash(image1);
+        frameInfo1.imageHashValid = true;
+    }
+    if (!frameInfo2.imageHashValid) {
+        frameInfo2.imageHash = imageHash(image2);
+        frameInfo2.imageHashValid = true;
+    }
+    if (frameInfo1.imageHash != frameInfo2.imageHash || image1.colorTable() != image2.colorTable())
+        return false;
+
+    //The last byte of the lines of images with less than 8 bits per pixel
+    //may hold padding bits.
+    if (image1.depth() < 8)
+        return image1 == image2;
+    int lineSize = image1.width() * image1.depth() / 8;
+    for (int y = 0; y < image1.height(); ++y) {
+        if (!bytesEqual(image1.constScanLine(y), image2.constScanLine(y), lineSize))
+            return false;
+    }
+    return true;
+}
+
+/*
+    Choose the disposal mode of each run of frames, among leaving it in
+    place, clearing it to the background and restoring what was there
+    before, so that the area of the canvas changed by the next run is the
+    smallest. Returns the frames to write: only the changed area is kept,
+    cut from the frame itself, or from the canvas when the transparent
+    pixels of the frame would let wrong pixels show through.
+ */
+QList<QGifFrameInfoData> QGifImagePrivate::planFrameDisposals(const QVector<QGifFrameRun> &frameRuns) const
+{
+    const QGifImage::DisposalMode disposalModes[] = {
+        QGifImage::DoNotDispose, QGifImage::DisposeToBackground, QGifImage::DisposeToPrevious
+    };
+    QRect canvasRect(QPoint(0, 0), getCanvasSize());
+    QImage emptyCanvas(canvasRect.size(), QImage::Format_ARGB32);
+    emptyCanvas.fill(0);
+
+    //The canvas once the previous frame is drawn, and before it was.
+    QImage canvas = emptyCanvas;
+    QImage previousCanvas = emptyCanvas;
+    QRect writtenRect;
+    QList<QGifFrameInfoData> plannedFrames;
+    for (int run = 0; run < frameRuns.size(); ++run) {
+        const QGifFrameInfoData &frameInfo = frameInfos.at(frameRuns[run].first);
+        QColor transColor = getFrameTransparentColor(frameInfo);
+        QImage layer = frameLayer(frameInfo.image, transColor);
+        QRect frameRect = QRect(frameInfo.offset, frameInfo.image.size()) & canvasRect;
+        QImage target = canvas;
+        drawLayer(&target, layer, frameInfo.offset);
+
+        QGifFrameInfoData plannedFrame = frameInfo;
+        plannedFrame.disposalMode = QGifImage::DoNotDispose;
+        if (run > 0) {
+            QImage backgroundCanvas = canvas;
+            for (int y = writtenRect.top(); y <= writtenRect.bottom(); ++y)
+                memset(backgroundCanvas.scanLine(y) + writtenRect.left() * 4, 0, writtenRect.width() * 4);
+            const QImage disposedCanvases[] = { canvas, backgroundCanvas, previousCanvas };
+
+            //Leaving the previous frame in place always works, as the whole
+            //frame can be drawn then.
+            int bestMode = -1;
+            QRect bestRect;
+            QImage bestImage;
+            QRect area = frameRect | writtenRect;
+            for (int mode = 0; mode < 3 && !frameRect.isEmpty(); ++mode) {
+                const QImage &disposedCanvas = disposedCanvases[mode];
+                QRect rect = changedRect(disposedCanvas, target, area);
+                if (rect.isEmpty())
+                    rect = QRect(frameRect.topLeft(), QSize(1, 1));
+                if (bestMode != -1 && rect.width() * rect.height() >= bestRect.width() * bestRect.height())
+                    continue;
+
+                QImage image;
+                if (frameRect.contains(rect) && layerCompletes(layer, frameInfo.offset, disposedCanvas, target, rect))
+                    image = frameInfo.image.copy(rect.translated(-frameInfo.offset));
+                else if (isOpaqueArea(target, rect, transColor))
+                    image = target.copy(rect).convertToFormat(QImage::Format_RGB32);
+                else
+                    continue;
+                bestMode = mode;
+                bestRect = rect;
+                bestImage = image;
+            }
+            if (bestMode != -1) {
+                plannedFrame.image = bestImage;
+                plannedFrame.offset = bestRect.topLeft();
+            } else {
+                bestMode = 0;
+            }
+            plannedFrames.last().disposalMode = disposalModes[bestMode];
+            previousCanvas = disposedCanvases[bestMode];
+        }
+        writtenRect = QRect(plannedFrame.offset, plannedFrame.image.size()) & canvasRect;
+        canvas = target;
+        plannedFrames.append(plannedFrame);
+    }
+    return plannedFrames;
+}
+
 int QGifImagePrivate::getFrameTransparentColorIndex(const QGifFrameInfoData &frameInfo) const
 {
     int index = -1;
 
-    QColor transColor = frameInfo.transparentColor.isValid() ? frameInfo.transparentColor : defaultTransparentColor;
+    QColor transColor = getFrameTransparentColor(frameInfo);
 
     if (transColor.isValid()) {
         if (!frameInfo.image.colorTable().isEmpty())
@@ -128,20 +997,227 @@ int QGifImagePrivate::getFrameTransparentColorIndex(const QGifFrameInfoData &fra
     return index;
 }
 
-bool QGifImagePrivate::load(QIODevice *device)
+QImage QGifImagePrivate::quantizeFrame(const QGifFrameInfoData &frameInfo) const
+{
+    QGifColorHistogram histogram;
+    histogram.addImage(frameInfo.image);
+
+    //Make sure that the transparent color is kept as is in the color table.
+    QColor transColor = getFrameTransparentColor(frameInfo);
+    bool keepTransColor = transColor.isValid() && histogram.containsColor(transColor.rgb());
+    if (keepTransColor)
+        histogram.removeColor(transColor.rgb());
+
+    int maxColors = qMax(1, encodeLevel.maxColorCount - (keepTransColor ? 1 : 0));
+    QVector<QRgb> colors;
+    QVector<quint32> counts;
+    histogram.getColors(&colors, &counts);
+    QVector<QRgb> colorTable = colors;
+    if (colors.size() > maxColors) {
+        if (quantizer)
+            colorTable = quantizer->colorTable(colors, counts, maxColors);
+        else
+            colorTable = QGifMedianCutQuantizer().colorTable(colors, counts, maxColors);
+    }
+    if (keepTransColor)
+        colorTable.append(transColor.rgb());
+
+    return mapFrame(frameInfo, colorTable);
+}
+
+/*
+    Map the image of the frame to \a colorTable, with the dither mode.
+    The transparent pixels are never dithered.
+ */
+QImage QGifImagePrivate::mapFrame(const QGifFrameInfoData &frameInfo, const QVector<QRgb> &colorTable) const
+{
+    QColor transColor = getFrameTransparentColor(frameInfo);
+    QGifColorMapper mapper(colorTable, transColor.isValid() ? colorTable.indexOf(transColor.rgb()) : -1);
+    if (ditherMode == QGifImage::NoDither)
+        return mapper.map(frameInfo.image);
+    return QGifDitherer(ditherMode, mapper).dither(frameInfo.image, frameInfo.offset);
+}
+
+/*
+    Return whether the frame can be mapped to \a colorTable instead of
+    being quantized: the root mean square distance between the pixels and
+    their nearest colors must not exceed the palette reuse tolerance.
+ */
+bool QGifImagePrivate::canReuseColorTable(const QGifFrameInfoData &frameInfo, const QVector<QRgb> &colorTable) const
+{
+    if (colorTable.isEmpty())
+        return false;
+
+    QGifColorHistogram histogram;
+    histogram.addImage(frameInfo.image, histogramSampleStep(frameInfo.image));
+
+    int transIndex = -1;
+    QColor transColor = getFrameTransparentColor(frameInfo);
+    if (transColor.isValid() && histogram.containsColor(transColor.rgb())) {
+        transIndex = colorTable.indexOf(transColor.rgb());
+        if (transIndex == -1)
+            return false;
+        histogram.removeColor(transColor.rgb());
+    }
+
+    QVector<QRgb> colors;
+    QVector<quint32> counts;
+    histogram.getColors(&colors, &counts);
+    QSharedPointer<QGifColorLookup> lookup = QGifColorLookup::get(colorTable, transIndex);
+    qint64 pixelCount = 0;
+    qint64 error = 0;
+    for (int idx = 0; idx < colors.size(); ++idx) {
+        QRgb color = colorTable[lookup->nearestOpaqueIndex(colors[idx])];
+        int dr = qRed(colors[idx]) - qRed(color);
+        int dg = qGreen(colors[idx]) - qGreen(color);
+        int db = qBlue(colors[idx]) - qBlue(color);
+        error += qint64(dr * dr + dg * dg + db * db) * counts[idx];
+        pixelCount += counts[idx];
+    }
+    return error <= qint64(paletteReuseTolerance) * paletteReuseTolerance * pixelCount;
+}
+
+/*
+    Compute the histograms of subsampled frames, in parallel.
+ */
+QVector<QGifColorHistogram> QGifImagePrivate::computeFrameHistograms() const
+{
+    //The histograms are kept with the frames, only the new frames are sampled.
+    QVector<FrameHistogram> frameHistograms;
+    QVector<int> frameIndexes;
+    for (int idx=0; idx<frameInfos.size(); ++idx) {
+        if (frameInfos[idx].histogramValid)
+            continue;
+        FrameHistogram frameHistogram;
+        frameHistogram.image = &frameInfos[idx].image;
+        frameHistogram.sampleStep = histogramSampleStep(frameInfos[idx].image);
+        frameHistograms.append(frameHistogram);
+        frameIndexes.append(idx);
+    }
+    QtConcurrent::blockingMap(frameHistograms, computeFrameHistogram);
+    for (int idx=0; idx<frameIndexes.size(); ++idx) {
+        const QGifFrameInfoData &frameInfo = frameInfos[frameIndexes[idx]];
+        frameInfo.histogram = frameHistograms[idx].histogram;
+        frameInfo.histogramValid = true;
+    }
+
+    QVector<QGifColorHistogram> histograms;
+    foreach (const QGifFrameInfoData &frameInfo, frameInfos)
+        histograms.append(frameInfo.histogram);
+    return histograms;
+}
+
+/*
+    Build one color table for the frames of \a frameIndexes, from their
+    merged \a histogram.
+ */
+QVector<QRgb> QGifImagePrivate::buildColorTable(QGifColorHistogram histogram, const QVector<int> &frameIndexes) const
+{
+    //Make sure that the transparent colors are kept as is in the color table.
+    QVector<QRgb> transColors;
+    foreach (int frameIndex, frameIndexes) {
+        QColor transColor = getFrameTransparentColor(frameInfos[frameIndex]);
+        if (transColor.isValid() && histogram.containsColor(transColor.rgb()) && !transColors.contains(transColor.rgb()))
+            transColors.append(transColor.rgb());
+    }
+    foreach (QRgb transColor, transColors)
+        histogram.removeColor(transColor);
+
+    int maxColors = qMax(1, encodeLevel.maxColorCount - transColors.size());
+    QVector<QRgb> colors;
+    QVector<quint32> counts;
+    histogram.getColors(&colors, &counts);
+    QVector<QRgb> colorTable = colors;
+    if (colors.size() > maxColors) {
+        if (quantizer)
+            colorTable = quantizer->colorTable(colors, counts, maxColors);
+        else
+            colorTable = QGifMedianCutQuantizer().colorTable(colors, counts, maxColors);
+    }
+    colorTable += transColors;
+
+    if (reorderColorTable) {
+        //Sort the colors by decreasing usage.
+        QSharedPointer<QGifColorLookup> lookup = QGifColorLookup::get(colorTable, -1);
+        QVector<quint64> usage(colorTable.size(), 0);
+        for (int idx = 0; idx < colors.size(); ++idx)
+            usage[lookup->nearestOpaqueIndex(colors[idx])] += counts[idx];
+        QVector<QPair<quint64, int> > sortedColors;
+        for (int idx = 0; idx < colorTable.size(); ++idx)
+            sortedColors.append(qMakePair(~usage[idx], idx));
+        qSort(sortedColors.begin(), sortedColors.end());
+        QVector<QRgb> sortedTable;
+        for (int idx = 0; idx < sortedColors.size(); ++idx)
+            sortedTable.append(colorTable[sortedColors[idx].second]);
+        colorTable = sortedTable;
+    }
+    return colorTable;
+}
+
+/*
+    Build one color table for all the frames, from the histograms of
+    subsampled frames.
+ */
+QVector<QRgb> QGifImagePrivate::buildGlobalColorTable() const
+{
+    QVector<QGifColorHistogram> frameHistograms = computeFrameHistograms();
+    QGifColorHistogram histogram;
+    QVector<int> frameIndexes;
+    for (int idx=0; idx<frameHistograms.size(); ++idx) {
+        histogram.addHistogram(frameHistograms[idx]);
+        frameIndexes.append(idx);
+    }
+    return buildColorTable(histogram, frameIndexes);
+}
+
+/*
+    Cluster the frames in up to paletteGroupCount groups of frames with
+    similar colors, and build one color table per group. The group of
+    each frame is stored in \a frameGroups.
+ */
+QVector<QVector<QRgb> > QGifImagePrivate::buildGroupColorTables(QVector<int> *frameGroups) const
 {
-    static int interlacedOffset[] = { 0, 4, 2, 1 }; /* The way Interlaced image should. */
-    static int interlacedJumps[] = { 8, 8, 4, 2 };    /* be read - offsets and jumps... */
+    QVector<QGifColorHistogram> frameHistograms = computeFrameHistograms();
+    QVector<QVector<float> > features;
+    foreach (const QGifColorHistogram &histogram, frameHistograms)
+        features.append(histogramFeature(histogram));
+    *frameGroups = clusterFeatures(features, paletteGroupCount);
+
+    int groupCount = 0;
+    foreach (int group, *frameGroups)
+        groupCount = qMax(groupCount, group + 1);
+
+    QVector<QVector<QRgb> > colorTables;
+    for (int group = 0; group < groupCount; ++group) {
+        QGifColorHistogram histogram;
+        QVector<int> frameIndexes;
+        for (int idx=0; idx<frameHistograms.size(); ++idx) {
+            if (frameGroups->at(idx) == group) {
+                histogram.addHistogram(frameHistograms[idx]);
+                frameIndexes.append(idx);
+            }
+        }
+        colorTables.append(buildColorTable(histogram, frameIndexes));
+    }
+    return colorTables;
+}
 
+bool QGifImagePrivate::load(QIODevice *device)
+{
     int error;
     GifFileType *gifFile = DGifOpen(device, readFromIODevice, &error);
     if (!gifFile) {
         qWarning(GifErrorString(error));
         return false;
     }
+    if (parallelDecoding)
+        DGifSetImageDecoder(gifFile, decodeImageInParallel);
 
-    if (DGifSlurp(gifFile) == GIF_ERROR)
+    if (DGifSlurp(gifFile) == GIF_ERROR) {
+        qWarning(GifErrorString(gifFile->Error));
+        DGifCloseFile(gifFile);
         return false;
+    }
 
     canvasSize.setWidth(gifFile->SWidth);
     canvasSize.setHeight(gifFile->SHeight);
@@ -158,291 +1234,1188 @@ bool QGifImagePrivate::load(QIODevice *device)
         int width = gifImage.ImageDesc.Width;
         int height = gifImage.ImageDesc.Height;
 
-        QGifFrameInfoData frameInfo;
-        GraphicsControlBlock gcb;
-        DGifSavedExtensionToGCB(gifFile, idx, &gcb);
-        int transColorIndex = gcb.TransparentColor;
+        QGifFrameInfoData frameInfo;
+        GraphicsControlBlock gcb;
+        DGifSavedExtensionToGCB(gifFile, idx, &gcb);
+        int transColorIndex = gcb.TransparentColor;
+
+        QVector<QRgb> colorTable;
+        if (gifImage.ImageDesc.ColorMap)
+            colorTable = colorTableFromColorMapObject(gifImage.ImageDesc.ColorMap, transColorIndex);
+        else if (transColorIndex != -1)
+            colorTable = colorTableFromColorMapObject(gifFile->SColorMap, transColorIndex);
+        else
+            colorTable = globalColorTable;
+
+        if (transColorIndex != -1)
+            frameInfo.transparentColor = colorTable[transColorIndex];
+        frameInfo.delayTime = gcb.DelayTime * 10; //convert to milliseconds
+        if (gcb.DisposalMode <= DISPOSE_PREVIOUS)
+            frameInfo.disposalMode = QGifImage::DisposalMode(gcb.DisposalMode);
+        frameInfo.interlace = gifImage.ImageDesc.Interlace;
+        frameInfo.offset = QPoint(left, top);
+
+        QImage image(width, height, QImage::Format_Indexed8);
+        image.setOffset(QPoint(left, top)); //Maybe useful for some users.
+        image.setColorTable(colorTable);
+        if (transColorIndex != -1)
+            image.fill(transColorIndex);
+        else if (!globalColorTable.isEmpty())
+            image.fill(gifFile->SBackGroundColor); //!ToDo
+
+        //DGifSlurp() has already put the rows of interlaced images in order.
+        for (int row = 0; row < height; row++) {
+            memcpy(image.scanLine(row), gifImage.RasterBits+row*width, width);
+        }
+
+        //Extract other data for the image.
+        if (idx == 0) {
+            if (gifImage.ExtensionBlockCount > 2) {
+                ExtensionBlock *extBlock = gifImage.ExtensionBlocks;
+                if (extBlock->Function == APPLICATION_EXT_FUNC_CODE && extBlock->ByteCount == 8) {
+                    if (QByteArray((char *)extBlock->Bytes) == QByteArray("NETSCAPE2.0")) {
+                        ExtensionBlock *block = gifImage.ExtensionBlocks+1;
+                        if (block->ByteCount == 3) {
+                            loopCount = uchar(block->Bytes[1])
+                                    + uchar((block->Bytes[2])<<8);
+                        }
+                    }
+                }
+            }
+        }
+
+        frameInfo.image = image;
+        frameInfos.append(frameInfo);
+    }
+
+    DGifCloseFile(gifFile);
+    return true;
+}
+
+/*
+    Write the logical screen descriptor, the global color table and the
+    loop count.
+ */
+bool QGifImagePrivate::writeScreenDescriptor(GifFileType *gifFile, const QVector<QRgb> &colorTable) const
+{
+    QSize _canvasSize = getCanvasSize();
+    int bgIndex = colorTable.indexOf(bgColor.rgba());
+    ColorMapObject *colorMap = colorTableToColorMapObject(colorTable);
+    EGifSetGifVersion(gifFile, true);
+    int result = EGifPutScreenDesc(gifFile, _canvasSize.width(), _canvasSize.height(), 8,
+                                   bgIndex == -1 ? 0 : bgIndex, colorMap);
+    GifFreeMapObject(colorMap);
+    if (result == GIF_ERROR)
+        return false;
+
+    uchar data8[12] = "NETSCAPE2.0";
+    uchar data[3];
+    data[0] = 0x01;
+    data[1] = loopCount & 0xFF;
+    data[2] = (loopCount >> 8) & 0xFF;
+    return EGifPutExtensionLeader(gifFile, APPLICATION_EXT_FUNC_CODE) != GIF_ERROR
+            && EGifPutExtensionBlock(gifFile, 11, data8) != GIF_ERROR
+            && EGifPutExtensionBlock(gifFile, 3, data) != GIF_ERROR
+            && EGifPutExtensionTrailer(gifFile) != GIF_ERROR;
+}
+
+/*
+    Write the image descriptor and the pixels of the frame, which must be
+    an indexed image. The lines are compressed straight from the image, in
+    interlaced order if needed.
+ */
+bool QGifImagePrivate::writeFrame(GifFileType *gifFile, const QGifFrameInfoData &frameInfo, const ColorMapObject *colorMap) const
+{
+    static const int interlacedOffset[] = { 0, 4, 2, 1 };
+    static const int interlacedJumps[] = { 8, 8, 4, 2 };
+
+    const QImage &image = frameInfo.image;
+
+    if (EGifPutImageDesc(gifFile, frameInfo.offset.x(), frameInfo.offset.y(), image.width(), image.height(),
+                         frameInfo.interlace, colorMap) == GIF_ERROR)
+        return false;
+
+    QVector<int> rows;
+    rows.reserve(image.height());
+    if (frameInfo.interlace) {
+        for (int pass = 0; pass < 4; ++pass) {
+            for (int row = interlacedOffset[pass]; row < image.height(); row += interlacedJumps[pass])
+                rows.append(row);
+        }
+    } else {
+        for (int row = 0; row < image.height(); ++row)
+            rows.append(row);
+    }
+
+    //A large frame is cut into strips of rows, which start with a clear
+    //code and so can be compressed at once by several threads. Each strip
+    //costs its clear code and the strings it has to learn again.
+    int stripCount = 1;
+    if (parallelCompression) {
+        qint64 maxStripCount = qint64(image.width()) * image.height() / minStripPixels;
+        stripCount = int(qMin(qint64(qMin(QThread::idealThreadCount(), rows.size())), maxStripCount));
+    }
+    if (stripCount < 2) {
+        foreach (int row, rows) {
+            if (EGifPutLine(gifFile, image.constScanLine(row), image.width()) == GIF_ERROR)
+                return false;
+        }
+        return true;
+    }
+
+    QVector<CompressedStrip> strips(stripCount);
+    for (int idx = 0; idx < stripCount; ++idx) {
+        strips[idx].firstRow = rows.size() * idx / stripCount;
+        strips[idx].rowCount = rows.size() * (idx + 1) / stripCount - strips[idx].firstRow;
+        strips[idx].last = idx == stripCount - 1;
+    }
+    StripCompressor compressor;
+    compressor.gifFile = gifFile;
+    compressor.image = &image;
+    compressor.rows = rows.constData();
+    QtConcurrent::blockingMap(strips, compressor);
+
+    GifAllocCounter *counter = GifGetAllocCounter();
+    if (counter) {
+        foreach (const CompressedStrip &strip, strips) {
+            counter->BytesAllocated += strip.allocCounter.BytesAllocated;
+            counter->BytesFreed += strip.allocCounter.BytesFreed;
+        }
+    }
+    foreach (const CompressedStrip &strip, strips) {
+        if (strip.error != 0) {
+            gifFile->Error = strip.error;
+            return false;
+        }
+        if (EGifPutStrip(gifFile, reinterpret_cast<const GifByteType *>(strip.codes.constData()), strip.codeBits,
+                         strip.rowCount * image.width()) == GIF_ERROR)
+            return false;
+    }
+    return true;
+}
+
+/*
+    Write the frames to \a device, with the color count, lossy level and
+    frame drop count of \a level.
+ */
+bool QGifImagePrivate::encode(QIODevice *device, const QGifEncodeLevel &level) const
+{
+    encodeLevel = level;
+
+    GifWriteBuffer writeBuffer(device);
+    GifSaveContext context(&lastSaveBytesAllocated, &lastSaveBytesFreed);
+    int error;
+    GifFileType *gifFile = context.gifFile = EGifOpen(&writeBuffer, writeToIODevice, &error);
+    if (!gifFile) {
+        qWarning(GifErrorString(error));
+        return false;
+    }
+    EGifSetCompressionLevel(gifFile, compressionLevel == QGifImage::FastestCompression ? GIF_COMPRESSION_FASTEST
+                                     : compressionLevel == QGifImage::BestCompression ? GIF_COMPRESSION_BEST
+                                     : GIF_COMPRESSION_NORMAL);
+    EGifSetClearPolicy(gifFile, clearPolicy == QGifImage::DeferredClear ? GIF_CLEAR_DEFERRED
+                                : clearPolicy == QGifImage::RatioDropClear ? GIF_CLEAR_ON_RATIO_DROP
+                                : GIF_CLEAR_FIXED);
+
+    //The color tables built from all the frames by the last save are still
+    //good if no frame, and no setting, has changed since.
+    bool framesDirty = false;
+    foreach (const QGifFrameInfoData &frameInfo, frameInfos)
+        framesDirty = framesDirty || frameInfo.dirty;
+    bool rebuildColorTables = framesDirty || builtMaxColorCount != encodeLevel.maxColorCount;
+
+    QVector<QRgb> _globalColorTable = globalColorTable;
+    bool mapToGlobalColorTable = false;
+    if (_globalColorTable.isEmpty() && autoGlobalColorTable && !frameInfos.isEmpty()) {
+        if (rebuildColorTables)
+            builtGlobalColorTable = buildGlobalColorTable();
+        _globalColorTable = builtGlobalColorTable;
+        mapToGlobalColorTable = true;
+    }
+
+    //The frames of a group share one local color table.
+    QVector<int> frameGroups;
+    QVector<QVector<QRgb> > groupColorTables;
+    QVector<ColorMapObject *> groupColorMaps;
+    if (_globalColorTable.isEmpty() && paletteGroupCount > 0 && !frameInfos.isEmpty()) {
+        if (rebuildColorTables)
+            builtGroupColorTables = buildGroupColorTables(&builtFrameGroups);
+        frameGroups = builtFrameGroups;
+        groupColorTables = builtGroupColorTables;
+        foreach (const QVector<QRgb> &colorTable, groupColorTables)
+            groupColorMaps.append(context.ownColorMap(colorTableToColorMapObject(colorTable)));
+    }
+    builtMaxColorCount = encodeLevel.maxColorCount;
+
+    //The color table of the first frame becomes the global one, and is
+    //reused by the next frames when it is good enough.
+    bool reuseColorTables = _globalColorTable.isEmpty() && groupColorTables.isEmpty() && paletteReuseTolerance > 0;
+    QVector<QRgb> previousColorTable;
+
+    //The screen descriptor is written once the first frame is ready, as the
+    //global color table may come from it.
+    //The frames which look like the previous one are dropped, and the
+    //previous one is shown for as long as all of them. So are the frames
+    //dropped to make the file smaller.
+    QVector<QGifFrameRun> frameRuns;
+    int droppedFrames = 0;
+    for (int idx=0; idx < frameInfos.size(); ++idx) {
+        const QGifFrameInfoData &frameInfo = frameInfos.at(idx);
+        bool dropFrame = false;
+        if (mergeDuplicateFrames && !frameRuns.isEmpty())
+            dropFrame = isDuplicateFrame(frameInfos.at(frameRuns.last().first), frameInfo);
+        if (!dropFrame && !frameRuns.isEmpty() && droppedFrames < encodeLevel.frameDropCount) {
+            dropFrame = true;
+            ++droppedFrames;
+        } else if (!dropFrame) {
+            droppedFrames = 0;
+        }
+        if (dropFrame) {
+            QGifFrameRun &frameRun = frameRuns.last();
+            frameRun.last = idx;
+            frameRun.delayTime += getFrameDelay(frameInfo);
+            frameRun.dirty = frameRun.dirty || frameInfo.dirty;
+            frameInfo.dirty = false;
+            frameInfo.encodedBytes.clear();
+            frameInfo.compressionRatio = 0;
+        } else {
+            frameRuns.append(QGifFrameRun(idx, getFrameDelay(frameInfo), frameInfo.dirty));
+        }
+    }
+
+    //Only the area which changes is written for each frame, and the
+    //disposal mode of the frame before it is chosen to make that area small.
+    //The frames planned by the last save are still good up to the first run
+    //which is dirty or made of other frames.
+    QList<QGifFrameInfoData> plannedFrames;
+    int unchangedRuns = 0;
+    if (autoDisposalMode) {
+        while (unchangedRuns < frameRuns.size() && unchangedRuns < builtFrameRuns.size()
+               && !frameRuns[unchangedRuns].dirty
+               && frameRuns[unchangedRuns].first == builtFrameRuns[unchangedRuns].first
+               && frameRuns[unchangedRuns].last == builtFrameRuns[unchangedRuns].last)
+            ++unchangedRuns;
+        if (unchangedRuns == frameRuns.size() && unchangedRuns == builtFrameRuns.size())
+            plannedFrames = builtPlannedFrames;
+        else
+            plannedFrames = planFrameDisposals(frameRuns);
+        builtFrameRuns = frameRuns;
+        builtPlannedFrames = plannedFrames;
+    }
+
+    //The screen descriptor is written once the first frame is ready, as the
+    //global color table may come from it.
+    bool ok = frameInfos.isEmpty() ? writeScreenDescriptor(gifFile, _globalColorTable) : true;
+    for (int run=0; ok && run < frameRuns.size(); ++run) {
+        int idx = frameRuns[run].first;
+        int delay = frameRuns[run].delayTime / 10; //convert from milliseconds
+        //The area written for a frame depends on all the frames before it.
+        bool canvasDirty = autoDisposalMode && run >= unchangedRuns;
+        const QGifFrameInfoData &sourceFrame = autoDisposalMode ? plannedFrames.at(run) : frameInfos.at(idx);
+        //The planned disposal modes are only written, the ones of the frames
+        //are left as they were set.
+        int disposalMode = autoDisposalMode ? sourceFrame.disposalMode : frameInfos.at(frameRuns[run].last).disposalMode;
+
+        //A frame is encoded against the global color table and, when the
+        //color tables are shared, against the one of its group or of the
+        //previous frame. If neither they nor the frame itself have changed
+        //since the last save, its encoded bytes are spliced as they are.
+        const QGifFrameInfoData &cachedFrame = frameInfos.at(idx);
+        QVector<QRgb> frameGlobalColorTable = _globalColorTable;
+        QVector<QRgb> contextColorTable = groupColorTables.isEmpty() ? previousColorTable
+                                                                     : groupColorTables[frameGroups[idx]];
+        if (!cachedFrame.dirty && !canvasDirty && !cachedFrame.encodedBytes.isEmpty()
+                && cachedFrame.encodedRect == QRect(sourceFrame.offset, sourceFrame.image.size())
+                && cachedFrame.encodedMaxColorCount == encodeLevel.maxColorCount
+                && cachedFrame.encodedLossyLevel == encodeLevel.lossyLevel
+                && cachedFrame.encodedGlobalColorTable == frameGlobalColorTable
+                && cachedFrame.encodedContextColorTable == contextColorTable) {
+            if (reuseColorTables) {
+                if (_globalColorTable.isEmpty() && !cachedFrame.encodedColorTable.isEmpty())
+                    _globalColorTable = cachedFrame.encodedColorTable;
+                previousColorTable = cachedFrame.encodedColorTable;
+            }
+            if (idx == 0)
+                ok = writeScreenDescriptor(gifFile, _globalColorTable);
+            ok = ok && writeEncodedFrame(gifFile, &writeBuffer, cachedFrame.encodedBytes, delay, disposalMode,
+                                         cachedFrame.encodedTransparentIndex);
+            continue;
+        }
+
+        QGifFrameInfoData frameInfo = sourceFrame;
+        QImage image = frameInfo.image;
+        if (mapToGlobalColorTable) {
+            if (image.format() != QImage::Format_Indexed8 || image.colorTable() != _globalColorTable) {
+                image = mapFrame(frameInfo, _globalColorTable);
+                frameInfo.image = image;
+            }
+        } else if (!groupColorTables.isEmpty()) {
+            const QVector<QRgb> &colorTable = groupColorTables[frameGroups[idx]];
+            if (image.format() != QImage::Format_Indexed8 || image.colorTable() != colorTable) {
+                image = mapFrame(frameInfo, colorTable);
+                frameInfo.image = image;
+            }
+        } else if (image.format() != QImage::Format_Indexed8) {
+            if (!_globalColorTable.isEmpty() && !reuseColorTables)
+                image = mapFrame(frameInfo, _globalColorTable);
+            else if (reuseColorTables && canReuseColorTable(frameInfo, _globalColorTable))
+                image = mapFrame(frameInfo, _globalColorTable);
+            else if (reuseColorTables && canReuseColorTable(frameInfo, previousColorTable))
+                image = mapFrame(frameInfo, previousColorTable);
+            else if (quantizer || encodeLevel.maxColorCount < 256)
+                image = quantizeFrame(frameInfo);
+            else
+                image = image.convertToFormat(QImage::Format_Indexed8);
+            //The transparent color index must be found in the new color table.
+            frameInfo.image = image;
+        }
+
+        if (encodeLevel.lossyLevel > 0 && image.format() == QImage::Format_Indexed8) {
+            applyLossyLevel(&image, encodeLevel.lossyLevel, getFrameTransparentColorIndex(frameInfo));
+            frameInfo.image = image;
+        }
+
+        //Only the colors used by the frame are written in its local color
+        //table, the LZW code size is smaller too. The most used colors get
+        //the lowest indexes if asked. The color table which becomes the
+        //global one is kept whole, so that the next frames can reuse it.
+        bool promoteColorTable = reuseColorTables && _globalColorTable.isEmpty();
+        if (groupColorTables.isEmpty() && !promoteColorTable && image.format() == QImage::Format_Indexed8
+                && image.colorTable() != _globalColorTable) {
+            image = optimizeColorTable(image, reorderColorTable);
+            frameInfo.image = image;
+        }
+
+        if (reuseColorTables) {
+            if (promoteColorTable && !image.colorTable().isEmpty())
+                _globalColorTable = image.colorTable();
+            previousColorTable = image.colorTable();
+        }
+
+        if (idx == 0)
+            ok = writeScreenDescriptor(gifFile, _globalColorTable);
+
+        //The frame is compressed aside, so that its graphics control block
+        //can be written first.
+        QByteArray encodedBytes;
+        writeBuffer.redirect(&encodedBytes);
+        if (ok && !groupColorMaps.isEmpty()) {
+            ok = writeFrame(gifFile, frameInfo, groupColorMaps[frameGroups[idx]]);
+        } else if (ok && !image.colorTable().isEmpty() && (image.colorTable() != _globalColorTable)) {
+            QScopedPointer<ColorMapObject, GifColorMapDeleter> colorMap(colorTableToColorMapObject(image.colorTable()));
+            ok = writeFrame(gifFile, frameInfo, colorMap.data());
+        } else if (ok) {
+            ok = writeFrame(gifFile, frameInfo, 0);
+        }
+        writeBuffer.redirect(0);
+        cachedFrame.compressionRatio = ok ? EGifGetCompressionRatio(gifFile) : 0;
+
+        int transparentIndex = getFrameTransparentColorIndex(frameInfo);
+        ok = ok && writeEncodedFrame(gifFile, &writeBuffer, encodedBytes, delay, disposalMode, transparentIndex);
+
+        if (ok) {
+            cachedFrame.dirty = false;
+            cachedFrame.encodedBytes = encodedBytes;
+            cachedFrame.encodedRect = QRect(frameInfo.offset, frameInfo.image.size());
+            cachedFrame.encodedTransparentIndex = transparentIndex;
+            cachedFrame.encodedMaxColorCount = encodeLevel.maxColorCount;
+            cachedFrame.encodedLossyLevel = encodeLevel.lossyLevel;
+            cachedFrame.encodedGlobalColorTable = frameGlobalColorTable;
+            cachedFrame.encodedContextColorTable = contextColorTable;
+            cachedFrame.encodedColorTable = image.colorTable();
+        }
+    }
+
+    if (!ok)
+        qWarning(GifErrorString(gifFile->Error));
+    if (!context.closeFile())
+        ok = false;
+    if (!writeBuffer.flush())
+        ok = false;
+
+    return ok;
+}
+
+/*
+    Return the settings tried to meet the target size, from the ones of the
+    image to the ones giving the smallest file: higher lossy levels first,
+    then fewer colors, then more dropped frames.
+ */
+QVector<QGifEncodeLevel> QGifImagePrivate::targetSizeLevels() const
+{
+    static const int lossyLevels[] = { 10, 20, 40, 60 };
+    static const int colorCounts[] = { 128, 64, 32, 16 };
+
+    QGifEncodeLevel level(maxColorCount, lossyLevel, frameDropCount);
+    QVector<QGifEncodeLevel> levels;
+    levels.append(level);
+    for (int idx = 0; idx < 4; ++idx) {
+        if (lossyLevels[idx] > level.lossyLevel) {
+            level.lossyLevel = lossyLevels[idx];
+            levels.append(level);
+        }
+    }
+    for (int idx = 0; idx < 4; ++idx) {
+        if (colorCounts[idx] < level.maxColorCount) {
+            level.maxColorCount = colorCounts[idx];
+            levels.append(level);
+        }
+    }
+    for (int idx = 0; idx < 3; ++idx) {
+        ++level.frameDropCount;
+        levels.append(level);
+    }
+    return levels;
+}
+
+/*
+    Reserve the memory of \a device once if it is a QBuffer. The frames
+    encoded by the last save count with the size of their encoded bytes, the
+    other ones with a quarter of a byte per pixel.
+ */
+void QGifImagePrivate::reserveBuffer(QIODevice *device) const
+{
+    QBuffer *buffer = qobject_cast<QBuffer *>(device);
+    if (!buffer)
+        return;
+
+    qint64 estimatedSize = buffer->pos() + 1024;
+    foreach (const QGifFrameInfoData &frameInfo, frameInfos) {
+        if (!frameInfo.dirty && !frameInfo.encodedBytes.isEmpty())
+            estimatedSize += 32 + frameInfo.encodedBytes.size();
+        else
+            estimatedSize += 1024 + qint64(frameInfo.image.width()) * frameInfo.image.height() / 4;
+    }
+    estimatedSize = qMin(estimatedSize, maxReservedSize);
+    if (estimatedSize > buffer->buffer().capacity())
+        buffer->buffer().reserve(int(estimatedSize));
+}
+
+bool QGifImagePrivate::save(QIODevice *device) const
+{
+    if (targetSize <= 0) {
+        reserveBuffer(device);
+        return encode(device, QGifEncodeLevel(maxColorCount, lossyLevel, frameDropCount));
+    }
+
+    //The file mostly gets smaller from one level to the next, the first one
+    //which fits is found by bisection. Each try only does again the work which
+    //depends on the settings that changed: the histograms, the planned frames
+    //and the frames encoded with the same settings are kept between tries.
+    QVector<QGifEncodeLevel> levels = targetSizeLevels();
+    int bestLevel = -1;
+    int smallestLevel = 0;
+    qint64 smallestSize = -1;
+    int lastLevel = -1;
+    int low = 0;
+    int high = levels.size() - 1;
+    while (low <= high) {
+        //The settings of the image are tried first, they often fit.
+        int mid = lastLevel == -1 ? 0 : (low + high) / 2;
+        QBuffer buffer;
+        buffer.open(QIODevice::WriteOnly);
+        if (!encode(&buffer, levels[mid]))
+            return false;
+        lastLevel = mid;
+        qint64 size = buffer.size();
+        if (smallestSize == -1 || size < smallestSize) {
+            smallestSize = size;
+            smallestLevel = mid;
+        }
+        if (size <= targetSize) {
+            bestLevel = mid;
+            high = mid - 1;
+        } else {
+            low = mid + 1;
+        }
+    }
+
+    //Writing the chosen level again splices the frames encoded by the last
+    //try when it is the one, and keeps the frames in step with the file.
+    //Only this last write reserves the memory of \a device, with the sizes
+    //of the frames encoded by the tries.
+    reserveBuffer(device);
+    return encode(device, levels[bestLevel != -1 ? bestLevel : smallestLevel]);
+}
+
+
+/*!
+    \class QGifImage
+    \inmodule QtGifImage
+    \brief Class used to read/wirte .gif files.
+*/
+
+/*!
+    \enum QGifImage::DitherMode
+
+    \value NoDither Each pixel is mapped to the nearest color.
+    \value OrderedDither The pixels are offset by a 8x8 Bayer matrix before
+           being mapped. It is fast and stable between frames.
+    \value BlueNoiseDither The pixels are offset by a 64x64 blue noise
+           map before being mapped. It has no visible pattern.
+    \value FloydSteinbergDither The quantization error of each pixel is
+           diffused to its neighbours with the Floyd-Steinberg weights.
+    \value SierraDither The quantization error is diffused over three rows
+           with the Sierra weights. It is the slowest mode, and the best one.
+*/
+
+/*!
+    \enum QGifImage::DisposalMode
+
+    \value UnspecifiedDisposal The decoder may do what it likes with the
+           frame once its delay is over.
+    \value DoNotDispose The frame is left in place, and the next frame is
+           drawn over it.
+    \value DisposeToBackground The area of the frame is cleared to the
+           background.
+    \value DisposeToPrevious The area of the frame is restored to what it
+           was before the frame was drawn.
+*/
+
+/*!
+    \enum QGifImage::CompressionLevel
+
+    \value FastestCompression Each pixel is written as its own LZW code,
+           without looking for repeated strings. It is about as fast as
+           copying the pixels, and the pixels take a bit more than their
+           own size.
+    \value NormalCompression Repeated strings of pixels are found with a
+           hashed string table.
+    \value BestCompression The pixels of each frame are parsed a few ways,
+           with lookahead for strings which let the next one be longer,
+           and with the string table cleared at once or only when it
+           stops paying off. The smallest parse is written, so the output
+           is never larger than with NormalCompression. It is several
+           times slower, and keeps the pixels of the frame in memory.
+*/
+
+/*!
+    \enum QGifImage::ClearPolicy
+
+    \value FixedClear The LZW string table is cleared as soon as it is
+           full, as most encoders do.
+    \value DeferredClear The full string table is kept to the end of the
+           frame. This suits frames whose second half looks like the first.
+    \value RatioDropClear The full string table is kept while its codes
+           cost no more bits per pixel than right after it got full, and is
+           cleared once they do. This suits frames whose content changes
+           along the way.
+*/
+
+/*!
+    Constructs a gif image
+*/
+QGifImage::QGifImage()
+    :d_ptr(new QGifImagePrivate(this))
+{
+
+}
+
+/*!
+    Constructs a gif image and tries to load the image from the
+    file with the given \a fileName
+*/
+QGifImage::QGifImage(const QString &fileName)
+    :d_ptr(new QGifImagePrivate(this))
+{
+    load(fileName);
+}
+
+/*!
+    Constructs a gif image with the given \a size
+*/
+QGifImage::QGifImage(const QSize &size)
+    :d_ptr(new QGifImagePrivate(this))
+{
+    d_ptr->canvasSize = size;
+}
+
+/*!
+    Destroys the gif image and cleans up.
+*/
+QGifImage::~QGifImage()
+{
+    delete d_ptr;
+}
+
+/*!
+    Return global color table.
+ */
+QVector<QRgb> QGifImage::globalColorTable() const
+{
+    Q_D(const QGifImage);
+    return d->globalColorTable;
+}
+
+/*!
+    Return background color of the gif canvas. It only makes sense when
+    global color table is not empty.
+ */
+QColor QGifImage::backgroundColor() const
+{
+    Q_D(const QGifImage);
+    return d->bgColor;
+}
+
+/*!
+    Set the global color table \a colors and background color \a bgColor.
+    \a bgColor must be one the color in \a colors.
+
+    Unlike other image formats that support alpha (e.g. png), GIF does not
+    support semi-transparent pixels. So the alpha channel of the color table
+    will be ignored.
+*/
+void QGifImage::setGlobalColorTable(const QVector<QRgb> &colors, const QColor &bgColor)
+{
+    Q_D(QGifImage);
+    d->globalColorTable = colors;
+    d->bgColor = bgColor;
+    d->invalidateFrames();
+}
+
+/*!
+    Return the default delay in milliseconds. The default value is 1000 ms.
+
+    The time delay can be different for every frame.
+*/
+int QGifImage::defaultDelay() const
+{
+    Q_D(const QGifImage);
+    return d->defaultDelayTime;
+}
+
+/*!
+    Set the default \a delay in milliseconds.
+*/
+void QGifImage::setDefaultDelay(int delay)
+{
+    Q_D(QGifImage);
+    d->defaultDelayTime = delay;
+}
+
+/*!
+    Return the default transparent color.
+
+    The transparent color can be different for every frame.
+*/
+QColor QGifImage::defaultTransparentColor() const
+{
+    Q_D(const QGifImage);
+    return d->defaultTransparentColor;
+}
+
+/*!
+    Set the default transparent \a color.
+
+    Unlike other image formats that support alpha (e.g. png), GIF does
+    not support semi-transparent pixels. The way to achieve transparency
+    is to set a color that will be transparent when rendering the GIF.
+    So, if you set the transparent color to black, the black pixels in
+    the gif file will be transparent.
+*/
+void QGifImage::setDefaultTransparentColor(const QColor &color)
+{
+    Q_D(QGifImage);
+    d->defaultTransparentColor = color;
+    d->invalidateFrames();
+}
+
+/*!
+    Return the loop count.
+*/
+int QGifImage::loopCount() const
+{
+    Q_D(const QGifImage);
+    return d->loopCount;
+}
+
+/*!
+    Set the loop count. The default value of \a loop is 0, which means loop forever.
+*/
+void QGifImage::setLoopCount(int loop)
+{
+    Q_D(QGifImage);
+    d->loopCount = loop;
+}
+
+/*!
+    Return whether a global color table is generated by save() when none
+    has been set. The default value is false.
+
+    \sa setAutoGlobalColorTable()
+*/
+bool QGifImage::autoGlobalColorTable() const
+{
+    Q_D(const QGifImage);
+    return d->autoGlobalColorTable;
+}
+
+/*!
+    If \a enable is true and no global color table has been set, save()
+    builds one color table of up to 256 colors from the colors of all
+    the frames, and all the frames are mapped to it. No local color
+    table is written, which saves up to 768 bytes per frame and avoids
+    the color flickering between frames.
+
+    Large frames are subsampled, and the histograms of the frames are
+    computed in parallel. The color table is built by the quantizer(),
+    or by a median cut quantizer if no quantizer has been set.
+*/
+void QGifImage::setAutoGlobalColorTable(bool enable)
+{
+    Q_D(QGifImage);
+    d->autoGlobalColorTable = enable;
+    d->invalidateFrames();
+}
+
+/*!
+    Return the quantizer used to build the color table of the frames,
+    or 0 if the default conversion of QImage is used.
+
+    \sa setQuantizer()
+*/
+QGifQuantizer *QGifImage::quantizer() const
+{
+    Q_D(const QGifImage);
+    return d->quantizer;
+}
+
+/*!
+    Set the \a quantizer used by save() to build the color table of the
+    frames which are not indexed images. The same quantizer is used for
+    all the frames. QGifImage takes ownership of the \a quantizer, and the
+    previous one is deleted.
+
+    The quantizer is not used when a global color table has been set, the
+    frames are mapped to the global color table instead. If \a quantizer
+    is 0, QImage::convertToFormat() is used.
+
+    \code
+    gif.setQuantizer(QGifQuantizer::create(QGifQuantizer::MedianCut));
+    \endcode
+*/
+void QGifImage::setQuantizer(QGifQuantizer *quantizer)
+{
+    Q_D(QGifImage);
+    if (d->quantizer == quantizer)
+        return;
+    delete d->quantizer;
+    d->quantizer = quantizer;
+    d->invalidateFrames();
+}
+
+/*!
+    Return the palette reuse tolerance. The default value is 0, which
+    means that the color tables are never reused.
+
+    \sa setPaletteReuseTolerance()
+*/
+int QGifImage::paletteReuseTolerance() const
+{
+    Q_D(const QGifImage);
+    return d->paletteReuseTolerance;
+}
+
+/*!
+    Set the palette reuse \a tolerance used by save() when no global
+    color table is set.
+
+    When \a tolerance is greater than 0, the color table of the first
+    frame is written as the global color table. The next frames which are
+    not indexed images are mapped to the global color table, or to the
+    color table of the previous frame, instead of being quantized, if the
+    root mean square distance between their pixels and the colors of the
+    table does not exceed \a tolerance. This saves both the quantization
+    time and the local color tables.
+
+    A tolerance of 8 to 16 is usually not noticeable.
+*/
+void QGifImage::setPaletteReuseTolerance(int tolerance)
+{
+    Q_D(QGifImage);
+    d->paletteReuseTolerance = tolerance;
+    d->invalidateFrames();
+}
+
+/*!
+    Return the maximum number of color tables shared by groups of frames.
+    The default value is 0, which means that the frames are not grouped.
 
-        QVector<QRgb> colorTable;
-        if (gifImage.ImageDesc.ColorMap)
-            colorTable = colorTableFromColorMapObject(gifImage.ImageDesc.ColorMap, transColorIndex);
-        else if (transColorIndex != -1)
-            colorTable = colorTableFromColorMapObject(gifFile->SColorMap, transColorIndex);
-        else
-            colorTable = globalColorTable;
+    \sa setPaletteGroupCount()
+*/
+int QGifImage::paletteGroupCount() const
+{
+    Q_D(const QGifImage);
+    return d->paletteGroupCount;
+}
 
-        if (transColorIndex != -1)
-            frameInfo.transparentColor = colorTable[transColorIndex];
-        frameInfo.delayTime = gcb.DelayTime * 10; //convert to milliseconds
-        frameInfo.interlace = gifImage.ImageDesc.Interlace;
-        frameInfo.offset = QPoint(left, top);
+/*!
+    If \a count is greater than 0 and no global color table is set,
+    save() clusters the frames in up to \a count groups of frames with
+    similar color histograms. One color table is built per group, and it
+    is written as the local color table of all the frames of the group.
 
-        QImage image(width, height, QImage::Format_Indexed8);
-        image.setOffset(QPoint(left, top)); //Maybe useful for some users.
-        image.setColorTable(colorTable);
-        if (transColorIndex != -1)
-            image.fill(transColorIndex);
-        else if (!globalColorTable.isEmpty())
-            image.fill(gifFile->SBackGroundColor); //!ToDo
+    This suits long animations with scene changes, for which a single
+    global color table is not enough, and one color table per frame is
+    both slow and large.
 
-        if (gifImage.ImageDesc.Interlace) {
-            int line = 0;
-            for (int i = 0; i < 4; i++) {
-                for (int row = interlacedOffset[i]; row <height; row += interlacedJumps[i]) {
-                    memcpy(image.scanLine(row), gifImage.RasterBits+line*width, width);
-                    line ++;
-                }
-            }
-        } else {
-            for (int row = 0; row < height; row++) {
-                memcpy(image.scanLine(row), gifImage.RasterBits+row*width, width);
-            }
-        }
+    \sa setAutoGlobalColorTable()
+*/
+void QGifImage::setPaletteGroupCount(int count)
+{
+    Q_D(QGifImage);
+    d->paletteGroupCount = count;
+    d->invalidateFrames();
+}
 
-        //Extract other data for the image.
-        if (idx == 0) {
-            if (gifImage.ExtensionBlockCount > 2) {
-                ExtensionBlock *extBlock = gifImage.ExtensionBlocks;
-                if (extBlock->Function == APPLICATION_EXT_FUNC_CODE && extBlock->ByteCount == 8) {
-                    if (QByteArray((char *)extBlock->Bytes) == QByteArray("NETSCAPE2.0")) {
-                        ExtensionBlock *block = gifImage.ExtensionBlocks+1;
-                        if (block->ByteCount == 3) {
-                            loopCount = uchar(block->Bytes[1])
-                                    + uchar((block->Bytes[2])<<8);
-                        }
-                    }
-                }
-            }
-        }
+/*!
+    Return whether the colors of the color tables built by save() are
+    sorted by usage. The default value is false.
 
-        frameInfo.image = image;
-        frameInfos.append(frameInfo);
-    }
+    \sa setReorderColorTable()
+*/
+bool QGifImage::reorderColorTable() const
+{
+    Q_D(const QGifImage);
+    return d->reorderColorTable;
+}
 
-    DGifCloseFile(gifFile);
-    return true;
+/*!
+    If \a enable is true, save() sorts the colors of the local color
+    tables, and of the color tables it builds, by decreasing usage, and
+    remaps the pixels, so that the most used colors get the lowest indexes.
+    Only the order of the indexes changes, which leaves the LZW codes, and
+    so the file, the same size: this does not make the file smaller. The
+    unused colors are dropped from the local color tables whether or not
+    this is enabled.
+
+    The pixels of a frame whose color table has 16 colors or fewer are
+    remapped 16 at a time with SSSE3 or NEON when available. Larger color
+    tables use a lookup table, one pixel at a time.
+
+    A color table set with setGlobalColorTable() is never reordered.
+*/
+void QGifImage::setReorderColorTable(bool enable)
+{
+    Q_D(QGifImage);
+    d->reorderColorTable = enable;
+    d->invalidateFrames();
 }
 
-bool QGifImagePrivate::save(QIODevice *device) const
+/*!
+    Returns whether the frames which look exactly like the previous one
+    are merged with it when saving. The default value is false.
+
+    \sa setMergeDuplicateFrames()
+*/
+bool QGifImage::mergeDuplicateFrames() const
 {
-    int error;
-    GifFileType *gifFile = EGifOpen(device, writeToIODevice, &error);
-    if (!gifFile) {
-        qWarning(GifErrorString(error));
-        return false;
-    }
+    Q_D(const QGifImage);
+    return d->mergeDuplicateFrames;
+}
 
-    QSize _canvasSize = getCanvasSize();
-    gifFile->SWidth = _canvasSize.width();
-    gifFile->SHeight = _canvasSize.height();
-    gifFile->SColorResolution = 8;
-    if (!globalColorTable.isEmpty()) {
-        gifFile->SColorMap = colorTableToColorMapObject(globalColorTable);
-        int idx = globalColorTable.indexOf(bgColor.rgba());
-        gifFile->SBackGroundColor = idx == -1 ? 0 : idx;
-    }
+/*!
+    If \a enable is true, a frame with the same pixels, offset and
+    transparent color as the previous one is not written. The previous
+    frame is shown for the sum of their delays instead, which saves both
+    the encoding time and the file size of screen recordings that hold
+    still. A delay longer than a GIF frame can hold, about 11 minutes, is
+    split over copies of the frame.
 
-    gifFile->ImageCount = frameInfos.size();
-    gifFile->SavedImages = (SavedImage *)calloc(frameInfos.size(), sizeof(SavedImage));
-    for (int idx=0; idx < frameInfos.size(); ++idx) {
-        const QGifFrameInfoData frameInfo = frameInfos.at(idx);
-        QImage image = frameInfo.image;
-        if (image.format() != QImage::Format_Indexed8) {
-            if (!globalColorTable.isEmpty())
-                image = image.convertToFormat(QImage::Format_Indexed8, globalColorTable);
-            else
-                image = image.convertToFormat(QImage::Format_Indexed8);
-        }
+    The frames are kept as they are in this object.
 
-        SavedImage *gifImage = gifFile->SavedImages + idx;
+    \sa mergeDuplicateFrames()
+*/
+void QGifImage::setMergeDuplicateFrames(bool enable)
+{
+    Q_D(QGifImage);
+    d->mergeDuplicateFrames = enable;
+}
 
-        gifImage->ImageDesc.Left = frameInfo.offset.x();
-        gifImage->ImageDesc.Top = frameInfo.offset.y();
-        gifImage->ImageDesc.Width = image.width();
-        gifImage->ImageDesc.Height = image.height();
-        gifImage->ImageDesc.Interlace = frameInfo.interlace;
+/*!
+    Returns whether save() chooses the disposal mode of the frames.
+    The default value is false.
 
-        if (!image.colorTable().isEmpty() && (image.colorTable() != globalColorTable))
-            gifImage->ImageDesc.ColorMap = colorTableToColorMapObject(image.colorTable());
-        else
-            gifImage->ImageDesc.ColorMap = 0;
+    \sa setAutoDisposalMode()
+*/
+bool QGifImage::autoDisposalMode() const
+{
+    Q_D(const QGifImage);
+    return d->autoDisposalMode;
+}
 
-        GifByteType *data = (GifByteType *)malloc(image.width() * image.height() * sizeof(GifByteType));
-        for (int row=0; row<image.height(); ++row) {
-            memcpy(data+row*image.width(), image.scanLine(row), image.width());
-        }
-        gifImage->RasterBits = data;
+/*!
+    If \a enable is true, save() considers the frames as drawn one over
+    the other, and only writes the area of the canvas changed by each
+    frame. The disposal mode of each frame, left in place, cleared to the
+    background or restored to what was there before, is chosen to make
+    the area changed by the next frame as small as possible. This makes
+    animations of moving sprites over a still background much smaller.
 
-        if (idx == 0) {
-            uchar data8[12] = "NETSCAPE2.0";
-            GifAddExtensionBlock(&gifImage->ExtensionBlockCount, &gifImage->ExtensionBlocks
-                                 , APPLICATION_EXT_FUNC_CODE, 11, data8);
-            uchar data[3];
-            data[0] = 0x01;
-            data[1] = loopCount & 0xFF;
-            data[2] = (loopCount >> 8) & 0xFF;
-            GifAddExtensionBlock(&gifImage->ExtensionBlockCount, &gifImage->ExtensionBlocks
-                                 , CONTINUE_EXT_FUNC_CODE, 3, data);
-        }
-
-        GraphicsControlBlock gcbBlock;
-        gcbBlock.DisposalMode = 0;
-        gcbBlock.UserInputFlag = false;
-        gcbBlock.TransparentColor = getFrameTransparentColorIndex(frameInfo);
-
-        if (frameInfo.delayTime != -1)
-            gcbBlock.DelayTime = frameInfo.delayTime / 10; //convert from milliseconds
-        else
-            gcbBlock.DelayTime = defaultDelayTime / 10;
+    The chosen modes are only written to the file, the ones returned by
+    frameDisposalMode() are not changed.
 
-        EGifGCBToSavedExtension(&gcbBlock, gifFile, idx);
-    }
+    \sa autoDisposalMode(), setFrameDisposalMode()
+*/
+void QGifImage::setAutoDisposalMode(bool enable)
+{
+    Q_D(QGifImage);
+    d->autoDisposalMode = enable;
+    d->invalidateFrames();
+}
 
-    EGifSpew(gifFile);
-    //EGifCloseFile(gifFile);
+/*!
+    Returns the largest number of colors of the color tables built when
+    saving. The default value is 256.
 
-    return true;
+    \sa setMaxColorCount()
+*/
+int QGifImage::maxColorCount() const
+{
+    Q_D(const QGifImage);
+    return d->maxColorCount;
 }
 
+/*!
+    Sets the largest number of colors of the color tables built by the
+    quantizer, or from the colors of the frames, to \a count, between 2
+    and 256. Fewer colors make smaller files. The color tables set by the
+    user, and the ones of indexed frames, are used as they are.
+
+    \sa maxColorCount(), setTargetSize()
+*/
+void QGifImage::setMaxColorCount(int count)
+{
+    Q_D(QGifImage);
+    d->maxColorCount = qBound(2, count, 256);
+}
 
 /*!
-    \class QGifImage
-    \inmodule QtGifImage
-    \brief Class used to read/wirte .gif files.
+    Returns how far the colors of the pixels may be moved to make the
+    file smaller. The default value is 0, which keeps the pixels as they are.
+
+    \sa setLossyLevel()
 */
+int QGifImage::lossyLevel() const
+{
+    Q_D(const QGifImage);
+    return d->lossyLevel;
+}
 
 /*!
-    Constructs a gif image
+    Sets the lossy \a level, between 0 and 100. A pixel is given the color
+    of the pixel on its left, or else of the one above it, when the distance
+    between their colors is at most \a level, in RGB units. The longer runs
+    of the same color compress better, at the cost of flattening smooth
+    gradients and noise. The transparent pixels are kept as they are.
+
+    \sa lossyLevel(), setTargetSize()
 */
-QGifImage::QGifImage()
-    :d_ptr(new QGifImagePrivate(this))
+void QGifImage::setLossyLevel(int level)
 {
+    Q_D(QGifImage);
+    d->lossyLevel = qBound(0, level, 100);
+}
+
+/*!
+    Returns the number of frames dropped after each frame written.
+    The default value is 0.
 
+    \sa setFrameDropCount()
+*/
+int QGifImage::frameDropCount() const
+{
+    Q_D(const QGifImage);
+    return d->frameDropCount;
 }
 
 /*!
-    Constructs a gif image and tries to load the image from the
-    file with the given \a fileName
+    Drops \a count frames after each frame written when saving. The
+    written frame is shown for as long as the frames it replaces, so that
+    the duration of the animation is kept. The frames are kept as they are
+    in this object.
+
+    \sa frameDropCount(), setTargetSize()
 */
-QGifImage::QGifImage(const QString &fileName)
-    :d_ptr(new QGifImagePrivate(this))
+void QGifImage::setFrameDropCount(int count)
 {
-    load(fileName);
+    Q_D(QGifImage);
+    d->frameDropCount = qMax(0, count);
 }
 
 /*!
-    Constructs a gif image with the given \a size
+    Returns the largest size in bytes of the files written by save(),
+    or 0 if there is none. The default value is 0.
+
+    \sa setTargetSize()
 */
-QGifImage::QGifImage(const QSize &size)
-    :d_ptr(new QGifImagePrivate(this))
+qint64 QGifImage::targetSize() const
 {
-    d_ptr->canvasSize = size;
+    Q_D(const QGifImage);
+    return d->targetSize;
 }
 
 /*!
-    Destroys the gif image and cleans up.
+    Sets the largest \a size in bytes of the files written by save().
+    When the frames do not fit with the settings of the image, save()
+    raises the lossy level, then lowers the number of colors, then drops
+    frames, until the file fits. The settings of the image are the
+    starting point of this search, and are not changed. If even the
+    smallest file does not fit, the smallest file is written.
+
+    The search encodes the frames a few times in memory. Each try keeps
+    the color histograms, the areas changed between frames and the frames
+    already encoded with the same settings.
+
+    \sa targetSize(), setLossyLevel(), setMaxColorCount(), setFrameDropCount()
 */
-QGifImage::~QGifImage()
+void QGifImage::setTargetSize(qint64 size)
 {
-    delete d_ptr;
+    Q_D(QGifImage);
+    d->targetSize = qMax(qint64(0), size);
 }
 
 /*!
-    Return global color table.
- */
-QVector<QRgb> QGifImage::globalColorTable() const
+    Returns how hard the pixels are compressed when saving. The default
+    value is NormalCompression.
+
+    \sa setCompressionLevel()
+*/
+QGifImage::CompressionLevel QGifImage::compressionLevel() const
 {
     Q_D(const QGifImage);
-    return d->globalColorTable;
+    return d->compressionLevel;
 }
 
 /*!
-    Return background color of the gif canvas. It only makes sense when
-    global color table is not empty.
- */
-QColor QGifImage::backgroundColor() const
+    Sets how hard the pixels are compressed when saving to \a level.
+    FastestCompression suits live previews, where the time to save
+    matters more than the file size.
+
+    \sa compressionLevel()
+*/
+void QGifImage::setCompressionLevel(CompressionLevel level)
+{
+    Q_D(QGifImage);
+    d->compressionLevel = level;
+    d->invalidateFrames();
+}
+
+/*!
+    Returns when the LZW string table is cleared once it is full. The
+    default value is FixedClear.
+
+    \sa setClearPolicy(), frameCompressionRatio()
+*/
+QGifImage::ClearPolicy QGifImage::clearPolicy() const
 {
     Q_D(const QGifImage);
-    return d->bgColor;
+    return d->clearPolicy;
 }
 
 /*!
-    Set the global color table \a colors and background color \a bgColor.
-    \a bgColor must be one the color in \a colors.
+    Sets when the LZW string table is cleared once it is full to \a policy.
+    Which policy gives the smallest file depends on the frames, the
+    frameCompressionRatio() of each tells how well it did. BestCompression
+    tries the policies by itself and ignores this one.
 
-    Unlike other image formats that support alpha (e.g. png), GIF does not
-    support semi-transparent pixels. So the alpha channel of the color table
-    will be ignored.
+    \sa clearPolicy(), setCompressionLevel()
 */
-void QGifImage::setGlobalColorTable(const QVector<QRgb> &colors, const QColor &bgColor)
+void QGifImage::setClearPolicy(ClearPolicy policy)
 {
     Q_D(QGifImage);
-    d->globalColorTable = colors;
-    d->bgColor = bgColor;
+    d->clearPolicy = policy;
+    d->invalidateFrames();
 }
 
 /*!
-    Return the default delay in milliseconds. The default value is 1000 ms.
+    Returns whether the large frames are compressed by several threads when
+    saving. The default value is false.
 
-    The time delay can be different for every frame.
+    \sa setParallelCompression()
 */
-int QGifImage::defaultDelay() const
+bool QGifImage::parallelCompression() const
 {
     Q_D(const QGifImage);
-    return d->defaultDelayTime;
+    return d->parallelCompression;
 }
 
 /*!
-    Set the default \a delay in milliseconds.
+    If \a enable is true, a frame of more than about half a million pixels
+    is cut into strips of rows, one per core, which are compressed at once
+    and joined. Each strip starts the LZW string table again, so the frame
+    takes a little more room, most of all when it compresses well.
+
+    \sa parallelCompression(), setCompressionLevel()
 */
-void QGifImage::setDefaultDelay(int delay)
+void QGifImage::setParallelCompression(bool enable)
 {
     Q_D(QGifImage);
-    d->defaultDelayTime = delay;
+    d->parallelCompression = enable;
+    d->invalidateFrames();
 }
 
 /*!
-    Return the default transparent color.
+    Returns whether the large frames are decoded by several threads when
+    loading. The default value is false.
 
-    The transparent color can be different for every frame.
+    \sa setParallelDecoding()
 */
-QColor QGifImage::defaultTransparentColor() const
+bool QGifImage::parallelDecoding() const
 {
     Q_D(const QGifImage);
-    return d->defaultTransparentColor;
+    return d->parallelDecoding;
 }
 
 /*!
-    Set the default transparent \a color.
-
-    Unlike other image formats that support alpha (e.g. png), GIF does
-    not support semi-transparent pixels. The way to achieve transparency
-    is to set a color that will be transparent when rendering the GIF.
-    So, if you set the transparent color to black, the black pixels in
-    the gif file will be transparent.
+    If \a enable is true, load() looks for the clear codes which most
+    encoders send whenever the LZW string table is full, one near each part
+    of a large frame, and decodes the parts after them at once. A part is
+    only kept if the decoding of the one before it reaches the same clear
+    code, the frame is decoded one part after the other otherwise. Frames
+    with no such clear code, such as the ones saved with DeferredClear, are
+    decoded by one thread.
+
+    \sa parallelDecoding(), setParallelCompression()
 */
-void QGifImage::setDefaultTransparentColor(const QColor &color)
+void QGifImage::setParallelDecoding(bool enable)
 {
     Q_D(QGifImage);
-    d->defaultTransparentColor = color;
+    d->parallelDecoding = enable;
 }
 
 /*!
-    Return the loop count.
+    Return the dither mode used when the frames are mapped to a color
+    table. The default value is NoDither.
+
+    \sa setDitherMode()
 */
-int QGifImage::loopCount() const
+QGifImage::DitherMode QGifImage::ditherMode() const
 {
     Q_D(const QGifImage);
-    return d->loopCount;
+    return d->ditherMode;
 }
 
 /*!
-    Set the loop count. The default value of \a loop is 0, which means loop forever.
+    Set the dither \a mode used by save() when the frames which are not
+    indexed images are mapped to a color table.
+
+    OrderedDither uses a 8x8 Bayer matrix and BlueNoiseDither a 64x64
+    blue noise threshold map. The threshold maps are anchored to the
+    canvas, not to the frame, so that the static parts of an animation
+    are dithered the same way in every frame. The transparent color is
+    never dithered.
+
+    FloydSteinbergDither and SierraDither diffuse the quantization error.
+    The rows are processed in parallel as a wavefront, each row trailing
+    the previous one by a few pixels, and the result does not depend on
+    the number of threads.
 */
-void QGifImage::setLoopCount(int loop)
+void QGifImage::setDitherMode(DitherMode mode)
 {
     Q_D(QGifImage);
-    d->loopCount = loop;
+    d->ditherMode = mode;
+    d->invalidateFrames();
 }
 
 /*!
@@ -566,6 +2539,7 @@ void QGifImage::setFrameOffset(int index, const QPoint &offset)
     if (index < 0 || index >= d->frameInfos.size())
         return;
     d->frameInfos[index].offset = offset;
+    d->frameInfos[index].dirty = true;
 }
 
 /*!
@@ -616,12 +2590,67 @@ void QGifImage::setFrameTransparentColor(int index, const QColor &color)
     if (index < 0 || index >= d->frameInfos.size())
         return;
     d->frameInfos[index].transparentColor = color;
+    d->frameInfos[index].dirty = true;
+}
+
+/*!
+    Return the disposal mode of the frame at \a index, which tells what is
+    done with the frame before the next one is drawn.
+
+    \sa setFrameDisposalMode(), setAutoDisposalMode()
+*/
+QGifImage::DisposalMode QGifImage::frameDisposalMode(int index) const
+{
+    Q_D(const QGifImage);
+    if (index < 0 || index >= d->frameInfos.size())
+        return UnspecifiedDisposal;
+
+    return d->frameInfos[index].disposalMode;
+}
+
+/*!
+    Sets the disposal \a mode of the frame at \a index. The default value
+    is UnspecifiedDisposal, which most viewers handle like DoNotDispose.
+
+    The mode is not written when autoDisposalMode() is enabled, save()
+    chooses one instead.
+
+    \sa frameDisposalMode()
+*/
+void QGifImage::setFrameDisposalMode(int index, DisposalMode mode)
+{
+    Q_D(QGifImage);
+    if (index < 0 || index >= d->frameInfos.size())
+        return;
+    d->frameInfos[index].disposalMode = mode;
+}
+
+/*!
+    Returns the compression ratio of the frame at \a index when it was last
+    saved: the number of its pixels over the number of bytes of its LZW
+    codes. Returns 0 if the frame has not been saved, or was merged into
+    the frame before it.
+
+    \sa setClearPolicy(), setCompressionLevel()
+*/
+qreal QGifImage::frameCompressionRatio(int index) const
+{
+    Q_D(const QGifImage);
+    if (index < 0 || index >= d->frameInfos.size())
+        return 0;
+
+    return d->frameInfos[index].compressionRatio;
 }
 
 /*!
     Saves the gif image to the file with the given \a fileName.
     Returns \c true if the image was successfully saved; otherwise
     returns \c false.
+
+    The encoded frames are kept after a successful save. The next save
+    only converts and compresses again the frames which have been added
+    or modified since, or whose color tables have changed; the other
+    frames are copied as they are.
 */
 bool QGifImage::save(const QString &fileName) const
 {
@@ -641,12 +2670,41 @@ bool QGifImage::save(const QString &fileName) const
 bool QGifImage::save(QIODevice *device) const
 {
     Q_D(const QGifImage);
-    if (device->openMode() | QIODevice::WriteOnly)
+    if (device->openMode() & QIODevice::WriteOnly)
         return d->save(device);
 
     return false;
 }
 
+/*!
+    Returns the number of bytes allocated by giflib during the last call
+    to save(), or 0 if the image has never been saved.
+
+    The allocations made by the threads which compress the strips of a
+    frame, when parallelCompression() is enabled, are counted too.
+    Everything giflib allocates while saving is released before save()
+    returns, even when it fails, so this is equal to lastSaveBytesFreed().
+
+    \sa lastSaveBytesFreed()
+*/
+qint64 QGifImage::lastSaveBytesAllocated() const
+{
+    Q_D(const QGifImage);
+    return d->lastSaveBytesAllocated;
+}
+
+/*!
+    Returns the number of bytes freed by giflib during the last call
+    to save(), or 0 if the image has never been saved.
+
+    \sa lastSaveBytesAllocated()
+*/
+qint64 QGifImage::lastSaveBytesFreed() const
+{
+    Q_D(const QGifImage);
+    return d->lastSaveBytesFreed;
+}
+
 /*!
     Loads an gif image from the file with the given \a fileName. Returns \c true if
     the image was successfully loaded; otherwise invalidates the image
@@ -671,7 +2729,7 @@ bool QGifImage::load(const QString &fileName)
 bool QGifImage::load(QIODevice *device)
 {
     Q_D(QGifImage);
-    if (device->openMode() | QIODevice::ReadOnly)
+    if (device->openMode() & QIODevice::ReadOnly)
         return d->load(device);
 
     return false;
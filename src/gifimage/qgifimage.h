@@ -32,10 +32,38 @@
 #include <QVector>
 
 class QGifImagePrivate;
+class QGifQuantizer;
 class Q_GIFIMAGE_EXPORT QGifImage
 {
     Q_DECLARE_PRIVATE(QGifImage)
 public:
+    enum DitherMode {
+        NoDither,
+        OrderedDither,
+        BlueNoiseDither,
+        FloydSteinbergDither,
+        SierraDither
+    };
+
+    enum DisposalMode {
+        UnspecifiedDisposal,
+        DoNotDispose,
+        DisposeToBackground,
+        DisposeToPrevious
+    };
+
+    enum CompressionLevel {
+        FastestCompression,
+        NormalCompression,
+        BestCompression
+    };
+
+    enum ClearPolicy {
+        FixedClear,
+        DeferredClear,
+        RatioDropClear
+    };
+
     QGifImage();
     QGifImage(const QString &fileName);
     QGifImage(const QSize &size);
@@ -44,6 +72,8 @@ public:
     QVector<QRgb> globalColorTable() const;
     QColor backgroundColor() const;
     void setGlobalColorTable(const QVector<QRgb> &colors, const QColor &bgColor = QColor());
+    bool autoGlobalColorTable() const;
+    void setAutoGlobalColorTable(bool enable);
     int defaultDelay() const;
     void setDefaultDelay(int internal);
     QColor defaultTransparentColor() const;
@@ -52,6 +82,37 @@ public:
     int loopCount() const;
     void setLoopCount(int loop);
 
+    QGifQuantizer *quantizer() const;
+    void setQuantizer(QGifQuantizer *quantizer);
+    DitherMode ditherMode() const;
+    void setDitherMode(DitherMode mode);
+    int paletteReuseTolerance() const;
+    void setPaletteReuseTolerance(int tolerance);
+    int paletteGroupCount() const;
+    void setPaletteGroupCount(int count);
+    bool reorderColorTable() const;
+    void setReorderColorTable(bool enable);
+    bool mergeDuplicateFrames() const;
+    void setMergeDuplicateFrames(bool enable);
+    bool autoDisposalMode() const;
+    void setAutoDisposalMode(bool enable);
+    int maxColorCount() const;
+    void setMaxColorCount(int count);
+    int lossyLevel() const;
+    void setLossyLevel(int level);
+    int frameDropCount() const;
+    void setFrameDropCount(int count);
+    qint64 targetSize() const;
+    void setTargetSize(qint64 size);
+    CompressionLevel compressionLevel() const;
+    void setCompressionLevel(CompressionLevel level);
+    ClearPolicy clearPolicy() const;
+    void setClearPolicy(ClearPolicy policy);
+    bool parallelCompression() const;
+    void setParallelCompression(bool enable);
+    bool parallelDecoding() const;
+    void setParallelDecoding(bool enable);
+
     int frameCount() const;
     QImage frame(int index) const;
 
@@ -66,12 +127,18 @@ public:
     void setFrameDelay(int index, int delay);
     QColor frameTransparentColor(int index) const;
     void setFrameTransparentColor(int index, const QColor &color);
+    DisposalMode frameDisposalMode(int index) const;
+    void setFrameDisposalMode(int index, DisposalMode mode);
+    qreal frameCompressionRatio(int index) const;
 
     bool load(QIODevice *device);
     bool load(const QString &fileName);
     bool save(QIODevice *device) const;
     bool save(const QString &fileName) const;
 
+    qint64 lastSaveBytesAllocated() const;
+    qint64 lastSaveBytesFreed() const;
+
 private:
     QGifImagePrivate * const d_ptr;
 };
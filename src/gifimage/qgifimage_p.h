@@ -26,6 +26,7 @@
 #define QGIFIMAGE_P_H
 
 #include "qgifimage.h"
+#include "qgifquantizer_p.h"
 #include "gif_lib.h"
 
 #include <QVector>
@@ -35,7 +36,8 @@ class QGifFrameInfoData
 {
 public:
     QGifFrameInfoData()
-        :delayTime(-1), interlace(false)
+        :delayTime(-1), interlace(false), disposalMode(QGifImage::UnspecifiedDisposal), dirty(true), encodedTransparentIndex(-1), encodedMaxColorCount(0), encodedLossyLevel(0),
+          compressionRatio(0), histogramValid(false), imageHashValid(false), imageHash(0)
     {
 
     }
@@ -44,6 +46,55 @@ public:
     int delayTime;
     bool interlace;
     QColor transparentColor;
+    QGifImage::DisposalMode disposalMode;
+
+    //Set when the frame must be encoded again by the next save().
+    mutable bool dirty;
+    //Image descriptor and compressed pixels written by the last save(), with
+    //the area of the canvas they cover, the color tables they were encoded
+    //against, the color table of the frame itself, its transparent color
+    //index, and the color count and lossy level they were encoded with. The
+    //graphics control block is written again by every save(), the delay of
+    //the frame may change.
+    mutable QByteArray encodedBytes;
+    mutable QRect encodedRect;
+    mutable QVector<QRgb> encodedGlobalColorTable;
+    mutable QVector<QRgb> encodedContextColorTable;
+    mutable QVector<QRgb> encodedColorTable;
+    mutable int encodedTransparentIndex;
+    mutable int encodedMaxColorCount;
+    mutable int encodedLossyLevel;
+    //Pixels of the frame over the bytes of its LZW codes, as last saved.
+    mutable qreal compressionRatio;
+    //Sampled colors and hash of the image, which never changes once the frame
+    //is added.
+    mutable bool histogramValid;
+    mutable QGifColorHistogram histogram;
+    mutable bool imageHashValid;
+    mutable quint64 imageHash;
+};
+
+//Consecutive frames written as one, from first to last.
+struct QGifFrameRun
+{
+    QGifFrameRun() : first(0), last(0), delayTime(0), dirty(false) {}
+    QGifFrameRun(int index, int delayTime, bool dirty)
+        : first(index), last(index), delayTime(delayTime), dirty(dirty) {}
+    int first;
+    int last;
+    int delayTime;
+    bool dirty;
+};
+
+//Settings which trade the quality of the frames against the file size.
+struct QGifEncodeLevel
+{
+    QGifEncodeLevel() : maxColorCount(256), lossyLevel(0), frameDropCount(0) {}
+    QGifEncodeLevel(int maxColorCount, int lossyLevel, int frameDropCount)
+        : maxColorCount(maxColorCount), lossyLevel(lossyLevel), frameDropCount(frameDropCount) {}
+    int maxColorCount;
+    int lossyLevel;
+    int frameDropCount;
 };
 
 class QGifImagePrivate
@@ -52,12 +103,29 @@ class QGifImagePrivate
 public:
     QGifImagePrivate(QGifImage *p);
     ~QGifImagePrivate();
+    void invalidateFrames();
     bool load(QIODevice *device);
     bool save(QIODevice *device) const;
+    bool encode(QIODevice *device, const QGifEncodeLevel &level) const;
+    void reserveBuffer(QIODevice *device) const;
+    QVector<QGifEncodeLevel> targetSizeLevels() const;
+    bool writeScreenDescriptor(GifFileType *gifFile, const QVector<QRgb> &colorTable) const;
+    bool writeFrame(GifFileType *gifFile, const QGifFrameInfoData &info, const ColorMapObject *colorMap) const;
     QVector<QRgb> colorTableFromColorMapObject(ColorMapObject *object, int transColorIndex=-1) const;
     ColorMapObject * colorTableToColorMapObject(QVector<QRgb> colorTable) const;
     QSize getCanvasSize() const;
+    QColor getFrameTransparentColor(const QGifFrameInfoData &info) const;
     int getFrameTransparentColorIndex(const QGifFrameInfoData &info) const;
+    int getFrameDelay(const QGifFrameInfoData &info) const;
+    bool isDuplicateFrame(const QGifFrameInfoData &info1, const QGifFrameInfoData &info2) const;
+    QList<QGifFrameInfoData> planFrameDisposals(const QVector<QGifFrameRun> &frameRuns) const;
+    QImage mapFrame(const QGifFrameInfoData &info, const QVector<QRgb> &colorTable) const;
+    bool canReuseColorTable(const QGifFrameInfoData &info, const QVector<QRgb> &colorTable) const;
+    QImage quantizeFrame(const QGifFrameInfoData &info) const;
+    QVector<QGifColorHistogram> computeFrameHistograms() const;
+    QVector<QRgb> buildColorTable(QGifColorHistogram histogram, const QVector<int> &frameIndexes) const;
+    QVector<QRgb> buildGlobalColorTable() const;
+    QVector<QVector<QRgb> > buildGroupColorTables(QVector<int> *frameGroups) const;
 
     QSize canvasSize;
     int loopCount;
@@ -66,7 +134,36 @@ public:
 
     QVector<QRgb> globalColorTable;
     QColor bgColor;
+    bool autoGlobalColorTable;
     QList<QGifFrameInfoData> frameInfos;
+    QGifQuantizer *quantizer;
+    QGifImage::DitherMode ditherMode;
+    int paletteReuseTolerance;
+    int paletteGroupCount;
+    bool reorderColorTable;
+    bool mergeDuplicateFrames;
+    bool autoDisposalMode;
+    int maxColorCount;
+    int lossyLevel;
+    int frameDropCount;
+    qint64 targetSize;
+    QGifImage::CompressionLevel compressionLevel;
+    QGifImage::ClearPolicy clearPolicy;
+    bool parallelCompression;
+    bool parallelDecoding;
+    //Settings of the encode() in progress.
+    mutable QGifEncodeLevel encodeLevel;
+    mutable qint64 lastSaveBytesAllocated;
+    mutable qint64 lastSaveBytesFreed;
+    //Color tables built from all the frames by the last save().
+    mutable QVector<QRgb> builtGlobalColorTable;
+    mutable QVector<int> builtFrameGroups;
+    mutable QVector<QVector<QRgb> > builtGroupColorTables;
+    mutable int builtMaxColorCount;
+    //Runs of frames and frames planned by the last save(), when the disposal
+    //modes are automatic.
+    mutable QVector<QGifFrameRun> builtFrameRuns;
+    mutable QList<QGifFrameInfoData> builtPlannedFrames;
 
     QGifImage *q_ptr;
 };
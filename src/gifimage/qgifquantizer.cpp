@@ -0,0 +1,721 @@
+/****************************************************************************
+** Copyright (c) 2013 Debao Zhang <hello@debao.me>
+** All right reserved.
+**
+** Permission is hereby granted, free of charge, to any person obtaining
+** a copy of this software and associated documentation files (the
+** "Software"), to deal in the Software without restriction, including
+** without limitation the rights to use, copy, modify, merge, publish,
+** distribute, sublicense, and/or sell copies of the Software, and to
+** permit persons to whom the Software is furnished to do so, subject to
+** the following conditions:
+**
+** The above copyright notice and this permission notice shall be
+** included in all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+** EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+** MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+** NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+** LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+** OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+** WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+**
+****************************************************************************/
+#include "qgifquantizer.h"
+#include "qgifquantizer_p.h"
+#include "gif_lib.h"
+
+#include <QGlobalStatic>
+#include <QList>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QPair>
+#include <QVarLengthArray>
+#include <QtAlgorithms>
+#include <limits.h>
+
+namespace
+{
+inline int colorDistance(QRgb c1, QRgb c2)
+{
+    int dr = qRed(c1) - qRed(c2);
+    int dg = qGreen(c1) - qGreen(c2);
+    int db = qBlue(c1) - qBlue(c2);
+    return dr * dr + dg * dg + db * db;
+}
+
+//Number of color lookups kept by QGifColorLookup::get()
+const int maxCachedLookups = 8;
+
+struct LookupCache
+{
+    QMutex mutex;
+    QList<QSharedPointer<QGifColorLookup> > lookups;
+};
+
+Q_GLOBAL_STATIC(LookupCache, lookupCache)
+
+inline int histogramIndex(QRgb color)
+{
+    //Same layout as the one used by quantize.c: 5 bits per primary color.
+    return ((qRed(color) >> 3) << 10) | ((qGreen(color) >> 3) << 5) | (qBlue(color) >> 3);
+}
+
+struct ColorSum
+{
+    ColorSum() : red(0), green(0), blue(0), count(0) {}
+    void add(QRgb color, quint64 weight)
+    {
+        red += qRed(color) * weight;
+        green += qGreen(color) * weight;
+        blue += qBlue(color) * weight;
+        count += weight;
+    }
+    QRgb average() const
+    {
+        if (!count)
+            return qRgb(0, 0, 0);
+        return qRgb((red + count / 2) / count, (green + count / 2) / count, (blue + count / 2) / count);
+    }
+    quint64 red, green, blue, count;
+};
+}
+
+QGifColorHistogram::QGifColorHistogram()
+{
+}
+
+/*
+    Count the colors of \a image. Only one pixel out of \a sampleStep
+    is counted in both directions, the alpha channel is ignored.
+ */
+void QGifColorHistogram::addImage(const QImage &image, int sampleStep)
+{
+    if (image.isNull())
+        return;
+    if (sampleStep < 1)
+        sampleStep = 1;
+
+    if (image.format() == QImage::Format_Indexed8) {
+        QVector<quint32> indexCounts(256, 0);
+        for (int y = 0; y < image.height(); y += sampleStep) {
+            const uchar *line = image.constScanLine(y);
+            for (int x = (y / sampleStep) % sampleStep; x < image.width(); x += sampleStep)
+                ++indexCounts[line[x]];
+        }
+        const QVector<QRgb> table = image.colorTable();
+        for (int idx = 0; idx < table.size(); ++idx) {
+            if (indexCounts[idx])
+                bins[table[idx] | 0xff000000] += indexCounts[idx];
+        }
+        return;
+    }
+
+    QImage argbImage = image;
+    if (image.format() != QImage::Format_RGB32 && image.format() != QImage::Format_ARGB32)
+        argbImage = image.convertToFormat(QImage::Format_ARGB32);
+
+    for (int y = 0; y < argbImage.height(); y += sampleStep) {
+        const QRgb *line = reinterpret_cast<const QRgb *>(argbImage.constScanLine(y));
+        //Flat areas are common in gif frames, so count runs instead of pixels.
+        QRgb runColor = 0;
+        quint32 runLength = 0;
+        for (int x = (y / sampleStep) % sampleStep; x < argbImage.width(); x += sampleStep) {
+            QRgb color = line[x] | 0xff000000;
+            if (runLength && color == runColor) {
+                ++runLength;
+                continue;
+            }
+            if (runLength)
+                bins[runColor] += runLength;
+            runColor = color;
+            runLength = 1;
+        }
+        if (runLength)
+            bins[runColor] += runLength;
+    }
+}
+
+void QGifColorHistogram::addHistogram(const QGifColorHistogram &other)
+{
+    QHash<QRgb, quint32>::const_iterator it = other.bins.constBegin();
+    for (; it != other.bins.constEnd(); ++it)
+        bins[it.key()] += it.value();
+}
+
+void QGifColorHistogram::removeColor(QRgb color)
+{
+    bins.remove(color | 0xff000000);
+}
+
+bool QGifColorHistogram::containsColor(QRgb color) const
+{
+    return bins.contains(color | 0xff000000);
+}
+
+int QGifColorHistogram::colorCount() const
+{
+    return bins.size();
+}
+
+/*
+    The colors are sorted, so that the quantizers give the same result
+    whatever the order in which the images were added.
+ */
+void QGifColorHistogram::getColors(QVector<QRgb> *colors, QVector<quint32> *counts) const
+{
+    QVector<QRgb> sortedColors;
+    sortedColors.reserve(bins.size());
+    QHash<QRgb, quint32>::const_iterator it = bins.constBegin();
+    for (; it != bins.constEnd(); ++it)
+        sortedColors.append(it.key());
+    qSort(sortedColors.begin(), sortedColors.end());
+
+    counts->resize(sortedColors.size());
+    for (int idx = 0; idx < sortedColors.size(); ++idx)
+        (*counts)[idx] = bins.value(sortedColors[idx]);
+    *colors = sortedColors;
+}
+
+/*
+    QGifColorLookup finds the nearest color of a color table. The RGB cube
+    is split in cells, and each cell is lazily filled the first time one of
+    its colors is looked up: if only one color of the table can be the
+    nearest color of the whole cell, it is stored in the cell. Otherwise,
+    the nearest color is searched in the colors sorted by r+g+b. The result
+    is the same as the one of a linear search, so the cells can be filled
+    concurrently by several threads.
+ */
+QGifColorLookup::QGifColorLookup(const QVector<QRgb> &colorTable, int transparentIndex)
+    : table(colorTable), transIndex(transparentIndex)
+{
+    //Small tables have large Voronoi cells, 5 bits per primary color is enough.
+    cellBits = table.size() <= 64 ? 5 : 6;
+    cells.resize(1 << (3 * cellBits));
+    cellData = cells.data();
+
+    QVector<QPair<int, int> > sums;
+    for (int idx = 0; idx < table.size(); ++idx) {
+        if (idx != transIndex)
+            sums.append(qMakePair(qRed(table[idx]) + qGreen(table[idx]) + qBlue(table[idx]), idx));
+    }
+    qSort(sums.begin(), sums.end());
+    for (int idx = 0; idx < sums.size(); ++idx) {
+        sortedSums.append(sums[idx].first);
+        sortedIndexes.append(sums[idx].second);
+    }
+}
+
+/*
+    Return the lookup of \a colorTable, the lookups of the recently used
+    color tables are shared, so that all the frames which use the same
+    color table share the filled cells.
+ */
+QSharedPointer<QGifColorLookup> QGifColorLookup::get(const QVector<QRgb> &colorTable, int transparentIndex)
+{
+    LookupCache *cache = lookupCache();
+    QMutexLocker locker(&cache->mutex);
+    for (int idx = 0; idx < cache->lookups.size(); ++idx) {
+        QSharedPointer<QGifColorLookup> lookup = cache->lookups[idx];
+        if (lookup->transIndex == transparentIndex && lookup->table == colorTable) {
+            cache->lookups.move(idx, 0);
+            return lookup;
+        }
+    }
+
+    QSharedPointer<QGifColorLookup> lookup(new QGifColorLookup(colorTable, transparentIndex));
+    cache->lookups.prepend(lookup);
+    while (cache->lookups.size() > maxCachedLookups)
+        cache->lookups.removeLast();
+    return lookup;
+}
+
+/*
+    Returns the index of the nearest color, the transparent one excluded.
+    The first one is returned when several colors are at the same distance.
+ */
+int QGifColorLookup::nearestOpaqueIndex(QRgb color) const
+{
+    if (sortedIndexes.isEmpty())
+        return 0;
+
+    int cell = cellIndex(color);
+    int value = cellData[cell].loadAcquire();
+    if (!value)
+        value = fillCell(cell);
+    if (value > 0)
+        return value - 1;
+    return searchNearest(color);
+}
+
+int QGifColorLookup::cellIndex(QRgb color) const
+{
+    int shift = 8 - cellBits;
+    return ((qRed(color) >> shift) << (2 * cellBits)) | ((qGreen(color) >> shift) << cellBits)
+            | (qBlue(color) >> shift);
+}
+
+int QGifColorLookup::fillCell(int cell) const
+{
+    int mask = (1 << cellBits) - 1;
+    int shift = 8 - cellBits;
+    int low[3] = { ((cell >> (2 * cellBits)) & mask) << shift, ((cell >> cellBits) & mask) << shift,
+                   (cell & mask) << shift };
+    int high = (1 << shift) - 1;
+
+    //Distances from the cell to each color: the nearest color of a point in
+    //the cell is one of the colors closer to the cell than minMaxDistance.
+    QVarLengthArray<int, 256> minDistances(table.size());
+    int minMaxDistance = INT_MAX;
+    for (int idx = 0; idx < table.size(); ++idx) {
+        if (idx == transIndex)
+            continue;
+        int channels[3] = { qRed(table[idx]), qGreen(table[idx]), qBlue(table[idx]) };
+        int minDistance = 0;
+        int maxDistance = 0;
+        for (int c = 0; c < 3; ++c) {
+            int below = low[c] - channels[c];
+            int above = channels[c] - (low[c] + high);
+            int nearest = qMax(0, qMax(below, above));
+            int farthest = qMax(qAbs(below), qAbs(above));
+            minDistance += nearest * nearest;
+            maxDistance += farthest * farthest;
+        }
+        minDistances[idx] = minDistance;
+        minMaxDistance = qMin(minMaxDistance, maxDistance);
+    }
+
+    int value = 0;
+    for (int idx = 0; idx < table.size(); ++idx) {
+        if (idx == transIndex || minDistances[idx] > minMaxDistance)
+            continue;
+        if (value) {
+            value = -1;
+            break;
+        }
+        value = idx + 1;
+    }
+    cellData[cell].storeRelease(value);
+    return value;
+}
+
+int QGifColorLookup::searchNearest(QRgb color) const
+{
+    //The distance between two colors is at least (sum1 - sum2)^2 / 3
+    int sum = qRed(color) + qGreen(color) + qBlue(color);
+    int start = qLowerBound(sortedSums.begin(), sortedSums.end(), sum) - sortedSums.begin();
+    int index = -1;
+    int minDistance = INT_MAX;
+    bool searchDown = true;
+    bool searchUp = true;
+    for (int step = 0; searchDown || searchUp; ++step) {
+        for (int side = 0; side < 2; ++side) {
+            int pos = side ? start + step : start - step - 1;
+            bool &search = side ? searchUp : searchDown;
+            if (!search)
+                continue;
+            if (pos < 0 || pos >= sortedSums.size()) {
+                search = false;
+                continue;
+            }
+            int delta = sortedSums[pos] - sum;
+            if (index != -1 && delta * delta > 3 * minDistance) {
+                search = false;
+                continue;
+            }
+            int idx = sortedIndexes[pos];
+            int distance = colorDistance(color, table[idx]);
+            if (distance < minDistance || (distance == minDistance && idx < index)) {
+                minDistance = distance;
+                index = idx;
+            }
+        }
+    }
+    return index;
+}
+
+/*
+    When \a transparentIndex is not -1, only the pixels of that exact color
+    are mapped to it, so that no hole is made in the other areas.
+ */
+QGifColorMapper::QGifColorMapper(const QVector<QRgb> &colorTable, int transparentIndex)
+    : table(colorTable), transparentIndex(transparentIndex)
+    , lookup(QGifColorLookup::get(colorTable, transparentIndex))
+{
+}
+
+QVector<QRgb> QGifColorMapper::colorTable() const
+{
+    return table;
+}
+
+bool QGifColorMapper::isTransparent(QRgb color) const
+{
+    return transparentIndex != -1 && (color | 0xff000000) == (table[transparentIndex] | 0xff000000);
+}
+
+int QGifColorMapper::nearestIndex(QRgb color) const
+{
+    if (isTransparent(color))
+        return transparentIndex;
+    return nearestOpaqueIndex(color);
+}
+
+/*
+    Returns the index of the nearest color, the transparent one excluded.
+ */
+int QGifColorMapper::nearestOpaqueIndex(QRgb color) const
+{
+    return lookup->nearestOpaqueIndex(color);
+}
+
+/*
+    Convert \a image to a Format_Indexed8 image which use the color table
+    of the mapper. No dithering is done.
+ */
+QImage QGifColorMapper::map(const QImage &image) const
+{
+    if (image.isNull() || table.isEmpty())
+        return QImage();
+
+    QImage result(image.width(), image.height(), QImage::Format_Indexed8);
+    result.setColorTable(table);
+    result.setOffset(image.offset());
+
+    if (image.format() == QImage::Format_Indexed8) {
+        const QVector<QRgb> sourceTable = image.colorTable();
+        QVector<uchar> translation(256, 0);
+        for (int idx = 0; idx < sourceTable.size(); ++idx)
+            translation[idx] = nearestIndex(sourceTable[idx]);
+        for (int y = 0; y < image.height(); ++y) {
+            const uchar *src = image.constScanLine(y);
+            uchar *dst = result.scanLine(y);
+            for (int x = 0; x < image.width(); ++x)
+                dst[x] = translation[src[x]];
+        }
+        return result;
+    }
+
+    QImage argbImage = image;
+    if (image.format() != QImage::Format_RGB32 && image.format() != QImage::Format_ARGB32)
+        argbImage = image.convertToFormat(QImage::Format_ARGB32);
+
+    for (int y = 0; y < argbImage.height(); ++y) {
+        const QRgb *src = reinterpret_cast<const QRgb *>(argbImage.constScanLine(y));
+        uchar *dst = result.scanLine(y);
+        QRgb lastColor = src[0] | 0xff000000;
+        int lastIndex = nearestIndex(lastColor);
+        for (int x = 0; x < argbImage.width(); ++x) {
+            QRgb color = src[x] | 0xff000000;
+            if (color != lastColor) {
+                lastColor = color;
+                lastIndex = nearestIndex(color);
+            }
+            dst[x] = lastIndex;
+        }
+    }
+    return result;
+}
+
+namespace
+{
+struct OctreeNode
+{
+    OctreeNode() : leaf(false)
+    {
+        for (int i = 0; i < 8; ++i)
+            children[i] = -1;
+    }
+    ColorSum sum;
+    int children[8];
+    bool leaf;
+};
+
+inline int octreeChildIndex(QRgb color, int level)
+{
+    int shift = 7 - level;
+    return (((qRed(color) >> shift) & 1) << 2)
+            | (((qGreen(color) >> shift) & 1) << 1)
+            | ((qBlue(color) >> shift) & 1);
+}
+
+void collectOctreeLeaves(const QVector<OctreeNode> &nodes, int nodeIndex, QVector<QRgb> *table)
+{
+    const OctreeNode &node = nodes[nodeIndex];
+    if (node.leaf) {
+        table->append(node.sum.average());
+        return;
+    }
+    for (int i = 0; i < 8; ++i) {
+        if (node.children[i] != -1)
+            collectOctreeLeaves(nodes, node.children[i], table);
+    }
+}
+}
+
+/*
+    Build the full octree of the colors, then fold the least used nodes,
+    deepest level first, until no more than maxColors leaves are left.
+ */
+QVector<QRgb> QGifOctreeQuantizer::colorTable(const QVector<QRgb> &colors, const QVector<quint32> &counts,
+                                              int maxColors) const
+{
+    maxColors = qBound(1, maxColors, 256);
+
+    QVector<OctreeNode> nodes;
+    nodes.reserve(colors.size() * 2 + 1);
+    nodes.append(OctreeNode());
+    QVector<QVector<int> > levelNodes(8);
+    levelNodes[0].append(0);
+    int leafCount = 0;
+
+    for (int idx = 0; idx < colors.size(); ++idx) {
+        int nodeIndex = 0;
+        nodes[0].sum.add(colors[idx], counts[idx]);
+        for (int level = 0; level < 8; ++level) {
+            int child = octreeChildIndex(colors[idx], level);
+            if (nodes[nodeIndex].children[child] == -1) {
+                nodes.append(OctreeNode());
+                nodes[nodeIndex].children[child] = nodes.size() - 1;
+                if (level == 7) {
+                    nodes.last().leaf = true;
+                    ++leafCount;
+                } else {
+                    levelNodes[level + 1].append(nodes.size() - 1);
+                }
+            }
+            nodeIndex = nodes[nodeIndex].children[child];
+            nodes[nodeIndex].sum.add(colors[idx], counts[idx]);
+        }
+    }
+
+    for (int level = 7; level >= 0 && leafCount > maxColors; --level) {
+        QVector<QPair<quint64, int> > candidates;
+        candidates.reserve(levelNodes[level].size());
+        foreach (int nodeIndex, levelNodes[level])
+            candidates.append(qMakePair(nodes[nodeIndex].sum.count, nodeIndex));
+        qSort(candidates.begin(), candidates.end());
+
+        for (int i = 0; i < candidates.size() && leafCount > maxColors; ++i) {
+            OctreeNode &node = nodes[candidates[i].second];
+            int childCount = 0;
+            for (int c = 0; c < 8; ++c) {
+                if (node.children[c] != -1) {
+                    ++childCount;
+                    node.children[c] = -1;
+                }
+            }
+            node.leaf = true;
+            leafCount -= childCount - 1;
+        }
+    }
+
+    QVector<QRgb> table;
+    if (!colors.isEmpty())
+        collectOctreeLeaves(nodes, 0, &table);
+    return table;
+}
+
+/*
+    The boxes are computed by the median cut of giflib on a 15 bits histogram,
+    but each color of the table is the exact mean of the colors in its box.
+ */
+QVector<QRgb> QGifMedianCutQuantizer::colorTable(const QVector<QRgb> &colors, const QVector<quint32> &counts,
+                                                 int maxColors) const
+{
+    maxColors = qBound(1, maxColors, 256);
+
+    QVector<unsigned long> histogram(GIF_QUANTIZE_HISTOGRAM_SIZE, 0);
+    for (int idx = 0; idx < colors.size(); ++idx)
+        histogram[histogramIndex(colors[idx])] += counts[idx];
+
+    int colorMapSize = maxColors;
+    QVector<GifColorType> colorMap(256);
+    QVector<GifByteType> indexMap(GIF_QUANTIZE_HISTOGRAM_SIZE);
+    if (GifQuantizeHistogram(histogram.constData(), &colorMapSize, colorMap.data(), indexMap.data()) == GIF_ERROR)
+        return QVector<QRgb>();
+
+    QVector<ColorSum> sums(colorMapSize);
+    for (int idx = 0; idx < colors.size(); ++idx)
+        sums[indexMap[histogramIndex(colors[idx])]].add(colors[idx], counts[idx]);
+
+    QVector<QRgb> table;
+    for (int idx = 0; idx < colorMapSize; ++idx) {
+        if (sums[idx].count)
+            table.append(sums[idx].average());
+    }
+    return table;
+}
+
+QGifKMeansQuantizer::QGifKMeansQuantizer()
+    : maxIterations(16)
+{
+}
+
+/*
+    Lloyd's k-means, seeded with the median cut table. When there are too
+    many distinct colors, they are first merged into 15 bits boxes whose
+    weighted means are used as input points.
+ */
+QVector<QRgb> QGifKMeansQuantizer::colorTable(const QVector<QRgb> &colors, const QVector<quint32> &counts,
+                                              int maxColors) const
+{
+    QVector<QRgb> centers = QGifMedianCutQuantizer().colorTable(colors, counts, maxColors);
+    if (centers.size() < 2)
+        return centers;
+
+    QVector<QRgb> points = colors;
+    QVector<quint32> weights = counts;
+    if (points.size() > GIF_QUANTIZE_HISTOGRAM_SIZE) {
+        QVector<ColorSum> boxes(GIF_QUANTIZE_HISTOGRAM_SIZE);
+        for (int idx = 0; idx < colors.size(); ++idx)
+            boxes[histogramIndex(colors[idx])].add(colors[idx], counts[idx]);
+        points.clear();
+        weights.clear();
+        for (int idx = 0; idx < boxes.size(); ++idx) {
+            if (boxes[idx].count) {
+                points.append(boxes[idx].average());
+                weights.append(qMin<quint64>(boxes[idx].count, 0xffffffff));
+            }
+        }
+    }
+
+    QVector<int> assignment(points.size(), -1);
+    for (int iteration = 0; iteration < maxIterations; ++iteration) {
+        bool changed = false;
+        for (int idx = 0; idx < points.size(); ++idx) {
+            int best = assignment[idx] == -1 ? 0 : assignment[idx];
+            int bestDistance = colorDistance(points[idx], centers[best]);
+            for (int c = 0; c < centers.size() && bestDistance; ++c) {
+                int distance = colorDistance(points[idx], centers[c]);
+                if (distance < bestDistance) {
+                    bestDistance = distance;
+                    best = c;
+                }
+            }
+            if (best != assignment[idx]) {
+                assignment[idx] = best;
+                changed = true;
+            }
+        }
+        if (!changed)
+            break;
+
+        QVector<ColorSum> sums(centers.size());
+        for (int idx = 0; idx < points.size(); ++idx)
+            sums[assignment[idx]].add(points[idx], weights[idx]);
+        for (int c = 0; c < centers.size(); ++c) {
+            //Keep the old center of an empty cluster.
+            if (sums[c].count)
+                centers[c] = sums[c].average();
+        }
+    }
+    return centers;
+}
+
+/*!
+    \class QGifQuantizer
+    \inmodule QtGifImage
+    \brief The QGifQuantizer class reduces the colors of an image to a color table.
+
+    Gif files can only store indexed images with no more than 256 colors.
+    A quantizer is used by QGifImage::save() to build the color table of
+    the frames which are not Format_Indexed8 images.
+
+    Subclasses must implement colorTable(), which computes the color table
+    from the histogram of an image. Three built-in quantizers can be created
+    with create().
+*/
+
+/*!
+    \enum QGifQuantizer::Method
+
+    \value Octree Fast quantizer, the least used branches of an octree of
+           the colors are folded.
+    \value MedianCut Balanced quantizer, the color space is split at the
+           median of the largest axis. It is the quantizer of giflib.
+    \value KMeans High quality quantizer, the median cut colors are refined
+           with a k-means clustering. It is the slowest one.
+*/
+
+/*!
+    Constructs a quantizer.
+*/
+QGifQuantizer::QGifQuantizer()
+{
+}
+
+/*!
+    Destroys the quantizer.
+*/
+QGifQuantizer::~QGifQuantizer()
+{
+}
+
+/*!
+    \fn QVector<QRgb> QGifQuantizer::colorTable(const QVector<QRgb> &colors, const QVector<quint32> &counts, int maxColors) const
+
+    Returns a color table of no more than \a maxColors colors which
+    represents the \a colors, each of them found \a counts times in the image.
+
+    The colors are opaque and distinct, and there are always more than
+    \a maxColors of them.
+*/
+
+/*!
+    \overload
+
+    Returns a color table of no more than \a maxColors colors for \a image.
+    If the image has no more than \a maxColors colors, they are returned as is.
+*/
+QVector<QRgb> QGifQuantizer::colorTable(const QImage &image, int maxColors) const
+{
+    QGifColorHistogram histogram;
+    histogram.addImage(image);
+
+    QVector<QRgb> colors;
+    QVector<quint32> counts;
+    histogram.getColors(&colors, &counts);
+    if (colors.size() <= maxColors)
+        return colors;
+
+    return colorTable(colors, counts, maxColors);
+}
+
+/*!
+    Returns a Format_Indexed8 copy of \a image with no more than
+    \a maxColors colors.
+*/
+QImage QGifQuantizer::quantize(const QImage &image, int maxColors) const
+{
+    return QGifColorMapper(colorTable(image, maxColors)).map(image);
+}
+
+/*!
+    \overload
+
+    Returns a Format_Indexed8 copy of \a image which use the given
+    \a colorTable. Each pixel is mapped to the nearest color of the table.
+*/
+QImage QGifQuantizer::quantize(const QImage &image, const QVector<QRgb> &colorTable)
+{
+    return QGifColorMapper(colorTable).map(image);
+}
+
+/*!
+    Creates a built-in quantizer of the given \a method.
+    The caller takes ownership of the returned object.
+*/
+QGifQuantizer *QGifQuantizer::create(Method method)
+{
+    switch (method) {
+    case Octree:
+        return new QGifOctreeQuantizer;
+    case MedianCut:
+        return new QGifMedianCutQuantizer;
+    case KMeans:
+        return new QGifKMeansQuantizer;
+    }
+    return 0;
+}
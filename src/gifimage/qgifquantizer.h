@@ -0,0 +1,57 @@
+/****************************************************************************
+** Copyright (c) 2013 Debao Zhang <hello@debao.me>
+** All right reserved.
+**
+** Permission is hereby granted, free of charge, to any person obtaining
+** a copy of this software and associated documentation files (the
+** "Software"), to deal in the Software without restriction, including
+** without limitation the rights to use, copy, modify, merge, publish,
+** distribute, sublicense, and/or sell copies of the Software, and to
+** permit persons to whom the Software is furnished to do so, subject to
+** the following conditions:
+**
+** The above copyright notice and this permission notice shall be
+** included in all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+** EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+** MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+** NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+** LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+** OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+** WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+**
+****************************************************************************/
+#ifndef QGIFQUANTIZER_H
+#define QGIFQUANTIZER_H
+
+#include "qgifglobal.h"
+#include <QImage>
+#include <QVector>
+
+class Q_GIFIMAGE_EXPORT QGifQuantizer
+{
+public:
+    enum Method {
+        Octree,
+        MedianCut,
+        KMeans
+    };
+
+    QGifQuantizer();
+    virtual ~QGifQuantizer();
+
+    virtual QVector<QRgb> colorTable(const QVector<QRgb> &colors, const QVector<quint32> &counts,
+                                     int maxColors) const = 0;
+
+    QVector<QRgb> colorTable(const QImage &image, int maxColors = 256) const;
+    QImage quantize(const QImage &image, int maxColors = 256) const;
+    static QImage quantize(const QImage &image, const QVector<QRgb> &colorTable);
+
+    static QGifQuantizer *create(Method method);
+
+private:
+    Q_DISABLE_COPY(QGifQuantizer)
+};
+
+#endif // QGIFQUANTIZER_H
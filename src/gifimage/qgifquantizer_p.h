@@ -0,0 +1,121 @@
+/****************************************************************************
+** Copyright (c) 2013 Debao Zhang <hello@debao.me>
+** All right reserved.
+**
+** Permission is hereby granted, free of charge, to any person obtaining
+** a copy of this software and associated documentation files (the
+** "Software"), to deal in the Software without restriction, including
+** without limitation the rights to use, copy, modify, merge, publish,
+** distribute, sublicense, and/or sell copies of the Software, and to
+** permit persons to whom the Software is furnished to do so, subject to
+** the following conditions:
+**
+** The above copyright notice and this permission notice shall be
+** included in all copies or substantial portions of the Software.
+**
+** THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+** EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+** MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+** NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+** LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+** OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+** WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+**
+****************************************************************************/
+#ifndef QGIFQUANTIZER_P_H
+#define QGIFQUANTIZER_P_H
+
+#include "qgifquantizer.h"
+
+#include <QAtomicInt>
+#include <QHash>
+#include <QSharedPointer>
+#include <QVector>
+
+class QGifColorHistogram
+{
+public:
+    QGifColorHistogram();
+
+    void addImage(const QImage &image, int sampleStep = 1);
+    void addHistogram(const QGifColorHistogram &other);
+    void removeColor(QRgb color);
+    bool containsColor(QRgb color) const;
+
+    int colorCount() const;
+    void getColors(QVector<QRgb> *colors, QVector<quint32> *counts) const;
+
+private:
+    QHash<QRgb, quint32> bins;
+};
+
+class QGifColorLookup
+{
+public:
+    QGifColorLookup(const QVector<QRgb> &colorTable, int transparentIndex);
+
+    static QSharedPointer<QGifColorLookup> get(const QVector<QRgb> &colorTable, int transparentIndex);
+
+    QVector<QRgb> colorTable() const { return table; }
+    int transparentIndex() const { return transIndex; }
+    int nearestOpaqueIndex(QRgb color) const;
+
+private:
+    int cellIndex(QRgb color) const;
+    int fillCell(int cell) const;
+    int searchNearest(QRgb color) const;
+
+    QVector<QRgb> table;
+    int transIndex;
+    int cellBits;
+    //Opaque colors sorted by r+g+b.
+    QVector<int> sortedSums;
+    QVector<int> sortedIndexes;
+    //0 if not filled yet, index+1 if the cell has one nearest color, -1 otherwise.
+    QVector<QAtomicInt> cells;
+    QAtomicInt *cellData;
+};
+
+class QGifColorMapper
+{
+public:
+    explicit QGifColorMapper(const QVector<QRgb> &colorTable, int transparentIndex = -1);
+
+    QVector<QRgb> colorTable() const;
+    bool isTransparent(QRgb color) const;
+    int nearestIndex(QRgb color) const;
+    int nearestOpaqueIndex(QRgb color) const;
+    QImage map(const QImage &image) const;
+
+private:
+    QVector<QRgb> table;
+    int transparentIndex;
+    QSharedPointer<QGifColorLookup> lookup;
+};
+
+class QGifOctreeQuantizer : public QGifQuantizer
+{
+public:
+    QVector<QRgb> colorTable(const QVector<QRgb> &colors, const QVector<quint32> &counts,
+                             int maxColors) const;
+};
+
+class QGifMedianCutQuantizer : public QGifQuantizer
+{
+public:
+    QVector<QRgb> colorTable(const QVector<QRgb> &colors, const QVector<quint32> &counts,
+                             int maxColors) const;
+};
+
+class QGifKMeansQuantizer : public QGifQuantizer
+{
+public:
+    QGifKMeansQuantizer();
+
+    QVector<QRgb> colorTable(const QVector<QRgb> &colors, const QVector<quint32> &counts,
+                             int maxColors) const;
+
+    int maxIterations;
+};
+
+#endif // QGIFQUANTIZER_P_H
@@ -1,15 +1,20 @@
 INCLUDEPATH += $$PWD
 DEPENDPATH += $$PWD
 
-QT += core gui
+QT += core gui concurrent
 !build_gifimage_lib:DEFINES += GIFIMAGE_NO_LIB
 
 include($$PWD/../3rdParty/giflib.pri)
 
 HEADERS += \
+    $$PWD/qgifdither_p.h \
     $$PWD/qgifglobal.h \
     $$PWD/qgifimage.h \
-    $$PWD/qgifimage_p.h
+    $$PWD/qgifimage_p.h \
+    $$PWD/qgifquantizer.h \
+    $$PWD/qgifquantizer_p.h
 
 SOURCES += \ 
-    $$PWD/qgifimage.cpp
+    $$PWD/qgifdither.cpp \
+    $$PWD/qgifimage.cpp \
+    $$PWD/qgifquantizer.cpp
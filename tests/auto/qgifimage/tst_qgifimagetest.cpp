@@ -1,5 +1,9 @@
 #include "qgifimage.h"
+#include "qgifquantizer.h"
+#include <QBuffer>
 #include <QPainter>
+#include <QTemporaryFile>
+#include <QThreadPool>
 #include <QtTest>
 
 class QGifimageTest : public QObject
@@ -11,10 +15,43 @@ public:
 
 private Q_SLOTS:
     void testGifFileLoad();
+    void testQuantizer_data();
+    void testQuantizer();
+    void testColorLookup_data();
+    void testColorLookup();
+    void testDitherMode_data();
+    void testDitherMode();
+    void testDitherThreadCount_data();
+    void testDitherThreadCount();
+    void testAutoGlobalColorTable();
+    void testPaletteReuse();
+    void testPaletteGroups();
+    void testCompactColorTable();
+    void testReorderColorTable();
+    void testSaveToFile();
+    void testSaveAllocations();
+    void testIncrementalSave();
+    void testInterlace();
+    void testMergeDuplicateFrames();
+    void testAutoDisposalMode();
+    void testTargetSize();
+    void testCompressionLevel();
+    void testBestCompression();
+    void testClearPolicy();
+    void testParallelCompression();
+    void testParallelDecoding();
+    void testTruncatedFile();
+    void testCodeBlocks_data();
+    void testCodeBlocks();
+    void testLineLengths_data();
+    void testLineLengths();
+    void testCodeSizes_data();
+    void testCodeSizes();
 
 private:
     QImage rgbImage;
     QImage indexed8Image;
+    QImage patternImage;
     QGifImage gifImage;
 };
 
@@ -29,14 +66,881 @@ QGifimageTest::QGifimageTest()
     rgbImage = image;
     indexed8Image = image.convertToFormat(QImage::Format_Indexed8);
 
+    //A pattern of 64 colors which fills the LZW string table many times.
+    patternImage = QImage(1024, 1024, QImage::Format_Indexed8);
+    QVector<QRgb> colorTable;
+    for (int idx = 0; idx < 64; ++idx)
+        colorTable.append(qRgb(idx * 4, 255 - idx * 4, idx * 2));
+    patternImage.setColorTable(colorTable);
+    for (int y = 0; y < patternImage.height(); ++y) {
+        for (int x = 0; x < patternImage.width(); ++x)
+            patternImage.scanLine(y)[x] = ((x ^ y) + (x * y) % 7) % 64;
+    }
+
     gifImage.load(SRCDIR"test.gif");
 }
 
+/*
+    Return the file written by \a gif, or an empty array if the save failed.
+ */
+static QByteArray saveToData(const QGifImage &gif)
+{
+    QBuffer buffer;
+    buffer.open(QIODevice::WriteOnly);
+    if (!gif.save(&buffer))
+        return QByteArray();
+    return buffer.data();
+}
+
+/*
+    Load the file \a data into \a gif, return whether it succeeded.
+ */
+static bool loadFromData(QGifImage *gif, QByteArray data)
+{
+    QBuffer buffer(&data);
+    buffer.open(QIODevice::ReadOnly);
+    return gif->load(&buffer);
+}
+
+/*
+    Return the first frame of the file \a data as an RGB32 image, or a null
+    image if the file cannot be loaded.
+ */
+static QImage loadFirstFrame(QByteArray data, bool parallelDecoding = false)
+{
+    QGifImage gif;
+    gif.setParallelDecoding(parallelDecoding);
+    if (!loadFromData(&gif, data))
+        return QImage();
+    return gif.frame(0).convertToFormat(QImage::Format_RGB32);
+}
+
 void QGifimageTest::testGifFileLoad()
 {
     QVERIFY2(true, "Failure");
 }
 
+void QGifimageTest::testQuantizer_data()
+{
+    QTest::addColumn<int>("method");
+
+    QTest::newRow("Octree") << int(QGifQuantizer::Octree);
+    QTest::newRow("MedianCut") << int(QGifQuantizer::MedianCut);
+    QTest::newRow("KMeans") << int(QGifQuantizer::KMeans);
+}
+
+void QGifimageTest::testQuantizer()
+{
+    QFETCH(int, method);
+    QScopedPointer<QGifQuantizer> quantizer(QGifQuantizer::create(QGifQuantizer::Method(method)));
+
+    //Few colors, the image should not be changed.
+    QImage image = quantizer->quantize(rgbImage);
+    QCOMPARE(image.format(), QImage::Format_Indexed8);
+    QCOMPARE(image.convertToFormat(QImage::Format_RGB32), rgbImage);
+
+    QImage gradient(256, 64, QImage::Format_RGB32);
+    for (int y = 0; y < gradient.height(); ++y) {
+        for (int x = 0; x < gradient.width(); ++x)
+            gradient.setPixel(x, y, qRgb(x, y * 4, 255 - x));
+    }
+    image = quantizer->quantize(gradient, 16);
+    QCOMPARE(image.format(), QImage::Format_Indexed8);
+    QVERIFY(image.colorCount() <= 16);
+    QVERIFY(image.colorCount() > 1);
+}
+
+void QGifimageTest::testColorLookup_data()
+{
+    QTest::addColumn<int>("colorCount");
+    QTest::addColumn<bool>("transparent");
+
+    QTest::newRow("64 colors") << 64 << false;
+    QTest::newRow("200 colors") << 200 << false;
+    QTest::newRow("64 colors, transparent") << 64 << true;
+    QTest::newRow("200 colors, transparent") << 200 << true;
+}
+
+void QGifimageTest::testColorLookup()
+{
+    QFETCH(int, colorCount);
+    QFETCH(bool, transparent);
+
+    quint32 seed = colorCount;
+    QVector<QRgb> colorTable;
+    for (int idx = 0; idx < colorCount; ++idx) {
+        seed = seed * 1103515245 + 12345;
+        colorTable.append(qRgb(seed >> 24, seed >> 16, seed >> 8));
+    }
+    QImage image(128, 64, QImage::Format_RGB32);
+    for (int y = 0; y < image.height(); ++y) {
+        for (int x = 0; x < image.width(); ++x) {
+            seed = seed * 1103515245 + 12345;
+            image.setPixel(x, y, qRgb(seed >> 24, seed >> 16, seed >> 8));
+        }
+    }
+
+    QGifImage gif;
+    gif.setGlobalColorTable(colorTable);
+    int transIndex = -1;
+    if (transparent) {
+        transIndex = colorCount / 2;
+        gif.setDefaultTransparentColor(QColor(colorTable[transIndex]));
+    }
+    gif.addFrame(image);
+
+    QGifImage gif2;
+    QVERIFY(loadFromData(&gif2, saveToData(gif)));
+
+    //The cells give the nearest color of a linear search, the first one
+    //when several colors are at the same distance.
+    QImage frame = gif2.frame(0).convertToFormat(QImage::Format_RGB32);
+    for (int y = 0; y < image.height(); ++y) {
+        for (int x = 0; x < image.width(); ++x) {
+            QRgb color = image.pixel(x, y);
+            int nearestIndex = -1;
+            int minDistance = 3 * 256 * 256;
+            for (int idx = 0; idx < colorTable.size(); ++idx) {
+                int dr = qRed(color) - qRed(colorTable[idx]);
+                int dg = qGreen(color) - qGreen(colorTable[idx]);
+                int db = qBlue(color) - qBlue(colorTable[idx]);
+                int distance = dr * dr + dg * dg + db * db;
+                if (idx != transIndex && distance < minDistance) {
+                    minDistance = distance;
+                    nearestIndex = idx;
+                }
+            }
+            QCOMPARE(frame.pixel(x, y), colorTable[nearestIndex]);
+        }
+    }
+}
+
+void QGifimageTest::testDitherMode_data()
+{
+    QTest::addColumn<int>("mode");
+
+    QTest::newRow("OrderedDither") << int(QGifImage::OrderedDither);
+    QTest::newRow("BlueNoiseDither") << int(QGifImage::BlueNoiseDither);
+    QTest::newRow("FloydSteinbergDither") << int(QGifImage::FloydSteinbergDither);
+    QTest::newRow("SierraDither") << int(QGifImage::SierraDither);
+}
+
+void QGifimageTest::testDitherMode()
+{
+    QFETCH(int, mode);
+
+    QImage gray(64, 64, QImage::Format_RGB32);
+    gray.fill(qRgb(96, 96, 96));
+
+    QGifImage gif;
+    gif.setGlobalColorTable(QVector<QRgb>() << qRgb(0, 0, 0) << qRgb(255, 255, 255));
+    gif.setDitherMode(QGifImage::DitherMode(mode));
+    gif.addFrame(gray);
+
+    QGifImage gif2;
+    QVERIFY(loadFromData(&gif2, saveToData(gif)));
+
+    //The mean level of the dithered frame should be close to the source.
+    QImage frame = gif2.frame(0).convertToFormat(QImage::Format_RGB32);
+    int sum = 0;
+    for (int y = 0; y < frame.height(); ++y) {
+        for (int x = 0; x < frame.width(); ++x)
+            sum += qGray(frame.pixel(x, y));
+    }
+    QVERIFY(qAbs(sum / (frame.width() * frame.height()) - 96) < 16);
+}
+
+void QGifimageTest::testDitherThreadCount_data()
+{
+    QTest::addColumn<int>("mode");
+
+    QTest::newRow("FloydSteinbergDither") << int(QGifImage::FloydSteinbergDither);
+    QTest::newRow("SierraDither") << int(QGifImage::SierraDither);
+}
+
+void QGifimageTest::testDitherThreadCount()
+{
+    QFETCH(int, mode);
+
+    QImage gradient(512, 256, QImage::Format_RGB32);
+    for (int y = 0; y < gradient.height(); ++y) {
+        for (int x = 0; x < gradient.width(); ++x)
+            gradient.setPixel(x, y, qRgb(x / 2, y, (x + y) % 256));
+    }
+    QVector<QRgb> colorTable;
+    for (int idx = 0; idx < 16; ++idx)
+        colorTable.append(qRgb((idx & 3) * 85, ((idx >> 2) & 3) * 85, idx * 17));
+
+    //The rows diffused by one thread, or by several ones working on
+    //overlapping rows, give the same pixels.
+    QThreadPool *pool = QThreadPool::globalInstance();
+    int maxThreadCount = pool->maxThreadCount();
+    QByteArray data[2];
+    for (int pass = 0; pass < 2; ++pass) {
+        QGifImage gif;
+        gif.setGlobalColorTable(colorTable);
+        gif.setDitherMode(QGifImage::DitherMode(mode));
+        gif.addFrame(gradient);
+
+        pool->setMaxThreadCount(pass ? maxThreadCount : 1);
+        data[pass] = saveToData(gif);
+        pool->setMaxThreadCount(maxThreadCount);
+        QVERIFY(!data[pass].isEmpty());
+    }
+    QCOMPARE(data[1], data[0]);
+}
+
+void QGifimageTest::testAutoGlobalColorTable()
+{
+    QImage greenImage = rgbImage;
+    greenImage.fill(QColor(Qt::green));
+
+    QGifImage gif;
+    QVERIFY(!gif.autoGlobalColorTable());
+    gif.setAutoGlobalColorTable(true);
+    gif.addFrame(rgbImage);
+    gif.addFrame(greenImage);
+
+    QGifImage gif2;
+    QVERIFY(loadFromData(&gif2, saveToData(gif)));
+
+    //One color table is built from the colors of both frames.
+    QCOMPARE(gif2.frameCount(), 2);
+    QVERIFY(!gif2.globalColorTable().isEmpty());
+    QCOMPARE(gif2.frame(0).convertToFormat(QImage::Format_RGB32), rgbImage);
+    QCOMPARE(gif2.frame(1).convertToFormat(QImage::Format_RGB32), greenImage);
+}
+
+void QGifimageTest::testPaletteReuse()
+{
+    QGifImage gif;
+    gif.setPaletteReuseTolerance(1);
+    gif.addFrame(rgbImage);
+    gif.addFrame(rgbImage);
+
+    QGifImage gif2;
+    QVERIFY(loadFromData(&gif2, saveToData(gif)));
+
+    //The color table of the first frame is written once, as the global one.
+    QCOMPARE(gif2.frameCount(), 2);
+    QVERIFY(!gif2.globalColorTable().isEmpty());
+    QCOMPARE(gif2.frame(1).convertToFormat(QImage::Format_RGB32), rgbImage);
+}
+
+void QGifimageTest::testPaletteGroups()
+{
+    QImage greenImage = rgbImage;
+    greenImage.fill(QColor(Qt::green));
+
+    QGifImage gif;
+    gif.setPaletteGroupCount(2);
+    gif.addFrame(rgbImage);
+    gif.addFrame(greenImage);
+    gif.addFrame(rgbImage);
+
+    QGifImage gif2;
+    QVERIFY(loadFromData(&gif2, saveToData(gif)));
+
+    QCOMPARE(gif2.frameCount(), 3);
+    QCOMPARE(gif2.frame(0).colorTable(), gif2.frame(2).colorTable());
+    QVERIFY(gif2.frame(0).colorTable() != gif2.frame(1).colorTable());
+    QCOMPARE(gif2.frame(1).convertToFormat(QImage::Format_RGB32), greenImage);
+}
+
+void QGifimageTest::testCompactColorTable()
+{
+    QVector<QRgb> colorTable;
+    for (int idx = 0; idx < 256; ++idx)
+        colorTable.append(qRgb(idx, 255 - idx, 128));
+    colorTable[10] = qRgb(255, 0, 0);
+    colorTable[100] = qRgb(0, 0, 255);
+
+    QGifImage gif;
+    gif.addFrame(rgbImage.convertToFormat(QImage::Format_Indexed8, colorTable));
+
+    QGifImage gif2;
+    QVERIFY(loadFromData(&gif2, saveToData(gif)));
+
+    //Only the two used colors are written.
+    QCOMPARE(gif2.frame(0).colorTable().size(), 2);
+    QCOMPARE(gif2.frame(0).convertToFormat(QImage::Format_RGB32), rgbImage);
+}
+
+void QGifimageTest::testReorderColorTable()
+{
+    QImage image(40, 8, QImage::Format_Indexed8);
+    QVector<QRgb> colorTable;
+    for (int idx = 0; idx < 8; ++idx)
+        colorTable.append(qRgb(idx * 32, 255 - idx * 32, 128));
+    image.setColorTable(colorTable);
+    for (int y = 0; y < image.height(); ++y) {
+        for (int x = 0; x < image.width(); ++x)
+            image.scanLine(y)[x] = (x * y + x) % 5 + 2;
+    }
+    //Two indexes past the color table, one remapped 16 pixels at once
+    //and one in the tail of the line.
+    image.scanLine(0)[2] = 19;
+    image.scanLine(0)[37] = 19;
+
+    QGifImage gif;
+    gif.setReorderColorTable(true);
+    gif.addFrame(image);
+
+    QGifImage gif2;
+    QVERIFY(loadFromData(&gif2, saveToData(gif)));
+
+    //The unused colors are dropped and the most used one comes first.
+    QImage frame = gif2.frame(0);
+    QCOMPARE(frame.colorTable().first(), colorTable[2]);
+    QCOMPARE(frame.pixelIndex(2, 0), frame.pixelIndex(37, 0));
+    for (int y = 0; y < image.height(); ++y) {
+        for (int x = 0; x < image.width(); ++x) {
+            if (image.pixelIndex(x, y) < colorTable.size())
+                QCOMPARE(frame.pixel(x, y), image.pixel(x, y));
+        }
+    }
+}
+
+void QGifimageTest::testSaveToFile()
+{
+    //Random pixels, so that the file takes several blocks of the write buffer.
+    QImage noise(512, 512, QImage::Format_Indexed8);
+    QVector<QRgb> colorTable;
+    for (int idx = 0; idx < 256; ++idx)
+        colorTable.append(qRgb(idx, idx / 2, 255 - idx));
+    noise.setColorTable(colorTable);
+    quint32 seed = 1;
+    for (int y = 0; y < noise.height(); ++y) {
+        for (int x = 0; x < noise.width(); ++x) {
+            seed = seed * 1103515245 + 12345;
+            noise.scanLine(y)[x] = seed >> 24;
+        }
+    }
+
+    QGifImage gif;
+    gif.addFrame(rgbImage);
+    gif.addFrame(noise);
+
+    QBuffer buffer;
+    QVERIFY(!gif.save(&buffer));
+    buffer.open(QIODevice::ReadOnly);
+    QVERIFY(!gif.save(&buffer));
+    buffer.close();
+    buffer.open(QIODevice::WriteOnly);
+    QVERIFY(gif.save(&buffer));
+    QVERIFY(buffer.size() > 3 * 65536);
+    QGifImage gif2;
+    QVERIFY(!gif2.load(&buffer));
+
+    //The file is written by large blocks, while the memory of the buffer
+    //is reserved first. Both get the same bytes.
+    QTemporaryFile file;
+    QVERIFY(file.open());
+    file.close();
+    QVERIFY(gif.save(file.fileName()));
+    QVERIFY(file.open());
+    QCOMPARE(file.readAll(), buffer.data());
+
+    //Once the frames are encoded, the memory reserved fits the file.
+    QBuffer buffer2;
+    buffer2.open(QIODevice::WriteOnly);
+    QVERIFY(gif.save(&buffer2));
+    QCOMPARE(buffer2.data(), buffer.data());
+    QVERIFY(buffer2.buffer().capacity() >= buffer2.size());
+    QVERIFY(buffer2.buffer().capacity() < buffer2.size() + 4096);
+}
+
+void QGifimageTest::testSaveAllocations()
+{
+    QGifImage gif;
+    gif.setPaletteGroupCount(2);
+    gif.addFrame(rgbImage);
+    gif.addFrame(indexed8Image);
+    QVERIFY(!saveToData(gif).isEmpty());
+
+    //Everything giflib allocated has been freed.
+    QVERIFY(gif.lastSaveBytesAllocated() > 0);
+    QCOMPARE(gif.lastSaveBytesFreed(), gif.lastSaveBytesAllocated());
+
+    //The strips compressed by other threads allocate a string table each,
+    //which is counted too.
+    QGifImage gif2;
+    gif2.addFrame(rgbImage.scaled(1024, 1024));
+    QVERIFY(!saveToData(gif2).isEmpty());
+    qint64 serialBytesAllocated = gif2.lastSaveBytesAllocated();
+    gif2.setParallelCompression(true);
+    QVERIFY(!saveToData(gif2).isEmpty());
+    QCOMPARE(gif2.lastSaveBytesFreed(), gif2.lastSaveBytesAllocated());
+    if (QThread::idealThreadCount() > 1)
+        QVERIFY(gif2.lastSaveBytesAllocated() > serialBytesAllocated);
+}
+
+void QGifimageTest::testIncrementalSave()
+{
+    QImage greenImage = rgbImage;
+    greenImage.fill(QColor(Qt::green));
+
+    QGifImage gif;
+    gif.setPaletteReuseTolerance(1);
+    gif.addFrame(rgbImage);
+    gif.addFrame(greenImage);
+    QVERIFY(!saveToData(gif).isEmpty());
+
+    //The frames changed after a save must be encoded again, and give the
+    //same file as if nothing had been saved before.
+    gif.setFrameDelay(1, 500);
+    gif.insertFrame(1, rgbImage);
+    QByteArray data = saveToData(gif);
+    QVERIFY(!data.isEmpty());
+
+    QGifImage gif2;
+    gif2.setPaletteReuseTolerance(1);
+    gif2.addFrame(rgbImage);
+    gif2.addFrame(rgbImage);
+    gif2.addFrame(greenImage, 500);
+    QCOMPARE(data, saveToData(gif2));
+}
+
+/*
+    Return a GIF file of the indexed \a image, with 1 << \a codeSize colors
+    and LZW codes starting at \a codeSize + 1 bits, its rows stored in
+    interlaced order if \a interlaced. The codes are all literal ones, with a
+    clear code every 128 codes, and get longer as the string table grows.
+ */
+static QByteArray literalGif(const QImage &image, int codeSize, bool interlaced)
+{
+    int clearCode = 1 << codeSize;
+    QByteArray data("GIF89a");
+    data.append(char(image.width())).append(char(image.width() >> 8));
+    data.append(char(image.height())).append(char(image.height() >> 8));
+    data.append(char(0xf0 | (codeSize - 1))).append(char(0)).append(char(0));
+    for (int idx = 0; idx < clearCode; ++idx) {
+        QRgb color = image.color(idx);
+        data.append(char(qRed(color))).append(char(qGreen(color))).append(char(qBlue(color)));
+    }
+    data.append(',').append(QByteArray(4, 0));
+    data.append(char(image.width())).append(char(image.width() >> 8));
+    data.append(char(image.height())).append(char(image.height() >> 8));
+    data.append(char(interlaced ? 0x40 : 0)).append(char(codeSize));
+
+    QVector<int> codes;
+    static const int interlacedOffset[] = { 0, 4, 2, 1 };
+    static const int interlacedJumps[] = { 8, 8, 4, 2 };
+    for (int pass = 0; pass < (interlaced ? 4 : 1); ++pass) {
+        for (int y = interlaced ? interlacedOffset[pass] : 0; y < image.height();
+             y += interlaced ? interlacedJumps[pass] : 1) {
+            for (int x = 0; x < image.width(); ++x) {
+                if (codes.size() % 128 == 0)
+                    codes.append(clearCode);
+                codes.append(image.pixelIndex(x, y));
+            }
+        }
+    }
+    codes.append(clearCode + 1);
+
+    //As in giflib, the codes get one bit longer when the count of codes
+    //since the clear, the first one included, passes the largest code.
+    QByteArray bytes;
+    quint32 bits = 0;
+    int bitCount = 0;
+    int codeBits = codeSize + 1;
+    int readCode = clearCode + 2;
+    foreach (int code, codes) {
+        bits |= code << bitCount;
+        for (bitCount += codeBits; bitCount >= 8; bitCount -= 8, bits >>= 8)
+            bytes.append(char(bits));
+        if (code == clearCode) {
+            codeBits = codeSize + 1;
+            readCode = clearCode + 2;
+        } else if (++readCode > (1 << codeBits)) {
+            ++codeBits;
+        }
+    }
+    if (bitCount > 0)
+        bytes.append(char(bits));
+    for (int pos = 0; pos < bytes.size(); pos += 255) {
+        QByteArray block = bytes.mid(pos, 255);
+        data.append(char(block.size())).append(block);
+    }
+    data.append(char(0)).append(';');
+    return data;
+}
+
+void QGifimageTest::testInterlace()
+{
+    //Each row is different, so that a row written at the place of another
+    //one is found.
+    QImage image(1024, 512, QImage::Format_Indexed8);
+    QVector<QRgb> colorTable;
+    for (int idx = 0; idx < 256; ++idx)
+        colorTable.append(qRgb(idx, 255 - idx, idx / 2));
+    image.setColorTable(colorTable);
+    for (int y = 0; y < image.height(); ++y) {
+        for (int x = 0; x < image.width(); ++x)
+            image.scanLine(y)[x] = x < 512 ? (x + y) % 256 : (x + y / 256) % 256;
+    }
+
+    QGifImage gif;
+    QVERIFY(loadFromData(&gif, literalGif(image, 8, true)));
+    QCOMPARE(gif.frame(0).convertToFormat(QImage::Format_RGB32), image.convertToFormat(QImage::Format_RGB32));
+
+    //The frame is saved interlaced too, in one piece or in strips.
+    for (int parallel = 0; parallel < 2; ++parallel) {
+        gif.setParallelCompression(parallel);
+        QCOMPARE(loadFirstFrame(saveToData(gif)), image.convertToFormat(QImage::Format_RGB32));
+    }
+}
+
+void QGifimageTest::testMergeDuplicateFrames()
+{
+    QImage greenImage = rgbImage;
+    greenImage.fill(QColor(Qt::green));
+
+    QGifImage gif;
+    gif.setMergeDuplicateFrames(true);
+    gif.addFrame(rgbImage, 100);
+    gif.addFrame(rgbImage.copy(), 200);
+    gif.addFrame(greenImage, 50);
+    gif.addFrame(greenImage, 400000);
+    gif.addFrame(greenImage, 400000);
+
+    QGifImage gif2;
+    QVERIFY(loadFromData(&gif2, saveToData(gif)));
+
+    //The delay of the last frame does not fit in one graphics control block.
+    QCOMPARE(gif2.frameCount(), 3);
+    QCOMPARE(gif2.frameDelay(0), 300);
+    QCOMPARE(gif2.frameDelay(1), 655350);
+    QCOMPARE(gif2.frameDelay(2), 144700);
+    QCOMPARE(gif2.frame(1).convertToFormat(QImage::Format_RGB32), greenImage);
+}
+
+void QGifimageTest::testAutoDisposalMode()
+{
+    QGifImage gif;
+    gif.setAutoDisposalMode(true);
+    gif.addFrame(rgbImage);
+    for (int idx = 0; idx < 3; ++idx) {
+        QImage image = rgbImage;
+        QPainter p(&image);
+        p.fillRect(10 + idx * 25, 40, 10, 10, Qt::green);
+        p.end();
+        gif.addFrame(image);
+    }
+
+    QGifImage gif2;
+    QVERIFY(loadFromData(&gif2, saveToData(gif)));
+
+    //Only the moving square is written, and the canvas is restored under it.
+    //The disposal modes of the frames themselves are left as they were.
+    QCOMPARE(gif.frameDisposalMode(1), QGifImage::UnspecifiedDisposal);
+    QCOMPARE(gif2.frameCount(), 4);
+    QCOMPARE(gif2.frameDisposalMode(0), QGifImage::DoNotDispose);
+    QCOMPARE(gif2.frameDisposalMode(1), QGifImage::DisposeToPrevious);
+    QCOMPARE(gif2.frameOffset(2), QPoint(35, 40));
+    QCOMPARE(gif2.frame(2).size(), QSize(10, 10));
+}
+
+void QGifimageTest::testTargetSize()
+{
+    QGifImage gif;
+    gif.setQuantizer(QGifQuantizer::create(QGifQuantizer::MedianCut));
+    for (int idx = 0; idx < 8; ++idx) {
+        QImage image(120, 100, QImage::Format_RGB32);
+        for (int y = 0; y < image.height(); ++y) {
+            for (int x = 0; x < image.width(); ++x) {
+                int noise = (x * 7 + y * 13 + idx * 5) % 24;
+                image.setPixel(x, y, qRgb((x * 2 + idx * 3 + noise) & 0xff, (y * 2 + noise) & 0xff, (x + y) & 0xff));
+            }
+        }
+        gif.addFrame(image, 100);
+    }
+
+    QByteArray data = saveToData(gif);
+    QVERIFY(!data.isEmpty());
+    qint64 fullSize = data.size();
+
+    //The settings of the image are not changed by the search.
+    gif.setTargetSize(fullSize / 3);
+    QByteArray data2 = saveToData(gif);
+    QVERIFY(!data2.isEmpty());
+    QVERIFY(data2.size() <= fullSize / 3);
+    QCOMPARE(gif.lossyLevel(), 0);
+    QCOMPARE(gif.maxColorCount(), 256);
+    QCOMPARE(gif.frameDropCount(), 0);
+
+    QGifImage gif2;
+    QVERIFY(loadFromData(&gif2, data2));
+    int duration = 0;
+    for (int idx = 0; idx < gif2.frameCount(); ++idx)
+        duration += gif2.frameDelay(idx);
+    QCOMPARE(duration, 800);
+}
+
+void QGifimageTest::testCompressionLevel()
+{
+    QGifImage gif;
+    gif.addFrame(indexed8Image);
+    QCOMPARE(gif.compressionLevel(), QGifImage::NormalCompression);
+    QByteArray data = saveToData(gif);
+    QVERIFY(!data.isEmpty());
+
+    //The literal codes take more room, and decode to the same pixels.
+    gif.setCompressionLevel(QGifImage::FastestCompression);
+    QByteArray data2 = saveToData(gif);
+    QVERIFY(data2.size() > data.size());
+    QImage frame = loadFirstFrame(data);
+    QVERIFY(!frame.isNull());
+    QCOMPARE(loadFirstFrame(data2), frame);
+}
+
+void QGifimageTest::testBestCompression()
+{
+    QImage image = patternImage.copy(0, 0, 200, 150);
+    QGifImage gif;
+    gif.addFrame(image);
+    QByteArray data = saveToData(gif);
+    QVERIFY(!data.isEmpty());
+
+    gif.setCompressionLevel(QGifImage::BestCompression);
+    QByteArray data2 = saveToData(gif);
+    QVERIFY(!data2.isEmpty());
+    QVERIFY(data2.size() <= data.size());
+    QCOMPARE(gif.lastSaveBytesAllocated(), gif.lastSaveBytesFreed());
+    QCOMPARE(loadFirstFrame(data2), image.convertToFormat(QImage::Format_RGB32));
+}
+
+void QGifimageTest::testClearPolicy()
+{
+    QImage image = patternImage.copy(0, 0, 400, 300);
+    QGifImage gif;
+    gif.addFrame(image);
+    QCOMPARE(gif.clearPolicy(), QGifImage::FixedClear);
+    QCOMPARE(gif.frameCompressionRatio(0), qreal(0));
+
+    //The string table fills up several times, each policy must still
+    //decode to the same pixels.
+    for (int policy = QGifImage::FixedClear; policy <= QGifImage::RatioDropClear; ++policy) {
+        gif.setClearPolicy(QGifImage::ClearPolicy(policy));
+        QByteArray data = saveToData(gif);
+        QVERIFY(!data.isEmpty());
+        QVERIFY(gif.frameCompressionRatio(0) > 0);
+        QCOMPARE(loadFirstFrame(data), image.convertToFormat(QImage::Format_RGB32));
+    }
+}
+
+void QGifimageTest::testParallelCompression()
+{
+    QGifImage gif;
+    gif.addFrame(patternImage);
+    QVERIFY(!gif.parallelCompression());
+    gif.setParallelCompression(true);
+
+    //The strips are joined at any bit, whatever the size of their codes.
+    for (int level = QGifImage::FastestCompression; level <= QGifImage::BestCompression; ++level) {
+        gif.setCompressionLevel(QGifImage::CompressionLevel(level));
+        QByteArray data = saveToData(gif);
+        QVERIFY(!data.isEmpty());
+        QCOMPARE(gif.lastSaveBytesAllocated(), gif.lastSaveBytesFreed());
+        QCOMPARE(loadFirstFrame(data), patternImage.convertToFormat(QImage::Format_RGB32));
+    }
+}
+
+void QGifimageTest::testParallelDecoding()
+{
+    QVERIFY(!QGifImage().parallelDecoding());
+
+    //The string table is cleared many times with FixedClear, and never
+    //with DeferredClear, which leaves no segment to start from.
+    for (int policy = QGifImage::FixedClear; policy <= QGifImage::DeferredClear; ++policy) {
+        QGifImage gif;
+        gif.setClearPolicy(QGifImage::ClearPolicy(policy));
+        gif.addFrame(patternImage);
+        QByteArray data = saveToData(gif);
+        QVERIFY(!data.isEmpty());
+        QCOMPARE(loadFirstFrame(data, true), patternImage.convertToFormat(QImage::Format_RGB32));
+    }
+}
+
+void QGifimageTest::testTruncatedFile()
+{
+    QImage image = patternImage.copy(100, 100, 48, 64);
+    QGifImage gif;
+    gif.addFrame(patternImage.copy(0, 0, 64, 48));
+    gif.addFrame(rgbImage);
+    gif.addFrame(image);
+    QByteArray data = saveToData(gif);
+    QVERIFY(!data.isEmpty());
+
+    for (int parallel = 0; parallel < 2; ++parallel) {
+        //The codes of a frame are read ahead up to their empty block, the
+        //next frames must still be found.
+        QGifImage gif2;
+        gif2.setParallelDecoding(parallel);
+        QVERIFY(loadFromData(&gif2, data));
+        QCOMPARE(gif2.frameCount(), 3);
+        QCOMPARE(gif2.frame(2).convertToFormat(QImage::Format_RGB32), image.convertToFormat(QImage::Format_RGB32));
+
+        //A file cut anywhere must fail to load.
+        for (int size = 0; size < data.size(); ++size)
+            QVERIFY(loadFirstFrame(data.left(size), parallel).isNull());
+    }
+}
+
+/*
+    Return the sizes of the sub-blocks holding the codes of the first frame
+    of the file \a data, up to and including the empty block.
+ */
+static QList<int> codeBlockSizes(const QByteArray &data)
+{
+    QList<int> sizes;
+    int pos = 13;
+    if (data.size() < pos)
+        return sizes;
+    uchar flags = data.at(10);
+    if (flags & 0x80)
+        pos += 3 << ((flags & 7) + 1);
+    while (pos < data.size() && uchar(data.at(pos)) == 0x21) {
+        pos += 2;
+        while (pos < data.size() && data.at(pos))
+            pos += uchar(data.at(pos)) + 1;
+        ++pos;
+    }
+    if (pos + 10 >= data.size() || uchar(data.at(pos)) != 0x2C)
+        return sizes;
+    flags = data.at(pos + 9);
+    pos += 10;
+    if (flags & 0x80)
+        pos += 3 << ((flags & 7) + 1);
+    for (++pos; pos < data.size(); pos += sizes.last() + 1) {
+        sizes.append(uchar(data.at(pos)));
+        if (!sizes.last())
+            break;
+    }
+    return sizes;
+}
+
+void QGifimageTest::testCodeBlocks_data()
+{
+    QTest::addColumn<int>("width");
+    QTest::addColumn<int>("height");
+
+    QTest::newRow("1x1") << 1 << 1;
+    QTest::newRow("16x16") << 16 << 16;
+    QTest::newRow("1024x1024") << 1024 << 1024;
+}
+
+void QGifimageTest::testCodeBlocks()
+{
+    QFETCH(int, width);
+    QFETCH(int, height);
+
+    QImage image = patternImage.copy(0, 0, width, height);
+    QGifImage gif;
+    gif.addFrame(image);
+    for (int parallel = 0; parallel < 2; ++parallel) {
+        gif.setParallelCompression(parallel);
+        for (int level = QGifImage::FastestCompression; level <= QGifImage::BestCompression; ++level) {
+            gif.setCompressionLevel(QGifImage::CompressionLevel(level));
+            QByteArray data = saveToData(gif);
+            QVERIFY(!data.isEmpty());
+
+            //The codes are staged and cut into blocks when flushed, all
+            //blocks but the last one must still be full.
+            QList<int> sizes = codeBlockSizes(data);
+            QVERIFY(sizes.size() >= 2);
+            QCOMPARE(sizes.last(), 0);
+            QVERIFY(sizes.at(sizes.size() - 2) > 0);
+            for (int idx = 0; idx < sizes.size() - 2; ++idx)
+                QCOMPARE(sizes.at(idx), 255);
+            if (width * height > 255 * 32 * 2)
+                QVERIFY(sizes.size() > 32 * 2);
+            QCOMPARE(loadFirstFrame(data), image.convertToFormat(QImage::Format_RGB32));
+        }
+    }
+}
+
+void QGifimageTest::testLineLengths_data()
+{
+    QTest::addColumn<int>("width");
+
+    QTest::newRow("1") << 1;
+    QTest::newRow("3") << 3;
+    QTest::newRow("7") << 7;
+    QTest::newRow("333") << 333;
+}
+
+void QGifimageTest::testLineLengths()
+{
+    QFETCH(int, width);
+
+    QImage image = patternImage.copy(0, 0, width, 97);
+    QVector<QRgb> colorTable = image.colorTable();
+    colorTable.resize(256);
+    image.setColorTable(colorTable);
+
+    QGifImage gif;
+    QVERIFY(loadFromData(&gif, literalGif(image, 8, true)));
+
+    //An interlaced frame is decoded a row at a time, so the strings of
+    //its codes are cut at the end of each row and finished on the next.
+    QByteArray data = saveToData(gif);
+    QVERIFY(!data.isEmpty());
+    for (int parallel = 0; parallel < 2; ++parallel)
+        QCOMPARE(loadFirstFrame(data, parallel), image.convertToFormat(QImage::Format_RGB32));
+}
+
+void QGifimageTest::testCodeSizes_data()
+{
+    QTest::addColumn<int>("colorCount");
+
+    QTest::newRow("1 bit") << 2;
+    QTest::newRow("2 bits") << 4;
+    QTest::newRow("3 bits") << 8;
+    QTest::newRow("4 bits") << 16;
+    QTest::newRow("5 bits") << 32;
+    QTest::newRow("7 bits") << 128;
+    QTest::newRow("8 bits") << 256;
+}
+
+void QGifimageTest::testCodeSizes()
+{
+    QFETCH(int, colorCount);
+
+    QImage image(256, 200, QImage::Format_Indexed8);
+    QVector<QRgb> colorTable;
+    for (int idx = 0; idx < colorCount; ++idx)
+        colorTable.append(qRgb(idx, 255 - idx, idx / 2));
+    image.setColorTable(colorTable);
+    for (int y = 0; y < image.height(); ++y) {
+        for (int x = 0; x < image.width(); ++x)
+            image.scanLine(y)[x] = ((x ^ y) + (x * y) % 7) % colorCount;
+    }
+
+    QGifImage gif;
+    gif.addFrame(image);
+    QByteArray data = saveToData(gif);
+    QVERIFY(!data.isEmpty());
+
+    //The frame is decoded by the kernel for its code size, 2, 4 and 8 bits
+    //ones have their own, the other sizes use the generic one.
+    for (int parallel = 0; parallel < 2; ++parallel) {
+        QGifImage gif2;
+        gif2.setParallelDecoding(parallel);
+        QVERIFY(loadFromData(&gif2, data));
+        QCOMPARE(gif2.frame(0).colorCount(), colorCount);
+        QCOMPARE(gif2.frame(0).convertToFormat(QImage::Format_RGB32), image.convertToFormat(QImage::Format_RGB32));
+    }
+
+    //Other encoders write 1 bit pixels with 2 bits codes, whose codes get
+    //longer right after the first one, and the segments must agree.
+    if (colorCount == 2) {
+        QByteArray data2 = literalGif(image, 1, false);
+        for (int parallel = 0; parallel < 2; ++parallel)
+            QCOMPARE(loadFirstFrame(data2, parallel), image.convertToFormat(QImage::Format_RGB32));
+    }
+}
+
 QTEST_MAIN(QGifimageTest)
 
 #include "tst_qgifimagetest.moc"